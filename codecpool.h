@@ -0,0 +1,115 @@
+#ifndef __codecpool_h_
+#define __codecpool_h_
+
+#include "pdopus.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+#define CODECPOOL_SLAB_STATES 16
+#define CODECPOOL_SIZE_CLASSES 4
+#define CODECPOOL_ALIGNMENT 64
+
+/* Process-wide slabs of codec states. OPUS encoder and decoder states are
+   plain blocks of opus_*_get_size() bytes that opus_*_init() sets up in
+   place, so instead of a heap allocation per object they are carved from
+   slabs of CODECPOOL_SLAB_STATES states of the same size and recycled
+   through a free list threaded through the unused states. Slabs are kept
+   for the life of the process, and in the pdopus library the encoders and
+   decoders share them. Objects may run in Pd instances on
+   separate threads, so the pool is guarded by a mutex; it is only touched
+   on the message thread, never in perform. */
+
+typedef struct _codecslab
+{
+    size_t _stateSize;
+    void* _free;
+    int _allocated;
+    int _inUse;
+} CodecSlab;
+
+typedef struct _codecpool
+{
+    pthread_mutex_t _mutex;
+    CodecSlab _slabs[CODECPOOL_SIZE_CLASSES];
+} CodecPool;
+
+PDOPUS_SHARED(CodecPool codecPool, { PTHREAD_MUTEX_INITIALIZER });
+
+static inline size_t codecPoolStateSize(size_t size)
+{
+    return (size + CODECPOOL_ALIGNMENT - 1) & ~(size_t)(CODECPOOL_ALIGNMENT - 1);
+}
+
+// the slab for a state size, or 0 if all size classes are taken
+static inline CodecSlab* codecPoolSlab(size_t stateSize)
+{
+    for (int i = 0; i < CODECPOOL_SIZE_CLASSES; ++i)
+    {
+        CodecSlab* slab = &codecPool._slabs[i];
+        if (!slab->_stateSize)
+            slab->_stateSize = stateSize;
+        if (slab->_stateSize == stateSize)
+            return slab;
+    }
+    return 0;
+}
+
+static inline void* codecPoolAlloc(size_t size)
+{
+    size_t stateSize = codecPoolStateSize(size);
+    void* state = 0;
+
+    pthread_mutex_lock(&codecPool._mutex);
+    CodecSlab* slab = codecPoolSlab(stateSize);
+    if (slab && !slab->_free)
+    {
+        char* block = (char*)aligned_alloc(CODECPOOL_ALIGNMENT, CODECPOOL_SLAB_STATES * stateSize);
+        for (int i = CODECPOOL_SLAB_STATES - 1; block && i >= 0; --i)
+        {
+            *(void**)(block + i * stateSize) = slab->_free;
+            slab->_free = block + i * stateSize;
+        }
+        if (block)
+            slab->_allocated += CODECPOOL_SLAB_STATES;
+    }
+    if (slab && slab->_free)
+    {
+        state = slab->_free;
+        slab->_free = *(void**)state;
+        slab->_inUse++;
+    }
+    pthread_mutex_unlock(&codecPool._mutex);
+
+    return slab ? state : malloc(size);
+}
+
+static inline void codecPoolFree(void* state, size_t size)
+{
+    if (!state)
+        return;
+
+    pthread_mutex_lock(&codecPool._mutex);
+    CodecSlab* slab = codecPoolSlab(codecPoolStateSize(size));
+    if (slab)
+    {
+        *(void**)state = slab->_free;
+        slab->_free = state;
+        slab->_inUse--;
+    }
+    pthread_mutex_unlock(&codecPool._mutex);
+
+    if (!slab)
+        free(state);
+}
+
+// states handed out and allocated for one state size
+static inline void codecPoolUsage(size_t size, int* inUse, int* allocated)
+{
+    pthread_mutex_lock(&codecPool._mutex);
+    CodecSlab* slab = codecPoolSlab(codecPoolStateSize(size));
+    *inUse = slab ? slab->_inUse : 0;
+    *allocated = slab ? slab->_allocated : 0;
+    pthread_mutex_unlock(&codecPool._mutex);
+}
+
+#endif /* __codecpool_h_ */
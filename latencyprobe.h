@@ -0,0 +1,78 @@
+#ifndef __latencyprobe_h_
+#define __latencyprobe_h_
+
+#include "m_pd.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LATENCYPROBE_MAGIC "PDLT"
+#define LATENCYPROBE_SIZE 14
+#define LATENCYPROBE_PADDING (LATENCYPROBE_SIZE + 2)
+#define LATENCYPROBE_RATE 48000
+
+/* A timestamp side channel for measuring end to end latency. The encoder
+   stamps each packet with the sample clock of the frame's first input
+   sample and the encoder lookahead, both at 48 kHz, in the packet's own
+   padding: opus_packet_pad() turns it into a code 3 packet with
+   LATENCYPROBE_PADDING bytes of padding (the extra 2 bytes cover the
+   frame count and padding length), and the stamp takes the last
+   LATENCYPROBE_SIZE of them. RFC 6716 has decoders ignore the padding,
+   so stamped packets play anywhere and go through lists, packet buses,
+   UDP and captures unchanged. The clock is Pd's logical time, so the
+   numbers only add up with the encoder and decoder in one Pd process. */
+
+// the sample clock at 48 kHz, shared by all objects in the process
+static inline uint64_t latencyProbeClock()
+{
+    return (uint64_t)(clock_gettimesince(0) * (LATENCYPROBE_RATE / 1000) + 0.5);
+}
+
+// writes the stamp into the last LATENCYPROBE_SIZE bytes of a padded packet
+static inline void latencyProbeWrite(unsigned char* packet, int size, uint64_t captured, int lookahead)
+{
+    unsigned char* stamp = packet + size - LATENCYPROBE_SIZE;
+    memcpy(stamp, LATENCYPROBE_MAGIC, 4);
+    for (int i = 0; i < 8; ++i)
+        stamp[4 + i] = (unsigned char)(captured >> (56 - 8 * i));
+    stamp[12] = (unsigned char)(lookahead >> 8);
+    stamp[13] = (unsigned char)lookahead;
+}
+
+// the padding length of a single stream code 3 packet, or 0
+static inline int latencyProbePadding(const unsigned char* packet, int size)
+{
+    if (size < 2 || (packet[0] & 3) != 3 || !(packet[1] & 0x40))
+        return 0;
+
+    int padding = 0;
+    for (int i = 2; i < size; ++i)
+    {
+        padding += packet[i] == 255 ? 254 : packet[i];
+        if (packet[i] != 255)
+            break;
+    }
+    return padding;
+}
+
+/* Reads the stamp of a packet, returning 0 if it has none. Multistream
+   packets pad their last stream, which starts somewhere inside the
+   packet, so only the magic is checked for them. */
+static inline int latencyProbeRead(const unsigned char* packet, int size, int multistream, uint64_t* captured, int* lookahead)
+{
+    if (size < LATENCYPROBE_SIZE + 1)
+        return 0;
+
+    const unsigned char* stamp = packet + size - LATENCYPROBE_SIZE;
+    if (memcmp(stamp, LATENCYPROBE_MAGIC, 4))
+        return 0;
+    if (!multistream && latencyProbePadding(packet, size) < LATENCYPROBE_SIZE)
+        return 0;
+
+    *captured = 0;
+    for (int i = 0; i < 8; ++i)
+        *captured = *captured << 8 | stamp[4 + i];
+    *lookahead = stamp[12] << 8 | stamp[13];
+    return 1;
+}
+
+#endif /* __latencyprobe_h_ */
@@ -0,0 +1,239 @@
+#ifndef __opuscodec_h_
+#define __opuscodec_h_
+
+#include <opus.h>
+#include <opus_private.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+/* Codec helpers shared by the externals and the offline tools in tools/,
+   so both agree on frame durations, mode names, packet levels and the
+   settings a mono encoder runs with. Nothing in here depends on Pd. */
+
+#define OPUSCODEC_DEFAULT_BITRATE 32000
+
+/* The options [opusenc~] sets on its encoder. _mode is an
+   OPUS_SET_FORCE_MODE value. */
+typedef struct _opusencodersettings
+{
+    int _bitrate;
+    int _mode;
+    int _fec;
+    int _dtx;
+    int _packetLoss;
+    int _complexity;
+    int _maxBandwidth;
+    int _vbr;
+    int _vbrConstraint;
+    int _signal;
+    int _lsbDepth;
+    int _predictionDisabled;
+} OpusEncoderSettings;
+
+// sets an integer option on whichever kind of encoder the caller holds
+typedef int (*OpusEncoderCtl)(void* encoder, int request, opus_int32 value);
+
+static inline float opusFrameDuration(int code)
+{
+    switch (code) {
+        case OPUS_FRAMESIZE_2_5_MS: return 2.5f;
+        case OPUS_FRAMESIZE_5_MS: return 5;
+        case OPUS_FRAMESIZE_10_MS: return 10;
+        case OPUS_FRAMESIZE_20_MS: return 20;
+        case OPUS_FRAMESIZE_40_MS: return 40;
+        case OPUS_FRAMESIZE_60_MS: return 60;
+        case OPUS_FRAMESIZE_80_MS: return 80;
+        case OPUS_FRAMESIZE_100_MS: return 100;
+        case OPUS_FRAMESIZE_120_MS: return 120;
+        default:
+            break;
+    }
+    return 0;
+}
+
+static inline int isOpusFrameDuration(float ms)
+{
+    for (int code = OPUS_FRAMESIZE_2_5_MS; code <= OPUS_FRAMESIZE_120_MS; ++code)
+    {
+        if (opusFrameDuration(code) == ms)
+            return 1;
+    }
+    return 0;
+}
+
+// maps "hybrid", "silk" and "celt" to the OPUS_SET_FORCE_MODE value, or 0
+static inline int opusModeFromName(const char* name)
+{
+    if (!strcmp(name, "hybrid"))
+        return MODE_HYBRID;
+    if (!strcmp(name, "silk"))
+        return MODE_SILK_ONLY;
+    if (!strcmp(name, "celt"))
+        return MODE_CELT_ONLY;
+    return 0;
+}
+
+static inline const char* opusModeName(int mode)
+{
+    switch (mode) {
+        case MODE_SILK_ONLY: return "silk";
+        case MODE_HYBRID: return "hybrid";
+        case MODE_CELT_ONLY: return "celt";
+        default:
+            break;
+    }
+    return "";
+}
+
+// the upper edge in Hz of an OPUS_BANDWIDTH_ value, or 0
+static inline int opusBandwidthHz(int bandwidth)
+{
+    switch (bandwidth) {
+        case OPUS_BANDWIDTH_NARROWBAND: return 4000;
+        case OPUS_BANDWIDTH_MEDIUMBAND: return 6000;
+        case OPUS_BANDWIDTH_WIDEBAND: return 8000;
+        case OPUS_BANDWIDTH_SUPERWIDEBAND: return 12000;
+        case OPUS_BANDWIDTH_FULLBAND: return 20000;
+        default:
+            break;
+    }
+    return 0;
+}
+
+// the mode of a packet from the configuration in its TOC byte (RFC 6716 3.1)
+static inline int opusPacketMode(const unsigned char* packet)
+{
+    int config = packet[0] >> 3;
+    return config < 12 ? MODE_SILK_ONLY : config < 16 ? MODE_HYBRID : MODE_CELT_ONLY;
+}
+
+/* Whether the first frame of a SILK or hybrid packet carries LBRR (in-band
+   FEC) data. The SILK layer starts with one VAD flag per 20 ms SILK frame
+   and an LBRR flag, repeated for the side channel of a stereo packet. They
+   are the first symbols of the range coder and coded with even odds, so
+   they are the top bits of the frame's first byte. frameSize is in
+   samples at 48 kHz. */
+static inline int opusFrameHasLbrr(const unsigned char* frame, int size, int frameSize, int channels)
+{
+    if (size < 1)
+        return 0;
+
+    int silkFrames = frameSize <= 960 ? 1 : frameSize / 960;
+    for (int c = 0; c < channels; ++c)
+    {
+        if (frame[0] & (0x80 >> ((c + 1) * (silkFrames + 1) - 1)))
+            return 1;
+    }
+    return 0;
+}
+
+static inline int opusMonoEncoderCtl(void* encoder, int request, opus_int32 value)
+{
+    return opus_encoder_ctl((OpusEncoder*)encoder, request, value);
+}
+
+/* The settings [opusenc~] starts with: 32 kbps, hybrid (CELT in the
+   restricted low delay application), FEC and DTX on and no expected loss,
+   and for the rest what the library set the encoder up with, so applying them
+   again changes nothing. Without an encoder to ask (the CELT custom
+   encoder can't report them) these are the CELT encoder's own. */
+static inline void opusDefaultEncoderSettings(OpusEncoderSettings* settings, OpusEncoder* encoder, int application)
+{
+    settings->_bitrate = OPUSCODEC_DEFAULT_BITRATE;
+    settings->_mode = application == OPUS_APPLICATION_RESTRICTED_LOWDELAY ? MODE_CELT_ONLY : MODE_HYBRID;
+    settings->_fec = 1;
+    settings->_dtx = 1;
+    settings->_packetLoss = 0;
+    settings->_complexity = 5;
+    settings->_maxBandwidth = OPUS_BANDWIDTH_FULLBAND;
+    settings->_vbr = 0;
+    settings->_vbrConstraint = 1;
+    settings->_signal = OPUS_AUTO;
+    settings->_lsbDepth = 24;
+    settings->_predictionDisabled = 0;
+    if (!encoder)
+        return;
+
+    opus_encoder_ctl(encoder, OPUS_GET_COMPLEXITY(&settings->_complexity));
+    opus_encoder_ctl(encoder, OPUS_GET_MAX_BANDWIDTH(&settings->_maxBandwidth));
+    opus_encoder_ctl(encoder, OPUS_GET_VBR(&settings->_vbr));
+    opus_encoder_ctl(encoder, OPUS_GET_VBR_CONSTRAINT(&settings->_vbrConstraint));
+    opus_encoder_ctl(encoder, OPUS_GET_SIGNAL(&settings->_signal));
+    opus_encoder_ctl(encoder, OPUS_GET_LSB_DEPTH(&settings->_lsbDepth));
+    opus_encoder_ctl(encoder, OPUS_GET_PREDICTION_DISABLED(&settings->_predictionDisabled));
+}
+
+/* Sets every option in settings and returns the first error the encoder
+   reports. The CELT custom encoder (celtOnly) has no mode, SILK, DTX or
+   bandwidth options and only gets the rest. */
+static inline int opusApplyEncoderSettings(OpusEncoderCtl ctl, void* encoder, const OpusEncoderSettings* settings, int celtOnly)
+{
+    int err = ctl(encoder, OPUS_SET_BITRATE(settings->_bitrate));
+    if (!err)
+        err = ctl(encoder, OPUS_SET_COMPLEXITY(settings->_complexity));
+    if (!err)
+        err = ctl(encoder, OPUS_SET_VBR(settings->_vbr));
+    if (!err)
+        err = ctl(encoder, OPUS_SET_VBR_CONSTRAINT(settings->_vbrConstraint));
+    if (!err)
+        err = ctl(encoder, OPUS_SET_LSB_DEPTH(settings->_lsbDepth));
+    if (!err)
+        err = ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(settings->_packetLoss));
+    if (err || celtOnly)
+        return err;
+
+    err = ctl(encoder, OPUS_SET_FORCE_MODE(settings->_mode));
+    if (!err)
+        err = ctl(encoder, OPUS_SET_INBAND_FEC(settings->_fec));
+    if (!err)
+        err = ctl(encoder, OPUS_SET_DTX(settings->_dtx));
+    if (!err)
+        err = ctl(encoder, OPUS_SET_MAX_BANDWIDTH(settings->_maxBandwidth));
+    if (!err)
+        err = ctl(encoder, OPUS_SET_SIGNAL(settings->_signal));
+    if (!err)
+        err = ctl(encoder, OPUS_SET_PREDICTION_DISABLED(settings->_predictionDisabled));
+    return err;
+}
+
+// encodes one mono frame; returns the packet size or an OPUS error
+static inline int opusEncodeFrame(OpusEncoder* encoder, const float* pcm, int frameSize, unsigned char* packet, int maxPacketSize)
+{
+    return opus_encode_float(encoder, pcm, frameSize, packet, maxPacketSize);
+}
+
+/* Decodes one mono packet into frameSize samples at most and returns the
+   number decoded or an OPUS error. Without data the frame is concealed;
+   with decodeFec it is recovered from the in-band FEC of the packet that
+   follows it. */
+static inline int opusDecodeFrame(OpusDecoder* decoder, const unsigned char* data, int size, float* pcm, int frameSize, int decodeFec)
+{
+    return opus_decode_float(decoder, data, size, pcm, frameSize, decodeFec);
+}
+
+// the level of an interleaved frame in -dBov, 0 (full scale) to 127 (silence)
+static inline float frameDbov(const float* samples, int count)
+{
+    float dbov = 0;
+    for (int i = 0; i < count; ++i)
+        dbov += samples[i] * samples[i];
+    dbov /= count;
+
+    if (dbov == 0)
+        return 127;
+    if (dbov >= 1)
+        return 0;
+
+    dbov = -10 * log10(dbov);
+    return dbov > 127 ? 127 : (int)(dbov + 0.5f);
+}
+
+static inline int elapsedMicroseconds(const struct timespec* start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (int)((end.tv_sec - start->tv_sec) * 1000000 + (end.tv_nsec - start->tv_nsec) / 1000);
+}
+
+#endif /* __opuscodec_h_ */
@@ -1,10 +1,28 @@
 #include "m_pd.h"
+#include "samplecopy.h"
+#include "opuscodec.h"
+#include "codecpool.h"
+#include "opustrace.h"
+#include "packetbus.h"
+#include "packetcapture.h"
+#include "latencyprobe.h"
 #include <opus.h>
 #include <opus_private.h>
+#include <opus_projection.h>
+#include <opus_custom.h>
+#include <modes.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #define MAX_PACKET_SIZE 1024
+#define MAX_FRAME_SIZE_MS 120
+#define DECODE_JOB_POLL_MS 10
+#define DECODE_JOB_MAX_GAP 100
+#define PACKET_QUEUE_SIZE 16
+#define DECODE_TIME_BUCKETS 8
+#define DECODE_TIME_FIRST_BUCKET_US 25
 
 static t_class* opusdec_tilde_class;
 
@@ -14,35 +32,188 @@ enum LOG_LEVEL
     LOG_LEVEL_NORMAL
 };
 
+/* An offline decode into a table on a background thread. The packets are
+   capture records, either a mapped capture file or the sequence built
+   with "append", where a record of size 0 marks a lost packet and gaps in
+   captured timestamps count as losses. The samples are decoded into a
+   private buffer and copied into the table on the message thread. */
+typedef struct _decodejob
+{
+    OpusDecoder* _decoder;
+    const unsigned char* _data;
+    size_t _size;
+    size_t _start;
+    int _mapped;
+    t_symbol* _table;
+    int _sampleRate;
+    float* _samples;
+    int _sampleCount;
+    int _decoded;
+    int _plcFrames;
+    int _fecFrames;
+    int _errors;
+    pthread_t _thread;
+    _Atomic int _done;
+    _Atomic int _cancel;
+} DecodeJob;
+
+// walks the packets and losses of a decode job
+typedef struct _decodecursor
+{
+    size_t _offset;
+    double _lastTime;
+    float _lastFrameMs;
+    int _pendingLosses;
+    const unsigned char* _pendingData;
+    int _pendingSize;
+} DecodeCursor;
+
+// a stamped frame waiting to be played out, with times at 48 kHz
+typedef struct _latencystamp
+{
+    uint64_t _captured;
+    uint64_t _arrival;
+    int _lookahead;
+    int _frameSize;
+    int _due;
+} LatencyStamp;
+
 typedef struct _opusdec_tilde
 {
     t_object x_obj;
-    t_outlet* _audioOutlet;
     OpusDecoder* _decoder;
+    OpusProjectionDecoder* _projectionDecoder;
+    OpusCustomMode* _customMode;
+    OpusCustomDecoder* _customDecoder;
+    int _customFrameSize;
+    int _channels;
+    int _streams;
+    int _coupledStreams;
+    unsigned char* _demixingMatrix;
+    int _demixingMatrixSize;
     int _sampleRate;
-    int _opusFrameSizeMs;
+    float _opusFrameSizeMs;
     int _opusFrameSize;
     int _masterFrameSize;
     float* _frameBuffer;
     int _frameBufferSize;
+    float* _decodeBuffer;
+    int _decodeBufferSize;
     int _writePosition;
     int _readPosition;
     int _framesDecoded;
     unsigned char* _packet;
     int _packetSize;
+    int _maxPacketSize;
     int _lostPrevious;
+    int _deferred;
+    unsigned char* _queueData;
+    int _queueSizes[PACKET_QUEUE_SIZE];
+    uint64_t _queueArrivals[PACKET_QUEUE_SIZE];
+    int _queueHead;
+    int _queueCount;
+    int _bufferedSamples;
+    t_outlet* _statsOutlet;
+    t_clock* _statsClock;
+    double _statsInterval;
+    int _packetsReceived;
+    int _invalidPackets;
+    int _decodeErrors;
+    int _plcFrames;
+    int _fecFrames;
+    int _underruns;
+    int _overruns;
+    int _decodeTimes[DECODE_TIME_BUCKETS];
+    t_clock* _feedbackClock;
+    double _feedbackInterval;
+    int _intervalReceived;
+    int _intervalLost;
+    double _lastArrival;
+    double _mediaSinceArrival;
+    double _jitter;
+    t_clock* _hibernateClock;
+    double _hibernateIdle;
+    double _lastActivity;
+    int _hibernating;
+    int _wakeups;
+    PacketBus* _bus;
+    t_symbol* _busName;
+    t_canvas* _canvas;
+    unsigned char* _sequence;
+    size_t _sequenceSize;
+    size_t _sequenceCapacity;
+    DecodeJob* _job;
+    t_clock* _jobClock;
+    LatencyStamp _stamps[PACKET_QUEUE_SIZE];
+    int _stampHead;
+    int _stampCount;
+    int _stampedLookahead;
+    t_clock* _latencyClock;
+    float _latency[4];
+    int _latencyReports;
+    double _latencySum;
 } t_opusdec_tilde;
 
 void opusdec_tilde_setup();
-void* opusdec_tilde_new(t_floatarg frameSize);
+void* opusdec_tilde_new(t_symbol* s, int argc, t_atom* argv);
 void opusdec_tilde_free(t_opusdec_tilde* x);
 void opusdec_tilde_dsp(t_opusdec_tilde* x, t_signal** sp);
 t_int* opusdec_tilde_perform(t_int* w);
+static t_perfroutine performRoutine(t_opusdec_tilde* x, int blockSize);
 void opusdec_tilde_reset(t_opusdec_tilde* x);
 void opusdec_tilde_packet(t_opusdec_tilde* x, t_symbol* s, int argc, t_atom* argv);
 void opusdec_tilde_bang(t_opusdec_tilde* x);
-int setOpusSampleRate(t_opusdec_tilde* x, int sampleRate);
-int setBufferSizes(t_opusdec_tilde* x, int masterFrameSize, int opusFrameSize);
+void opusdec_tilde_demixing(t_opusdec_tilde* x, t_symbol* s, int argc, t_atom* argv);
+void opusdec_tilde_deferred(t_opusdec_tilde* x, t_floatarg enabled);
+void opusdec_tilde_stats(t_opusdec_tilde* x);
+void opusdec_tilde_statsinterval(t_opusdec_tilde* x, t_floatarg interval);
+void opusdec_tilde_resetstats(t_opusdec_tilde* x);
+void opusdec_tilde_feedback(t_opusdec_tilde* x);
+void opusdec_tilde_feedbackinterval(t_opusdec_tilde* x, t_floatarg interval);
+void opusdec_tilde_hibernate(t_opusdec_tilde* x, t_floatarg idle);
+void opusdec_tilde_receive(t_opusdec_tilde* x, t_symbol* s);
+void opusdec_tilde_append(t_opusdec_tilde* x, t_symbol* s, int argc, t_atom* argv);
+void opusdec_tilde_clear(t_opusdec_tilde* x);
+void opusdec_tilde_decodearray(t_opusdec_tilde* x, t_symbol* table, t_symbol* file);
+void opusdec_tilde_trace(t_opusdec_tilde* x, t_symbol* s);
+static void outputStats(t_opusdec_tilde* x);
+static void statsTick(t_opusdec_tilde* x);
+static void feedbackTick(t_opusdec_tilde* x);
+static void hibernateTick(t_opusdec_tilde* x);
+static void latencyTick(t_opusdec_tilde* x);
+static void hibernate(t_opusdec_tilde* x);
+static int wake(t_opusdec_tilde* x);
+static OpusDecoder* acquireDecoder(int sampleRate, int* err);
+static void releaseDecoder(OpusDecoder* decoder);
+static void updateJitter(t_opusdec_tilde* x, int frameSize);
+static void receivePacket(t_opusdec_tilde* x, const unsigned char* data, int size);
+static void readPacketBus(t_opusdec_tilde* x);
+static int nextDecodeEntry(DecodeJob* job, DecodeCursor* cursor, const unsigned char** data, int* size);
+static int decodedSampleCount(DecodeJob* job);
+static void decodeJobFrame(DecodeJob* job, const unsigned char* data, int size, int frameSize, int decodeFec);
+static void* decodeJobThread(void* arg);
+static void decodeJobTick(t_opusdec_tilde* x);
+static void freeDecodeJob(DecodeJob* job);
+static void enqueuePacket(t_opusdec_tilde* x, const unsigned char* data, int size);
+static void noteLatencyStamp(t_opusdec_tilde* x, const unsigned char* data, int size, uint64_t arrival);
+static void playLatencyStamps(t_opusdec_tilde* x);
+static void decodeQueuedFrames(t_opusdec_tilde* x, int samples);
+static void decodeCustomFrames(t_opusdec_tilde* x, t_sample** out, int samples);
+static int dequeuePacket(t_opusdec_tilde* x);
+static int availableSamples(t_opusdec_tilde* x);
+static int atomToByte(const t_atom* a);
+static int hasDecoder(t_opusdec_tilde* x);
+static int decodeFrame(t_opusdec_tilde* x, const unsigned char* data, int size, int decodeFec);
+static int decodeInto(t_opusdec_tilde* x, const unsigned char* data, int size, int decodeFec, float* pcm, int frameSize);
+static int isDirectDecode(t_opusdec_tilde* x);
+static int decoderDelay(t_opusdec_tilde* x);
+static int algorithmicDelay(t_opusdec_tilde* x);
+static int initCustomDecoder(t_opusdec_tilde* x);
+static int packetFrameSize(t_opusdec_tilde* x, const unsigned char* data, int size);
+static void reserveFrameBuffer(t_opusdec_tilde* x, int frameSize);
+static int requiredFrameBufferSize(int masterFrameSize, int frameSize);
+static int setOpusSampleRate(t_opusdec_tilde* x, int sampleRate);
+static int setBufferSizes(t_opusdec_tilde* x, int masterFrameSize, int opusFrameSize);
 
 void opusdec_tilde_setup()
 {
@@ -51,68 +222,358 @@ void opusdec_tilde_setup()
                                    (t_method)opusdec_tilde_free,
                                    sizeof(t_opusdec_tilde),
                                    CLASS_DEFAULT,
-                                   A_FLOAT,
+                                   A_GIMME,
                                    0);
     
-    class_addmethod(opusdec_tilde_class, (t_method)opusdec_tilde_dsp, gensym("dsp"), 0);
+    class_addmethod(opusdec_tilde_class, (t_method)opusdec_tilde_dsp, gensym("dsp"), A_CANT, 0);
     class_addlist(opusdec_tilde_class, (t_method)opusdec_tilde_packet);
     class_addbang(opusdec_tilde_class, (t_method)opusdec_tilde_bang);
+    class_addmethod(opusdec_tilde_class, (t_method)opusdec_tilde_demixing, gensym("demixing"), A_GIMME, 0);
+    class_addmethod(opusdec_tilde_class, (t_method)opusdec_tilde_deferred, gensym("deferred"), A_FLOAT, 0);
+    class_addmethod(opusdec_tilde_class, (t_method)opusdec_tilde_stats, gensym("stats"), 0);
+    class_addmethod(opusdec_tilde_class, (t_method)opusdec_tilde_statsinterval, gensym("statsinterval"), A_FLOAT, 0);
+    class_addmethod(opusdec_tilde_class, (t_method)opusdec_tilde_resetstats, gensym("resetstats"), 0);
+    class_addmethod(opusdec_tilde_class, (t_method)opusdec_tilde_feedback, gensym("feedback"), 0);
+    class_addmethod(opusdec_tilde_class, (t_method)opusdec_tilde_feedbackinterval, gensym("feedbackinterval"), A_FLOAT, 0);
+    class_addmethod(opusdec_tilde_class, (t_method)opusdec_tilde_hibernate, gensym("hibernate"), A_FLOAT, 0);
+    class_addmethod(opusdec_tilde_class, (t_method)opusdec_tilde_receive, gensym("receive"), A_DEFSYMBOL, 0);
+    class_addmethod(opusdec_tilde_class, (t_method)opusdec_tilde_append, gensym("append"), A_GIMME, 0);
+    class_addmethod(opusdec_tilde_class, (t_method)opusdec_tilde_clear, gensym("clear"), 0);
+    class_addmethod(opusdec_tilde_class, (t_method)opusdec_tilde_decodearray, gensym("decodearray"), A_SYMBOL, A_DEFSYMBOL, 0);
+    class_addmethod(opusdec_tilde_class, (t_method)opusdec_tilde_trace, gensym("trace"), A_DEFSYMBOL, 0);
 }
 
-void* opusdec_tilde_new(t_floatarg frameSize)
+void* opusdec_tilde_new(t_symbol* s, int argc, t_atom* argv)
 {
+    int customFrameSize = 0;
+    t_float hibernateIdle = 0;
+    while (argc >= 2 && argv[0].a_type == A_SYMBOL)
+    {
+        if (!strcmp(argv[0].a_w.w_symbol->s_name, "-custom"))
+            customFrameSize = atom_getint(&argv[1]);
+        else if (!strcmp(argv[0].a_w.w_symbol->s_name, "-hibernate"))
+            hibernateIdle = atom_getfloat(&argv[1]);
+        else
+            break;
+        argc -= 2;
+        argv += 2;
+    }
+
+    t_float frameSize = atom_getfloatarg(0, argc, argv);
+    t_float channels = atom_getfloatarg(1, argc, argv);
+
+    if (customFrameSize && (customFrameSize < 0 || channels > 1 || frameSize))
+    {
+        error("opusdec~: custom mode takes only a frame size in samples and is mono");
+        return 0;
+    }
+
     t_opusdec_tilde* x = (t_opusdec_tilde*)pd_new(opusdec_tilde_class);
     if (!x)
         return 0;
     
-    x->_audioOutlet = outlet_new(&x->x_obj, &s_signal);
+    x->_channels = channels > 1 ? channels : 1;
+    for (int i = 0; i < x->_channels; ++i)
+        outlet_new(&x->x_obj, &s_signal);
+    x->_statsOutlet = outlet_new(&x->x_obj, 0);
+    x->_statsClock = clock_new(x, (t_method)statsTick);
+    x->_statsInterval = 0;
+    opusdec_tilde_resetstats(x);
+    x->_feedbackClock = clock_new(x, (t_method)feedbackTick);
+    x->_feedbackInterval = 0;
+    x->_intervalReceived = 0;
+    x->_intervalLost = 0;
+    x->_lastArrival = 0;
+    x->_mediaSinceArrival = 0;
+    x->_jitter = 0;
+    x->_hibernateClock = clock_new(x, (t_method)hibernateTick);
+    x->_hibernateIdle = 0;
+    x->_lastActivity = clock_getlogicaltime();
+    x->_hibernating = 0;
+    x->_bus = 0;
+    x->_busName = &s_;
+    x->_canvas = canvas_getcurrent();
+    x->_sequence = 0;
+    x->_sequenceSize = 0;
+    x->_sequenceCapacity = 0;
+    x->_job = 0;
+    x->_jobClock = clock_new(x, (t_method)decodeJobTick);
+    x->_latencyClock = clock_new(x, (t_method)latencyTick);
+    x->_stampHead = 0;
+    x->_stampCount = 0;
+    x->_stampedLookahead = -1;
+
+    x->_decoder = 0;
+    x->_projectionDecoder = 0;
+    x->_customMode = 0;
+    x->_customDecoder = 0;
+    x->_customFrameSize = customFrameSize;
+    x->_streams = 0;
+    x->_coupledStreams = 0;
+    x->_demixingMatrix = 0;
+    x->_demixingMatrixSize = 0;
     x->_sampleRate = (int)sys_getsr();
-    x->_opusFrameSizeMs = frameSize;
+    x->_opusFrameSizeMs = frameSize > 0 ? frameSize : 20;
     x->_opusFrameSize = 0;
     x->_masterFrameSize = 0;
     x->_frameBuffer = 0;
     x->_frameBufferSize = 0;
+    x->_decodeBuffer = 0;
+    x->_decodeBufferSize = 0;
     x->_writePosition = 0;
     x->_readPosition = 0;
     x->_framesDecoded = 0;
-    x->_packet = (unsigned char*)malloc(MAX_PACKET_SIZE);
+    x->_maxPacketSize = MAX_PACKET_SIZE * x->_channels;
+    x->_packet = (unsigned char*)malloc(x->_maxPacketSize);
     x->_packetSize = 0;
     x->_lostPrevious = 0;
+    x->_deferred = customFrameSize ? 1 : 0;
+    x->_queueData = (unsigned char*)malloc(PACKET_QUEUE_SIZE * x->_maxPacketSize);
+    x->_queueHead = 0;
+    x->_queueCount = 0;
     
-    int err = 0;
-    x->_decoder = opus_decoder_create(x->_sampleRate, 1, &err);
-    if (err)
+    if (x->_customFrameSize)
     {
-        error("could not create OPUS decoder: %s", opus_strerror(err));
-        opusdec_tilde_free(x);
-        return 0;
+        if (!initCustomDecoder(x))
+        {
+            opusdec_tilde_free(x);
+            return 0;
+        }
+    }
+    else if (x->_channels == 1)
+    {
+        int err = 0;
+        x->_decoder = acquireDecoder(x->_sampleRate, &err);
+        if (err)
+        {
+            error("could not create OPUS decoder: %s", opus_strerror(err));
+            opusdec_tilde_free(x);
+            return 0;
+        }
+        
+        verbose(LOG_LEVEL_NORMAL, "OPUS decoder initialised @%dhz", x->_sampleRate);
+    }
+    else
+    {
+        verbose(LOG_LEVEL_NORMAL, "OPUS projection decoder waiting for a demixing matrix for %d channels", x->_channels);
     }
-    
-    verbose(LOG_LEVEL_NORMAL, "OPUS decoder initialised @%dhz", x->_sampleRate);
 
-    setBufferSizes(x, sys_getblksize(), x->_opusFrameSizeMs * x->_sampleRate / 1000);
+    setBufferSizes(x, sys_getblksize(), x->_customFrameSize ? x->_customFrameSize : x->_opusFrameSizeMs * x->_sampleRate / 1000);
+
+    // objects that start out hibernating only take a decoder when the first
+    // packet arrives
+    if (hibernateIdle > 0)
+    {
+        opusdec_tilde_hibernate(x, hibernateIdle);
+        hibernate(x);
+    }
     
     return x;
 }
 
 void opusdec_tilde_free(t_opusdec_tilde* x)
 {
+    if (x->_job)
+    {
+        atomic_store(&x->_job->_cancel, 1);
+        pthread_join(x->_job->_thread, 0);
+        freeDecodeJob(x->_job);
+        x->_job = 0;
+    }
+    opusdec_tilde_clear(x);
+
+    if (x->_bus)
+    {
+        packetBusRelease(x->_bus, PACKETBUS_CONSUMER);
+        x->_bus = 0;
+    }
+
     if (x->_decoder)
     {
-        opus_decoder_destroy(x->_decoder);
+        releaseDecoder(x->_decoder);
         x->_decoder = 0;
     }
 
+    if (x->_projectionDecoder)
+    {
+        opus_projection_decoder_destroy(x->_projectionDecoder);
+        x->_projectionDecoder = 0;
+    }
+
+    if (x->_customDecoder)
+    {
+        opus_custom_decoder_destroy(x->_customDecoder);
+        x->_customDecoder = 0;
+    }
+
+    if (x->_customMode)
+    {
+        opus_custom_mode_destroy(x->_customMode);
+        x->_customMode = 0;
+    }
+
+    if (x->_demixingMatrix) {
+        free(x->_demixingMatrix);
+    }
+
     if (x->_frameBuffer) {
         free(x->_frameBuffer);
     }
 
+    if (x->_decodeBuffer) {
+        free(x->_decodeBuffer);
+    }
+
     if (x->_packet) {
         free(x->_packet);
     }
+
+    if (x->_queueData) {
+        free(x->_queueData);
+    }
+
+    clock_free(x->_statsClock);
+    clock_free(x->_feedbackClock);
+    clock_free(x->_hibernateClock);
+    clock_free(x->_jobClock);
+    clock_free(x->_latencyClock);
+}
+
+static OpusDecoder* acquireDecoder(int sampleRate, int* err)
+{
+    // mono decoder states all have the same size whatever their sample
+    // rate, so they come from the shared codec pool
+    OpusDecoder* decoder = (OpusDecoder*)codecPoolAlloc(opus_decoder_get_size(1));
+    if (!decoder)
+    {
+        *err = OPUS_ALLOC_FAIL;
+        return 0;
+    }
+
+    // initialising also clears whatever state the last owner left behind
+    *err = opus_decoder_init(decoder, sampleRate, 1);
+    if (*err)
+    {
+        releaseDecoder(decoder);
+        return 0;
+    }
+    return decoder;
+}
+
+static void releaseDecoder(OpusDecoder* decoder)
+{
+    codecPoolFree(decoder, opus_decoder_get_size(1));
+}
+
+void opusdec_tilde_hibernate(t_opusdec_tilde* x, t_floatarg idle)
+{
+    if (x->_customFrameSize || x->_channels > 1)
+    {
+        error("only the mono decoder can hibernate");
+        return;
+    }
+
+    x->_hibernateIdle = idle > 0 ? idle : 0;
+    if (!x->_hibernateIdle)
+    {
+        clock_unset(x->_hibernateClock);
+        wake(x);
+        return;
+    }
+
+    if (!x->_hibernating)
+        clock_delay(x->_hibernateClock, x->_hibernateIdle);
+}
+
+static void hibernateTick(t_opusdec_tilde* x)
+{
+    if (!x->_hibernateIdle || x->_hibernating)
+        return;
+
+    // packets from a bus arrive in perform, which must not allocate
+    if (x->_bus)
+    {
+        clock_delay(x->_hibernateClock, x->_hibernateIdle);
+        return;
+    }
+
+    // packets only move the activity time, the clock is checked lazily
+    double idle = clock_gettimesince(x->_lastActivity);
+    if (idle >= x->_hibernateIdle && !x->_queueCount)
+        hibernate(x);
+    else
+        clock_delay(x->_hibernateClock, idle < x->_hibernateIdle ? x->_hibernateIdle - idle : x->_opusFrameSizeMs);
+}
+
+static void hibernate(t_opusdec_tilde* x)
+{
+    if (x->_hibernating || !x->_decoder)
+        return;
+
+    releaseDecoder(x->_decoder);
+    x->_decoder = 0;
+
+    free(x->_frameBuffer);
+    free(x->_decodeBuffer);
+    free(x->_packet);
+    free(x->_queueData);
+    x->_frameBuffer = 0;
+    x->_decodeBuffer = 0;
+    x->_packet = 0;
+    x->_queueData = 0;
+
+    x->_hibernating = 1;
+    verbose(LOG_LEVEL_NORMAL, "OPUS decoder hibernating");
+}
+
+static int wake(t_opusdec_tilde* x)
+{
+    if (!x->_hibernating)
+        return 1;
+
+    int err = 0;
+    x->_decoder = acquireDecoder(x->_sampleRate, &err);
+    if (err)
+    {
+        error("could not create OPUS decoder: %s", opus_strerror(err));
+        return 0;
+    }
+
+    // the frame buffer keeps the size it had grown to before hibernating
+    x->_packet = (unsigned char*)malloc(x->_maxPacketSize);
+    x->_queueData = (unsigned char*)malloc(PACKET_QUEUE_SIZE * x->_maxPacketSize);
+    x->_frameBuffer = (float*)calloc(x->_frameBufferSize * x->_channels, sizeof(float));
+    x->_decodeBuffer = (float*)malloc(x->_decodeBufferSize * x->_channels * sizeof(float));
+    if (!x->_packet || !x->_queueData || !x->_frameBuffer || !x->_decodeBuffer)
+    {
+        error("could not wake OPUS decoder: %s", opus_strerror(OPUS_ALLOC_FAIL));
+        free(x->_packet);
+        free(x->_queueData);
+        free(x->_frameBuffer);
+        free(x->_decodeBuffer);
+        x->_packet = 0;
+        x->_queueData = 0;
+        x->_frameBuffer = 0;
+        x->_decodeBuffer = 0;
+        releaseDecoder(x->_decoder);
+        x->_decoder = 0;
+        return 0;
+    }
+
+    x->_hibernating = 0;
+    x->_lostPrevious = 0;
+    x->_lastArrival = 0;
+    x->_wakeups++;
+    opusdec_tilde_reset(x);
+
+    if (x->_hibernateIdle)
+        clock_delay(x->_hibernateClock, x->_hibernateIdle);
+
+    verbose(LOG_LEVEL_NORMAL, "OPUS decoder woken up @%dhz", x->_sampleRate);
+    return 1;
 }
 
-int setOpusSampleRate(t_opusdec_tilde* x, int sampleRate)
+static int setOpusSampleRate(t_opusdec_tilde* x, int sampleRate)
 {
     if (x->_sampleRate == sampleRate)
     {
@@ -120,8 +581,20 @@ int setOpusSampleRate(t_opusdec_tilde* x, int sampleRate)
     }
     
     x->_sampleRate = sampleRate;
+
+    if (x->_customDecoder)
+        return initCustomDecoder(x) && setBufferSizes(x, x->_masterFrameSize, x->_customFrameSize);
     
-    int err = opus_decoder_init(x->_decoder, sampleRate, 1);
+    // a hibernating decoder is initialised for the new rate when it wakes
+    if (x->_hibernating)
+        return setBufferSizes(x, x->_masterFrameSize, x->_opusFrameSizeMs * x->_sampleRate / 1000);
+
+    int err = 0;
+    if (x->_projectionDecoder)
+        err = opus_projection_decoder_init(x->_projectionDecoder, sampleRate, x->_channels, x->_streams, x->_coupledStreams, x->_demixingMatrix, x->_demixingMatrixSize);
+    else if (x->_decoder)
+        err = opus_decoder_init(x->_decoder, sampleRate, 1);
+
     if (err)
     {
         error("could not initialise OPUS encoder @%dhz: %s", sampleRate, opus_strerror(err));
@@ -133,19 +606,67 @@ int setOpusSampleRate(t_opusdec_tilde* x, int sampleRate)
     return setBufferSizes(x, x->_masterFrameSize, x->_opusFrameSizeMs * x->_sampleRate / 1000);
 }
 
-int setBufferSizes(t_opusdec_tilde* x, int masterFrameSize, int opusFrameSize)
+static int initCustomDecoder(t_opusdec_tilde* x)
+{
+    // a custom mode is tied to its sample rate, so it is created anew
+    if (x->_customDecoder)
+        opus_custom_decoder_destroy(x->_customDecoder);
+    if (x->_customMode)
+        opus_custom_mode_destroy(x->_customMode);
+    x->_customDecoder = 0;
+
+    int err = 0;
+    x->_customMode = opus_custom_mode_create(x->_sampleRate, x->_customFrameSize, &err);
+    if (!err)
+        x->_customDecoder = opus_custom_decoder_create(x->_customMode, 1, &err);
+
+    if (err)
+    {
+        error("could not create OPUS custom decoder for %d sample frames @%dhz: %s", x->_customFrameSize, x->_sampleRate, opus_strerror(err));
+        return 0;
+    }
+
+    x->_opusFrameSizeMs = x->_customFrameSize * 1000.f / x->_sampleRate;
+
+    verbose(LOG_LEVEL_NORMAL, "OPUS custom decoder initialised @%dhz with %d sample frames", x->_sampleRate, x->_customFrameSize);
+    return 1;
+}
+
+static int setBufferSizes(t_opusdec_tilde* x, int masterFrameSize, int opusFrameSize)
 {
     if (x->_masterFrameSize == masterFrameSize && x->_opusFrameSize == opusFrameSize)
         return 1;
+
+    // the frame buffer only depends on the OPUS frame size, so a new block
+    // size keeps the buffered audio
+    int keepBuffers = x->_opusFrameSize == opusFrameSize && x->_frameBuffer && requiredFrameBufferSize(masterFrameSize, opusFrameSize) <= x->_frameBufferSize;
     
     x->_masterFrameSize = masterFrameSize;
     x->_opusFrameSize = opusFrameSize;
+
+    if (keepBuffers)
+    {
+        verbose(LOG_LEVEL_NORMAL, "pd~ buffer size: %d, OPUS frame size: %d", x->_masterFrameSize, x->_opusFrameSize);
+        return 1;
+    }
+
+    if (x->_hibernating)
+    {
+        x->_frameBufferSize = requiredFrameBufferSize(x->_masterFrameSize, x->_opusFrameSize);
+        x->_decodeBufferSize = x->_opusFrameSize;
+        return 1;
+    }
     
     if (x->_frameBuffer)
         free(x->_frameBuffer);
+
+    if (x->_decodeBuffer)
+        free(x->_decodeBuffer);
     
-    x->_frameBufferSize = 3 * x->_opusFrameSize;
-    x->_frameBuffer = (float*)calloc(x->_frameBufferSize, sizeof(float));
+    x->_frameBufferSize = requiredFrameBufferSize(x->_masterFrameSize, x->_opusFrameSize);
+    x->_frameBuffer = (float*)calloc(x->_frameBufferSize * x->_channels, sizeof(float));
+    x->_decodeBufferSize = x->_opusFrameSize;
+    x->_decodeBuffer = (float*)malloc(x->_decodeBufferSize * x->_channels * sizeof(float));
     
     opusdec_tilde_reset(x);
     
@@ -158,109 +679,1217 @@ int setBufferSizes(t_opusdec_tilde* x, int masterFrameSize, int opusFrameSize)
 void opusdec_tilde_dsp(t_opusdec_tilde* x, t_signal** sp)
 {
     setOpusSampleRate(x, sp[0]->s_sr);
+    setBufferSizes(x, sp[0]->s_n, x->_opusFrameSize);
+    if (x->_bus)
+        reserveFrameBuffer(x, MAX_FRAME_SIZE_MS * x->_sampleRate / 1000);
     
-    dsp_add(opusdec_tilde_perform, 3, x, sp[0]->s_vec, sp[0]->s_n);
+    t_int* vec = (t_int*)getbytes((x->_channels + 2) * sizeof(t_int));
+    vec[0] = (t_int)x;
+    vec[1] = (t_int)sp[0]->s_n;
+    for (int c = 0; c < x->_channels; ++c)
+        vec[2 + c] = (t_int)sp[c]->s_vec;
+
+    dsp_addv(performRoutine(x, sp[0]->s_n), x->_channels + 2, vec);
+    freebytes(vec, (x->_channels + 2) * sizeof(t_int));
 }
 
 void opusdec_tilde_reset(t_opusdec_tilde* x)
 {
     x->_writePosition = 0;
     x->_readPosition = x->_frameBufferSize - x->_opusFrameSize;
-    memset(x->_frameBuffer, 0, x->_frameBufferSize * sizeof(float));
+    memset(x->_frameBuffer, 0, x->_frameBufferSize * x->_channels * sizeof(float));
     x->_framesDecoded = 0;
+    x->_queueHead = 0;
+    x->_queueCount = 0;
+    x->_bufferedSamples = x->_opusFrameSize;
+    x->_stampHead = 0;
+    x->_stampCount = 0;
+}
+
+void opusdec_tilde_resetstats(t_opusdec_tilde* x)
+{
+    x->_packetsReceived = 0;
+    x->_invalidPackets = 0;
+    x->_decodeErrors = 0;
+    x->_plcFrames = 0;
+    x->_fecFrames = 0;
+    x->_underruns = 0;
+    x->_overruns = 0;
+    x->_wakeups = 0;
+    memset(x->_decodeTimes, 0, sizeof(x->_decodeTimes));
+    memset(x->_latency, 0, sizeof(x->_latency));
+    x->_latencyReports = 0;
+    x->_latencySum = 0;
+}
+
+static void outputStat(t_opusdec_tilde* x, const char* name, int value)
+{
+    t_atom a;
+    SETFLOAT(&a, value);
+    outlet_anything(x->_statsOutlet, gensym(name), 1, &a);
+}
+
+static void outputStats(t_opusdec_tilde* x)
+{
+    outputStat(x, "received", x->_packetsReceived);
+    outputStat(x, "invalid", x->_invalidPackets);
+    outputStat(x, "errors", x->_decodeErrors);
+    outputStat(x, "plc", x->_plcFrames);
+    outputStat(x, "fec", x->_fecFrames);
+    outputStat(x, "underruns", x->_underruns);
+    outputStat(x, "overruns", x->_overruns);
+    outputStat(x, "fill", x->_bufferedSamples);
+    outputStat(x, "delay", decoderDelay(x));
+    outputStat(x, "algorithmicdelay", algorithmicDelay(x));
+    outputStat(x, "hibernating", x->_hibernating);
+    outputStat(x, "wakeups", x->_wakeups);
+
+    t_atom histogram[DECODE_TIME_BUCKETS];
+    for (int i = 0; i < DECODE_TIME_BUCKETS; ++i)
+        SETFLOAT(&histogram[i], x->_decodeTimes[i]);
+    outlet_anything(x->_statsOutlet, gensym("decodetime"), DECODE_TIME_BUCKETS, histogram);
 }
 
-void advanceWritePosition(t_opusdec_tilde* x, int samples) {
-    if (samples != x->_opusFrameSize)
+void opusdec_tilde_stats(t_opusdec_tilde* x)
+{
+    post("packets received: %d, invalid: %d, decode errors: %d", x->_packetsReceived, x->_invalidPackets, x->_decodeErrors);
+    post("PLC frames: %d, FEC frames: %d", x->_plcFrames, x->_fecFrames);
+    post("underruns: %d, overruns: %d, buffer fill: %d/%d samples", x->_underruns, x->_overruns, x->_bufferedSamples, x->_frameBufferSize);
+    post("decoder delay: %d samples%s", decoderDelay(x), isDirectDecode(x) ? " (custom frames decoded in perform)" : "");
+    post("algorithmic delay: %d samples (%s)", algorithmicDelay(x),
+         x->_customMode ? "frame and MDCT overlap" : x->_stampedLookahead >= 0 ? "frame and stamped encoder lookahead" : "frame and default encoder lookahead");
+    post("total latency: %d samples (%g ms)", decoderDelay(x) + algorithmicDelay(x), (decoderDelay(x) + algorithmicDelay(x)) * 1000.f / x->_sampleRate);
+    if (x->_bus)
+        post("packet bus %s: fill %d bytes, dropped by encoder: %d", x->_busName->s_name, packetBusFill(x->_bus), packetBusDropped(x->_bus));
+    post("%s, woken up %d times", x->_hibernating ? "hibernating" : "awake", x->_wakeups);
+    if (x->_latencyReports)
+        post("latency: %g ms (codec %g, transport %g, buffering %g), mean %g ms over %d stamped frames",
+             x->_latency[0], x->_latency[1], x->_latency[2], x->_latency[3], x->_latencySum / x->_latencyReports, x->_latencyReports);
+    if (!x->_customFrameSize && x->_channels == 1)
     {
-        error("decoded samples do not match frameSize");
-        return;
+        int inUse, allocated;
+        codecPoolUsage(opus_decoder_get_size(1), &inUse, &allocated);
+        post("codec pool: %d of %d decoder states in use", inUse, allocated);
+    }
+    for (int i = 0, us = DECODE_TIME_FIRST_BUCKET_US; i < DECODE_TIME_BUCKETS; ++i, us *= 2)
+    {
+        if (i == DECODE_TIME_BUCKETS - 1)
+            post("decode time >= %dus: %d", us / 2, x->_decodeTimes[i]);
+        else
+            post("decode time < %dus: %d", us, x->_decodeTimes[i]);
     }
 
-    x->_writePosition = (x->_writePosition + samples) % x->_frameBufferSize;
-    x->_framesDecoded = 1;
+    outputStats(x);
 }
 
-void opusdec_tilde_bang(t_opusdec_tilde* x)
+void opusdec_tilde_statsinterval(t_opusdec_tilde* x, t_floatarg interval)
 {
-    if (x->_lostPrevious) {
-        int decoded = opus_decode_float(x->_decoder, 0, 0, x->_frameBuffer + x->_writePosition, x->_opusFrameSize, 0);
-        advanceWritePosition(x, decoded);
-        verbose(LOG_LEVEL_NORMAL, "generated %d PLC samples", decoded);
-    }
-    x->_lostPrevious = 1;
+    x->_statsInterval = interval > 0 ? interval : 0;
+    if (x->_statsInterval)
+        clock_delay(x->_statsClock, x->_statsInterval);
+    else
+        clock_unset(x->_statsClock);
 }
 
-void loadPacket(t_opusdec_tilde* x, t_symbol* s, int argc, t_atom* argv)
+static void statsTick(t_opusdec_tilde* x)
 {
-    x->_packetSize = 0;
-    for (int i = 0; i < argc; ++i)
+    outputStats(x);
+    if (x->_statsInterval)
+        clock_delay(x->_statsClock, x->_statsInterval);
+}
+
+void opusdec_tilde_feedback(t_opusdec_tilde* x)
+{
+    // a receiver report for the sender's rate control: loss in percent
+    // since the last report, interarrival jitter and buffer fill in ms
+    int expected = x->_intervalReceived + x->_intervalLost;
+    t_atom report[3];
+    SETFLOAT(&report[0], expected ? 100.f * x->_intervalLost / expected : 0);
+    SETFLOAT(&report[1], x->_jitter);
+    SETFLOAT(&report[2], decoderDelay(x) * 1000.f / x->_sampleRate);
+    outlet_anything(x->_statsOutlet, gensym("feedback"), 3, report);
+
+    x->_intervalReceived = 0;
+    x->_intervalLost = 0;
+}
+
+void opusdec_tilde_feedbackinterval(t_opusdec_tilde* x, t_floatarg interval)
+{
+    x->_feedbackInterval = interval > 0 ? interval : 0;
+    if (x->_feedbackInterval)
+        clock_delay(x->_feedbackClock, x->_feedbackInterval);
+    else
+        clock_unset(x->_feedbackClock);
+}
+
+static void feedbackTick(t_opusdec_tilde* x)
+{
+    opusdec_tilde_feedback(x);
+    if (x->_feedbackInterval)
+        clock_delay(x->_feedbackClock, x->_feedbackInterval);
+}
+
+static void updateJitter(t_opusdec_tilde* x, int frameSize)
+{
+    // RFC 3550 interarrival jitter: how much the spacing of arrivals
+    // deviates from the duration of audio they carry
+    double arrival = sys_getrealtime() * 1000;
+    if (x->_lastArrival > 0)
     {
-        if (argv[i].a_type != A_FLOAT || argv[i].a_w.w_float != (int)argv[i].a_w.w_float || argv[i].a_w.w_float < 0 || argv[i].a_w.w_float > 255)
-        {
-            error("recieved invalid packet data (%f) at byte index: %d", argv[i].a_w.w_float, i);
-            return;
-        }
-        
-        x->_packet[i] = (int)argv[i].a_w.w_float;
+        double deviation = (arrival - x->_lastArrival) - x->_mediaSinceArrival;
+        x->_jitter += (fabs(deviation) - x->_jitter) / 16;
     }
-    x->_packetSize = argc;    
+
+    x->_lastArrival = arrival;
+    x->_mediaSinceArrival = frameSize * 1000.0 / x->_sampleRate;
 }
 
-void opusdec_tilde_packet(t_opusdec_tilde* x, t_symbol* s, int argc, t_atom* argv)
+void opusdec_tilde_deferred(t_opusdec_tilde* x, t_floatarg enabled)
 {
-    verbose(LOG_LEVEL_NORMAL, "packet of size %d received", argc);
-
-    loadPacket(x, s, argc, argv);
+    int f = (enabled == 0 ? 0 : 1);
+    if (f == x->_deferred)
+        return;
 
-    if (!x->_packetSize) {
-        opusdec_tilde_bang(x);
+    if (x->_customDecoder)
+    {
+        error("custom mode always decodes in the DSP tick");
         return;
     }
 
-    int decoded = 0;
-    if (x->_lostPrevious) {
-        decoded = opus_decode_float(x->_decoder, x->_packet, x->_packetSize, x->_frameBuffer + x->_writePosition, x->_opusFrameSize, 1);
-        advanceWritePosition(x, decoded);
-        verbose(LOG_LEVEL_NORMAL, "decoded %d FEC samples", decoded);
-    }
+    x->_deferred = f;
     x->_lostPrevious = 0;
-    
-    decoded = opus_decode_float(x->_decoder, x->_packet, x->_packetSize, x->_frameBuffer + x->_writePosition, x->_opusFrameSize, 0);
-    advanceWritePosition(x, decoded);
-    verbose(LOG_LEVEL_NORMAL, "decoded %d samples from a packet of size %d", decoded, argc);
+    x->_queueHead = 0;
+    x->_queueCount = 0;
+
+    verbose(LOG_LEVEL_NORMAL, "%s decoding", f ? "deferred" : "immediate");
 }
 
-void readFrameBuffer(t_opusdec_tilde* x, float* out)
+/* The ring holds the block being read plus two frames being decoded into
+   it, so a block read never wraps past the end of the buffer. */
+static int requiredFrameBufferSize(int masterFrameSize, int frameSize)
 {
-    if (!x->_framesDecoded)
+    int size = masterFrameSize + 2 * frameSize;
+    return size > 3 * frameSize ? size : 3 * frameSize;
+}
+
+static void reserveFrameBuffer(t_opusdec_tilde* x, int frameSize)
+{
+    if (frameSize > x->_decodeBufferSize)
     {
-        memset(out, 0, x->_masterFrameSize * sizeof(float));
-        return;
+        free(x->_decodeBuffer);
+        x->_decodeBufferSize = frameSize;
+        x->_decodeBuffer = (float*)malloc(x->_decodeBufferSize * x->_channels * sizeof(float));
     }
-    
-    if (x->_readPosition + x->_masterFrameSize > x->_frameBufferSize)
+
+    int size = requiredFrameBufferSize(x->_masterFrameSize, frameSize);
+    if (size <= x->_frameBufferSize)
+        return;
+
+    // keep the buffered audio by unrolling the old ring from the read position
+    float* buffer = (float*)calloc(size * x->_channels, sizeof(float));
+    int tail = x->_frameBufferSize - x->_readPosition;
+    memcpy(buffer, x->_frameBuffer + x->_readPosition * x->_channels, tail * x->_channels * sizeof(float));
+    memcpy(buffer + tail * x->_channels, x->_frameBuffer, x->_readPosition * x->_channels * sizeof(float));
+
+    x->_writePosition = (x->_writePosition - x->_readPosition + x->_frameBufferSize) % x->_frameBufferSize;
+    x->_readPosition = 0;
+
+    free(x->_frameBuffer);
+    x->_frameBuffer = buffer;
+    x->_frameBufferSize = size;
+
+    verbose(LOG_LEVEL_NORMAL, "frame buffer grown to %d samples for frames of %d samples", size, frameSize);
+}
+
+static void advanceWritePosition(t_opusdec_tilde* x, int samples) {
+    if (samples <= 0)
     {
-        int count = x->_frameBufferSize - x->_readPosition;
-        memcpy(out, x->_frameBuffer + x->_readPosition, count * sizeof(float));
-        memcpy(out + count, x->_frameBuffer, (x->_masterFrameSize - count) * sizeof(float));
+        x->_decodeErrors++;
+        error("failed to decode OPUS frame: %s", opus_strerror(samples ? samples : OPUS_INVALID_PACKET));
+        return;
     }
-    else
+
+    x->_bufferedSamples += samples;
+    if (x->_bufferedSamples > x->_frameBufferSize)
     {
-        memcpy(out, x->_frameBuffer + x->_readPosition, x->_masterFrameSize * sizeof(float));
+        x->_overruns++;
+        x->_bufferedSamples = x->_frameBufferSize;
     }
-    x->_readPosition = (x->_readPosition + x->_masterFrameSize) % x->_frameBufferSize;
+
+    x->_writePosition = (x->_writePosition + samples) % x->_frameBufferSize;
+    x->_framesDecoded = 1;
 }
 
-t_int* opusdec_tilde_perform(t_int* w)
+static int hasDecoder(t_opusdec_tilde* x)
 {
-    t_opusdec_tilde* x = (t_opusdec_tilde*)(w[1]);
-    t_sample* out = (t_sample*)(w[2]);
-    int n = (int)(w[3]);
-    
-    setBufferSizes(x, n, x->_opusFrameSize);
-    
-    readFrameBuffer(x, out);
-    
-    return w + 4;
+    return x->_decoder || x->_projectionDecoder || x->_customDecoder;
+}
+
+static int isDirectDecode(t_opusdec_tilde* x)
+{
+    return x->_customDecoder && x->_masterFrameSize % x->_customFrameSize == 0;
+}
+
+static int decoderDelay(t_opusdec_tilde* x)
+{
+    // queued packets plus whatever the frame buffer holds ahead of the output
+    int delay = x->_queueCount * x->_opusFrameSize;
+    if (!isDirectDecode(x))
+        delay += x->_bufferedSamples;
+    return delay;
+}
+
+static int algorithmicDelay(t_opusdec_tilde* x)
+{
+    if (x->_customMode)
+        return x->_customFrameSize + x->_customMode->overlap;
+
+    // the output trails the encoder's input by a frame plus its lookahead;
+    // a stamped packet tells the actual lookahead, otherwise it is the
+    // default of the encoder (2.5 ms, plus 4 ms of delay compensation
+    // outside the restricted low delay application)
+    int lookahead = x->_stampedLookahead >= 0 ? x->_stampedLookahead : x->_sampleRate / 400 + x->_sampleRate / 250;
+    return x->_opusFrameSize + lookahead;
+}
+
+static int packetFrameSize(t_opusdec_tilde* x, const unsigned char* data, int size)
+{
+    // custom mode packets have no TOC byte
+    if (x->_customDecoder)
+        return x->_customFrameSize;
+
+    return opus_packet_get_nb_samples(data, size, x->_sampleRate);
+}
+
+static int decodeFrame(t_opusdec_tilde* x, const unsigned char* data, int size, int decodeFec)
+{
+    // packets carry their own duration; PLC repeats the last one
+    int frameSize = data ? packetFrameSize(x, data, size) : x->_opusFrameSize;
+    if (frameSize <= 0)
+        return frameSize ? frameSize : OPUS_INVALID_PACKET;
+    if (requiredFrameBufferSize(x->_masterFrameSize, frameSize) > x->_frameBufferSize || frameSize > x->_decodeBufferSize)
+        return OPUS_BUFFER_TOO_SMALL;
+
+    int wraps = x->_writePosition + frameSize > x->_frameBufferSize;
+    float* pcm = wraps ? x->_decodeBuffer : x->_frameBuffer + x->_writePosition * x->_channels;
+    int decoded = decodeInto(x, data, size, decodeFec, pcm, frameSize);
+
+    if (decoded > 0 && wraps)
+    {
+        int count = x->_frameBufferSize - x->_writePosition;
+        if (count > decoded)
+            count = decoded;
+        memcpy(x->_frameBuffer + x->_writePosition * x->_channels, pcm, count * x->_channels * sizeof(float));
+        memcpy(x->_frameBuffer, pcm + count * x->_channels, (decoded - count) * x->_channels * sizeof(float));
+    }
+
+    if (decoded > 0 && data && !decodeFec)
+        x->_opusFrameSize = decoded;
+
+    return decoded;
+}
+
+static int decodeInto(t_opusdec_tilde* x, const unsigned char* data, int size, int decodeFec, float* pcm, int frameSize)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int decoded = 0;
+    if (x->_customDecoder)
+        decoded = opus_custom_decode_float(x->_customDecoder, data, size, pcm, frameSize);
+    else if (x->_projectionDecoder)
+        decoded = opus_projection_decode_float(x->_projectionDecoder, data, size, pcm, frameSize, decodeFec);
+    else
+        decoded = opusDecodeFrame(x->_decoder, data, size, pcm, frameSize, decodeFec);
+
+    int us = elapsedMicroseconds(&start);
+    int bucket = 0;
+    for (int limit = DECODE_TIME_FIRST_BUCKET_US; us >= limit && bucket < DECODE_TIME_BUCKETS - 1; limit *= 2)
+        bucket++;
+    x->_decodeTimes[bucket]++;
+
+    if (!data)
+        x->_plcFrames++;
+    else if (decodeFec)
+        x->_fecFrames++;
+
+    return decoded;
+}
+
+void opusdec_tilde_demixing(t_opusdec_tilde* x, t_symbol* s, int argc, t_atom* argv)
+{
+    if (argc < 3)
+    {
+        error("demixing matrix message must start with channels, streams and coupled streams");
+        return;
+    }
+
+    int channels = atom_getint(&argv[0]);
+    int streams = atom_getint(&argv[1]);
+    int coupledStreams = atom_getint(&argv[2]);
+    int size = argc - 3;
+
+    if (channels != x->_channels)
+    {
+        error("demixing matrix is for %d channels but the decoder has %d", channels, x->_channels);
+        return;
+    }
+
+    if (streams < 1 || coupledStreams < 0 || coupledStreams > streams || size != 2 * channels * (streams + coupledStreams))
+    {
+        error("invalid demixing matrix for %d stream(s), %d coupled, of %d bytes", streams, coupledStreams, size);
+        return;
+    }
+
+    unsigned char* matrix = (unsigned char*)malloc(size);
+    for (int i = 0; i < size; ++i)
+    {
+        int byte = atomToByte(&argv[3 + i]);
+        if (byte < 0)
+        {
+            error("recieved invalid demixing matrix data at byte index: %d", i);
+            free(matrix);
+            return;
+        }
+        matrix[i] = byte;
+    }
+
+    if (x->_projectionDecoder && x->_streams == streams && x->_coupledStreams == coupledStreams && !memcmp(x->_demixingMatrix, matrix, size))
+    {
+        free(matrix);
+        return;
+    }
+
+    int err = 0;
+    OpusProjectionDecoder* decoder = opus_projection_decoder_create(x->_sampleRate, channels, streams, coupledStreams, matrix, size, &err);
+    if (err)
+    {
+        error("could not create OPUS projection decoder: %s", opus_strerror(err));
+        free(matrix);
+        return;
+    }
+
+    if (x->_projectionDecoder)
+        opus_projection_decoder_destroy(x->_projectionDecoder);
+    if (x->_demixingMatrix)
+        free(x->_demixingMatrix);
+
+    x->_projectionDecoder = decoder;
+    x->_demixingMatrix = matrix;
+    x->_demixingMatrixSize = size;
+    x->_streams = streams;
+    x->_coupledStreams = coupledStreams;
+    x->_lostPrevious = 0;
+
+    verbose(LOG_LEVEL_NORMAL, "OPUS projection decoder initialised @%dhz with %d stream(s), %d coupled", x->_sampleRate, streams, coupledStreams);
+}
+
+void opusdec_tilde_bang(t_opusdec_tilde* x)
+{
+    // a loss marker keeps the decoder awake but doesn't wake it up
+    x->_lastActivity = clock_getlogicaltime();
+    if (!hasDecoder(x))
+        return;
+
+    x->_intervalLost++;
+    x->_mediaSinceArrival += x->_opusFrameSize * 1000.0 / x->_sampleRate;
+
+    if (x->_deferred) {
+        enqueuePacket(x, 0, 0);
+        return;
+    }
+
+    if (x->_lostPrevious) {
+        int decoded = decodeFrame(x, 0, 0, 0);
+        advanceWritePosition(x, decoded);
+        verbose(LOG_LEVEL_NORMAL, "generated %d PLC samples", decoded);
+    }
+    x->_lostPrevious = 1;
+}
+
+static int atomToByte(const t_atom* a)
+{
+    if (a->a_type != A_FLOAT || a->a_w.w_float != (int)a->a_w.w_float || a->a_w.w_float < 0 || a->a_w.w_float > 255)
+        return -1;
+
+    return (int)a->a_w.w_float;
+}
+
+static void loadPacket(t_opusdec_tilde* x, t_symbol* s, int argc, t_atom* argv)
+{
+    x->_packetSize = 0;
+    if (argc > x->_maxPacketSize)
+    {
+        error("recieved packet of %d bytes exceeds the maximum of %d", argc, x->_maxPacketSize);
+        return;
+    }
+
+    for (int i = 0; i < argc; ++i)
+    {
+        int byte = atomToByte(&argv[i]);
+        if (byte < 0)
+        {
+            error("recieved invalid packet data (%f) at byte index: %d", argv[i].a_w.w_float, i);
+            return;
+        }
+        
+        x->_packet[i] = byte;
+    }
+    x->_packetSize = argc;    
+}
+
+void opusdec_tilde_packet(t_opusdec_tilde* x, t_symbol* s, int argc, t_atom* argv)
+{
+    verbose(LOG_LEVEL_NORMAL, "packet of size %d received", argc);
+
+    x->_lastActivity = clock_getlogicaltime();
+    if (x->_hibernating && (!argc || !wake(x)))
+        return;
+
+    if (!hasDecoder(x))
+    {
+        verbose(LOG_LEVEL_NORMAL, "packet dropped: no demixing matrix received yet");
+        return;
+    }
+
+    loadPacket(x, s, argc, argv);
+
+    if (argc)
+    {
+        x->_packetsReceived++;
+        if (!x->_packetSize)
+            x->_invalidPackets++;
+    }
+
+    if (!x->_packetSize) {
+        opusdec_tilde_bang(x);
+        return;
+    }
+
+    receivePacket(x, x->_packet, x->_packetSize);
+}
+
+static void receivePacket(t_opusdec_tilde* x, const unsigned char* data, int size)
+{
+    OPUSTRACE_BEGIN(packet);
+    int frameSize = packetFrameSize(x, data, size);
+    reserveFrameBuffer(x, frameSize);
+    updateJitter(x, frameSize);
+    x->_intervalReceived++;
+
+    if (x->_deferred) {
+        enqueuePacket(x, data, size);
+        OPUSTRACE_END(packet, OPUSTRACE_PACKET, x, size);
+        return;
+    }
+
+    int decoded = 0;
+    if (x->_lostPrevious) {
+        decoded = decodeFrame(x, data, size, 1);
+        advanceWritePosition(x, decoded);
+        verbose(LOG_LEVEL_NORMAL, "decoded %d FEC samples", decoded);
+    }
+    x->_lostPrevious = 0;
+    
+    noteLatencyStamp(x, data, size, latencyProbeClock());
+    decoded = decodeFrame(x, data, size, 0);
+    advanceWritePosition(x, decoded);
+    verbose(LOG_LEVEL_NORMAL, "decoded %d samples from a packet of size %d", decoded, size);
+    OPUSTRACE_END(packet, OPUSTRACE_PACKET, x, size);
+}
+
+void opusdec_tilde_trace(t_opusdec_tilde* x, t_symbol* s)
+{
+#ifdef PDOPUS_TRACE
+    if (!*s->s_name)
+    {
+        opusTraceFile(0);
+        verbose(LOG_LEVEL_NORMAL, "tracing stopped, %d span(s) dropped", opusTraceDropped());
+        return;
+    }
+
+    char path[MAXPDSTRING];
+    canvas_makefilename(x->_canvas, s->s_name, path, MAXPDSTRING);
+
+    if (!opusTraceFile(path))
+    {
+        error("could not open trace file %s", path);
+        return;
+    }
+
+    verbose(LOG_LEVEL_NORMAL, "tracing to %s", path);
+#else
+    error("opusdec~ was built without PDOPUS_TRACE");
+#endif
+}
+
+void opusdec_tilde_receive(t_opusdec_tilde* x, t_symbol* s)
+{
+    if (x->_bus)
+    {
+        packetBusRelease(x->_bus, PACKETBUS_CONSUMER);
+        x->_bus = 0;
+        x->_busName = &s_;
+    }
+
+    if (!*s->s_name || !wake(x))
+        return;
+
+    x->_bus = packetBusAcquire(s, PACKETBUS_CONSUMER);
+    if (!x->_bus)
+        return;
+
+    // perform must never grow the frame buffer, so it is sized for the
+    // longest OPUS frame up front
+    x->_busName = s;
+    reserveFrameBuffer(x, MAX_FRAME_SIZE_MS * x->_sampleRate / 1000);
+    verbose(LOG_LEVEL_NORMAL, "reading packets from bus %s", s->s_name);
+}
+
+static void readPacketBus(t_opusdec_tilde* x)
+{
+    // packets written by [opusenc~] in this or the previous DSP tick go
+    // straight to the decoder, without atoms or a scheduler tick
+    int size;
+    while ((size = packetBusRead(x->_bus, x->_packet, x->_maxPacketSize)))
+    {
+        x->_packetsReceived++;
+        if (size < 0 || !hasDecoder(x))
+        {
+            x->_invalidPackets++;
+            continue;
+        }
+        receivePacket(x, x->_packet, size);
+    }
+}
+
+void opusdec_tilde_append(t_opusdec_tilde* x, t_symbol* s, int argc, t_atom* argv)
+{
+    if (argc > PACKETBUS_MAX_PACKET_SIZE - PACKETCAPTURE_RECORD_SIZE)
+    {
+        error("appended packet of %d bytes is too large", argc);
+        return;
+    }
+
+    size_t needed = x->_sequenceSize + PACKETCAPTURE_RECORD_SIZE + argc;
+    if (needed > x->_sequenceCapacity)
+    {
+        unsigned char* sequence = (unsigned char*)realloc(x->_sequence, 2 * needed);
+        if (!sequence)
+        {
+            error("could not append packet: %s", opus_strerror(OPUS_ALLOC_FAIL));
+            return;
+        }
+        x->_sequence = sequence;
+        x->_sequenceCapacity = 2 * needed;
+    }
+
+    // the same records as a capture file, without a timestamp
+    unsigned char* record = x->_sequence + x->_sequenceSize;
+    for (int i = 0; i < argc; ++i)
+    {
+        int byte = atomToByte(&argv[i]);
+        if (byte < 0)
+        {
+            error("recieved invalid packet data at byte index: %d", i);
+            return;
+        }
+        record[PACKETCAPTURE_RECORD_SIZE + i] = byte;
+    }
+
+    double time = -1;
+    uint16_t size = argc;
+    memcpy(record, &time, 8);
+    memcpy(record + 8, &size, 2);
+    record[10] = 0;
+    record[11] = 0;
+    x->_sequenceSize = needed;
+}
+
+void opusdec_tilde_clear(t_opusdec_tilde* x)
+{
+    free(x->_sequence);
+    x->_sequence = 0;
+    x->_sequenceSize = 0;
+    x->_sequenceCapacity = 0;
+}
+
+void opusdec_tilde_decodearray(t_opusdec_tilde* x, t_symbol* table, t_symbol* file)
+{
+    if (x->_job)
+    {
+        error("%s: still decoding into the last table", table->s_name);
+        return;
+    }
+
+    if (x->_channels > 1 || x->_customFrameSize)
+    {
+        error("decodearray needs a mono decoder");
+        return;
+    }
+
+    t_garray* array = (t_garray*)pd_findbyclass(table, garray_class);
+    if (!array)
+    {
+        error("%s: no such array", table->s_name);
+        return;
+    }
+
+    DecodeJob* job = (DecodeJob*)calloc(1, sizeof(DecodeJob));
+    if (!job)
+    {
+        error("%s: out of memory", table->s_name);
+        return;
+    }
+
+    job->_table = table;
+    job->_sampleRate = x->_sampleRate;
+
+    if (*file->s_name)
+    {
+        char path[MAXPDSTRING];
+        int sampleRate, channels;
+        canvas_makefilename(x->_canvas, file->s_name, path, MAXPDSTRING);
+        job->_size = packetCaptureMap(path, &job->_data, &sampleRate, &channels);
+        job->_start = PACKETCAPTURE_HEADER_SIZE;
+        job->_mapped = 1;
+        if (!job->_size || channels != 1)
+        {
+            error("%s is not a mono packet capture", path);
+            freeDecodeJob(job);
+            return;
+        }
+    }
+    else
+    {
+        if (!x->_sequenceSize)
+        {
+            error("no packets appended to decode");
+            free(job);
+            return;
+        }
+
+        // the job takes over the appended packets
+        job->_data = x->_sequence;
+        job->_size = x->_sequenceSize;
+        x->_sequence = 0;
+        opusdec_tilde_clear(x);
+    }
+
+    int err = 0;
+    job->_decoder = acquireDecoder(job->_sampleRate, &err);
+    job->_sampleCount = decodedSampleCount(job);
+    job->_samples = (float*)calloc(job->_sampleCount + 1, sizeof(float));
+    atomic_init(&job->_done, 0);
+    atomic_init(&job->_cancel, 0);
+
+    if (!err && !job->_samples)
+        err = OPUS_ALLOC_FAIL;
+
+    if (err || pthread_create(&job->_thread, 0, decodeJobThread, job))
+    {
+        error("could not start decoding into %s", table->s_name);
+        freeDecodeJob(job);
+        return;
+    }
+
+    // the table gets its final length right away and the samples once
+    // they are all decoded
+    if (garray_npoints(array) != job->_sampleCount)
+        garray_resize_long(array, job->_sampleCount);
+
+    x->_job = job;
+    clock_delay(x->_jobClock, DECODE_JOB_POLL_MS);
+    verbose(LOG_LEVEL_NORMAL, "decoding %d samples into %s", job->_sampleCount, table->s_name);
+}
+
+// yields the next packet, or a loss with size 0; returns 0 at the end
+static int nextDecodeEntry(DecodeJob* job, DecodeCursor* cursor, const unsigned char** data, int* size)
+{
+    *data = 0;
+    *size = 0;
+    if (cursor->_pendingLosses)
+    {
+        cursor->_pendingLosses--;
+        return 1;
+    }
+
+    if (cursor->_pendingData)
+    {
+        *data = cursor->_pendingData;
+        *size = cursor->_pendingSize;
+        cursor->_pendingData = 0;
+        return 1;
+    }
+
+    // demixing records carry no audio
+    PacketRecord record;
+    do
+    {
+        size_t next = packetCaptureRecord(job->_data, job->_size, cursor->_offset, &record);
+        if (!next)
+            return 0;
+        cursor->_offset = next;
+    } while (record._flags & PACKETCAPTURE_DEMIXING);
+
+    // a gap in the capture timestamps is lost packets, at the previous
+    // packet's duration
+    if (record._time >= 0 && cursor->_lastTime >= 0 && cursor->_lastFrameMs > 0)
+    {
+        int missing = (int)((record._time - cursor->_lastTime) / cursor->_lastFrameMs + 0.5f) - 1;
+        cursor->_pendingLosses = missing < 0 ? 0 : missing > DECODE_JOB_MAX_GAP ? DECODE_JOB_MAX_GAP : missing;
+    }
+    cursor->_lastTime = record._time;
+
+    int samples = record._size ? opus_packet_get_nb_samples(record._data, record._size, 48000) : 0;
+    if (samples > 0)
+        cursor->_lastFrameMs = samples / 48.f;
+
+    if (!record._size)
+        cursor->_pendingLosses++;
+    else
+    {
+        cursor->_pendingData = record._data;
+        cursor->_pendingSize = record._size;
+    }
+    return nextDecodeEntry(job, cursor, data, size);
+}
+
+static int decodedSampleCount(DecodeJob* job)
+{
+    // every loss is concealed at the length of the packet before it
+    DecodeCursor cursor = { job->_start, -1, 0, 0, 0, 0 };
+    const unsigned char* data;
+    int size;
+    int count = 0;
+    int lastFrame = job->_sampleRate / 50;
+    while (nextDecodeEntry(job, &cursor, &data, &size))
+    {
+        int frameSize = size ? opus_packet_get_nb_samples(data, size, job->_sampleRate) : 0;
+        if (frameSize > 0)
+            lastFrame = frameSize;
+        count += lastFrame;
+    }
+    return count;
+}
+
+static void decodeJobFrame(DecodeJob* job, const unsigned char* data, int size, int frameSize, int decodeFec)
+{
+    if (job->_decoded + frameSize > job->_sampleCount)
+    {
+        job->_errors++;
+        return;
+    }
+
+    // a failed frame stays silent so the rest keeps its place
+    int decoded = opusDecodeFrame(job->_decoder, data, size, job->_samples + job->_decoded, frameSize, decodeFec);
+    if (decoded < 0)
+        job->_errors++;
+    else if (!data)
+        job->_plcFrames++;
+    else if (decodeFec)
+        job->_fecFrames++;
+    job->_decoded += decoded > 0 ? decoded : frameSize;
+}
+
+static void* decodeJobThread(void* arg)
+{
+    // the same loss handling as packets decoded on arrival: a loss is
+    // concealed once the next entry shows whether FEC can recover it
+    DecodeJob* job = (DecodeJob*)arg;
+    DecodeCursor cursor = { job->_start, -1, 0, 0, 0, 0 };
+    const unsigned char* data;
+    int size;
+    int lastFrame = job->_sampleRate / 50;
+    int lostPrevious = 0;
+
+    while (!atomic_load(&job->_cancel) && nextDecodeEntry(job, &cursor, &data, &size))
+    {
+        int frameSize = size ? opus_packet_get_nb_samples(data, size, job->_sampleRate) : 0;
+        if (frameSize <= 0)
+        {
+            if (lostPrevious)
+                decodeJobFrame(job, 0, 0, lastFrame, 0);
+            lostPrevious = 1;
+            continue;
+        }
+
+        if (lostPrevious)
+            decodeJobFrame(job, data, size, lastFrame, 1);
+        lostPrevious = 0;
+
+        decodeJobFrame(job, data, size, frameSize, 0);
+        lastFrame = frameSize;
+    }
+
+    if (lostPrevious)
+        decodeJobFrame(job, 0, 0, lastFrame, 0);
+
+    atomic_store(&job->_done, 1);
+    return 0;
+}
+
+static void freeDecodeJob(DecodeJob* job)
+{
+    if (job->_mapped && job->_size)
+        packetCaptureUnmap(job->_data, job->_size);
+    else if (!job->_mapped)
+        free((void*)job->_data);
+    if (job->_decoder)
+        releaseDecoder(job->_decoder);
+    free(job->_samples);
+    free(job);
+}
+
+static void decodeJobTick(t_opusdec_tilde* x)
+{
+    DecodeJob* job = x->_job;
+    if (!atomic_load(&job->_done))
+    {
+        clock_delay(x->_jobClock, DECODE_JOB_POLL_MS);
+        return;
+    }
+
+    pthread_join(job->_thread, 0);
+    x->_job = 0;
+
+    // copied in one go on the message thread, so DSP never sees a half
+    // decoded table
+    t_garray* array = (t_garray*)pd_findbyclass(job->_table, garray_class);
+    int size = 0;
+    t_word* words = 0;
+    if (array && garray_npoints(array) != job->_sampleCount)
+        garray_resize_long(array, job->_sampleCount);
+    if (!array || !garray_getfloatwords(array, &size, &words))
+    {
+        error("%s: array went away while decoding", job->_table->s_name);
+        freeDecodeJob(job);
+        return;
+    }
+
+    for (int i = 0; i < size && i < job->_sampleCount; ++i)
+        words[i].w_float = job->_samples[i];
+    garray_redraw(array);
+
+    t_atom result[4];
+    SETFLOAT(&result[0], job->_sampleCount);
+    SETFLOAT(&result[1], job->_plcFrames);
+    SETFLOAT(&result[2], job->_fecFrames);
+    SETFLOAT(&result[3], job->_errors);
+    outlet_anything(x->_statsOutlet, gensym("decodearray"), 4, result);
+
+    verbose(LOG_LEVEL_NORMAL, "decoded %d samples into %s", job->_sampleCount, job->_table->s_name);
+    freeDecodeJob(job);
+}
+
+static void enqueuePacket(t_opusdec_tilde* x, const unsigned char* data, int size)
+{
+    if (x->_queueCount == PACKET_QUEUE_SIZE)
+    {
+        x->_overruns++;
+        verbose(LOG_LEVEL_NORMAL, "packet queue overflow, dropping the oldest packet");
+        x->_queueHead = (x->_queueHead + 1) % PACKET_QUEUE_SIZE;
+        x->_queueCount--;
+    }
+
+    int slot = (x->_queueHead + x->_queueCount) % PACKET_QUEUE_SIZE;
+    if (size)
+        memcpy(x->_queueData + slot * x->_maxPacketSize, data, size);
+    x->_queueSizes[slot] = size;
+    x->_queueArrivals[slot] = latencyProbeClock();
+    x->_queueCount++;
+}
+
+static int dequeuePacket(t_opusdec_tilde* x)
+{
+    int slot = x->_queueHead;
+    x->_queueHead = (x->_queueHead + 1) % PACKET_QUEUE_SIZE;
+    x->_queueCount--;
+    return slot;
+}
+
+static int availableSamples(t_opusdec_tilde* x)
+{
+    return x->_bufferedSamples;
+}
+
+static void decodeQueuedFrames(t_opusdec_tilde* x, int samples)
+{
+    if (!hasDecoder(x))
+        return;
+
+    while (!x->_framesDecoded || availableSamples(x) < samples)
+    {
+        int decoded = 0;
+
+        if (!x->_queueCount)
+        {
+            if (!x->_framesDecoded)
+                return;
+
+            x->_underruns++;
+            decoded = decodeFrame(x, 0, 0, 0);
+            verbose(LOG_LEVEL_NORMAL, "packet queue underrun, generated %d PLC samples", decoded);
+        }
+        else
+        {
+            int slot = dequeuePacket(x);
+            int next = x->_queueHead;
+            if (x->_queueSizes[slot])
+            {
+                noteLatencyStamp(x, x->_queueData + slot * x->_maxPacketSize, x->_queueSizes[slot], x->_queueArrivals[slot]);
+                decoded = decodeFrame(x, x->_queueData + slot * x->_maxPacketSize, x->_queueSizes[slot], 0);
+                verbose(LOG_LEVEL_NORMAL, "decoded %d samples from a queued packet of size %d", decoded, x->_queueSizes[slot]);
+            }
+            else if (x->_queueCount && x->_queueSizes[next] && !x->_customDecoder)
+            {
+                decoded = decodeFrame(x, x->_queueData + next * x->_maxPacketSize, x->_queueSizes[next], 1);
+                verbose(LOG_LEVEL_NORMAL, "decoded %d FEC samples from the next queued packet", decoded);
+            }
+            else
+            {
+                decoded = decodeFrame(x, 0, 0, 0);
+                verbose(LOG_LEVEL_NORMAL, "generated %d PLC samples", decoded);
+            }
+        }
+
+        advanceWritePosition(x, decoded);
+        if (decoded <= 0)
+            return;
+    }
+}
+
+static void decodeCustomFrames(t_opusdec_tilde* x, t_sample** out, int samples)
+{
+    // each custom frame is decoded straight into its place in the output
+    // block, so the decoder adds no buffering beyond the packet queue
+    int frameSize = x->_customFrameSize;
+    for (int offset = 0; offset < samples; offset += frameSize)
+    {
+        const unsigned char* data = 0;
+        int size = 0;
+
+        if (x->_queueCount)
+        {
+            int slot = dequeuePacket(x);
+            size = x->_queueSizes[slot];
+            if (size)
+                data = x->_queueData + slot * x->_maxPacketSize;
+        }
+        else if (x->_framesDecoded)
+        {
+            x->_underruns++;
+        }
+        else
+        {
+            memset(out[0] + offset, 0, frameSize * sizeof(t_sample));
+            continue;
+        }
+
+        int decoded = decodeInto(x, data, size, 0, x->_decodeBuffer, frameSize);
+        if (decoded <= 0)
+        {
+            x->_decodeErrors++;
+            error("failed to decode OPUS custom frame: %s", opus_strerror(decoded ? decoded : OPUS_INVALID_PACKET));
+            memset(out[0] + offset, 0, frameSize * sizeof(t_sample));
+            continue;
+        }
+
+        copyFloatToSamples(out[0] + offset, x->_decodeBuffer, frameSize);
+        x->_framesDecoded = 1;
+    }
+}
+
+static void noteLatencyStamp(t_opusdec_tilde* x, const unsigned char* data, int size, uint64_t arrival)
+{
+    uint64_t captured;
+    int lookahead;
+    if (x->_customDecoder || x->_stampCount == PACKET_QUEUE_SIZE
+        || !latencyProbeRead(data, size, x->_projectionDecoder != 0, &captured, &lookahead))
+        return;
+
+    // the frame plays once everything ahead of it in the frame buffer has played
+    LatencyStamp* stamp = &x->_stamps[(x->_stampHead + x->_stampCount) % PACKET_QUEUE_SIZE];
+    stamp->_captured = captured;
+    stamp->_arrival = arrival;
+    stamp->_lookahead = lookahead;
+    stamp->_frameSize = opus_packet_get_nb_samples(data, size, LATENCYPROBE_RATE);
+    stamp->_due = x->_bufferedSamples;
+    x->_stampCount++;
+    x->_stampedLookahead = (int)((int64_t)lookahead * x->_sampleRate / LATENCYPROBE_RATE);
+}
+
+static void playLatencyStamps(t_opusdec_tilde* x)
+{
+    // perform runs at the logical time the block ends at, as in [opusenc~]
+    const double msPerSample = 1000.0 / LATENCYPROBE_RATE;
+    int64_t blockStart = (int64_t)latencyProbeClock() - (int64_t)x->_masterFrameSize * LATENCYPROBE_RATE / x->_sampleRate;
+    int played = 0;
+
+    for (int i = 0; i < x->_stampCount; ++i)
+    {
+        LatencyStamp* stamp = &x->_stamps[(x->_stampHead + i) % PACKET_QUEUE_SIZE];
+        if (stamp->_due >= x->_masterFrameSize)
+        {
+            stamp->_due -= x->_masterFrameSize;
+            continue;
+        }
+
+        // the decoder output trails its input by the encoder lookahead, so
+        // the codec delay is that plus the frame it had to wait for
+        int64_t play = blockStart + (int64_t)(stamp->_due > 0 ? stamp->_due : 0) * LATENCYPROBE_RATE / x->_sampleRate;
+        x->_latency[1] = (stamp->_frameSize + stamp->_lookahead) * msPerSample;
+        x->_latency[2] = ((int64_t)(stamp->_arrival - stamp->_captured) - stamp->_frameSize) * msPerSample;
+        x->_latency[3] = (play - (int64_t)stamp->_arrival) * msPerSample;
+        x->_latency[0] = x->_latency[1] + x->_latency[2] + x->_latency[3];
+        x->_latencyReports++;
+        x->_latencySum += x->_latency[0];
+        played++;
+    }
+
+    // stamps are queued in the order they play, so the played ones lead
+    if (played)
+    {
+        x->_stampHead = (x->_stampHead + played) % PACKET_QUEUE_SIZE;
+        x->_stampCount -= played;
+        clock_delay(x->_latencyClock, 0);
+    }
+}
+
+static void latencyTick(t_opusdec_tilde* x)
+{
+    // total, codec, transport and buffering delay of the last stamped frame
+    t_atom report[4];
+    for (int i = 0; i < 4; ++i)
+        SETFLOAT(&report[i], x->_latency[i]);
+    outlet_anything(x->_statsOutlet, gensym("latency"), 4, report);
+}
+
+static void deinterleaveFrameBuffer(t_opusdec_tilde* x, t_sample** out, int offset, int position, int count)
+{
+    const float* frame = x->_frameBuffer + position * x->_channels;
+    for (int i = 0; i < count; ++i)
+        for (int c = 0; c < x->_channels; ++c)
+            out[c][offset + i] = *frame++;
+}
+
+static void readFrameBuffer(t_opusdec_tilde* x, t_sample** out)
+{
+    if (!x->_framesDecoded)
+    {
+        for (int c = 0; c < x->_channels; ++c)
+            memset(out[c], 0, x->_masterFrameSize * sizeof(t_sample));
+        return;
+    }
+
+    OPUSTRACE_BEGIN(read);
+    if (x->_stampCount)
+        playLatencyStamps(x);
+
+    if (x->_bufferedSamples < x->_masterFrameSize)
+    {
+        x->_underruns++;
+        x->_bufferedSamples = 0;
+    }
+    else
+    {
+        x->_bufferedSamples -= x->_masterFrameSize;
+    }
+    
+    if (x->_channels > 1)
+    {
+        int count = x->_readPosition + x->_masterFrameSize > x->_frameBufferSize ? x->_frameBufferSize - x->_readPosition : x->_masterFrameSize;
+        deinterleaveFrameBuffer(x, out, 0, x->_readPosition, count);
+        deinterleaveFrameBuffer(x, out, count, 0, x->_masterFrameSize - count);
+    }
+    else if (x->_readPosition + x->_masterFrameSize > x->_frameBufferSize)
+    {
+        int count = x->_frameBufferSize - x->_readPosition;
+        copyFloatToSamples(out[0], x->_frameBuffer + x->_readPosition, count);
+        copyFloatToSamples(out[0] + count, x->_frameBuffer, x->_masterFrameSize - count);
+    }
+    else
+    {
+        copyFloatToSamples(out[0], x->_frameBuffer + x->_readPosition, x->_masterFrameSize);
+    }
+    x->_readPosition = (x->_readPosition + x->_masterFrameSize) % x->_frameBufferSize;
+    OPUSTRACE_END(read, OPUSTRACE_READ, x, x->_masterFrameSize);
+}
+
+t_int* opusdec_tilde_perform(t_int* w)
+{
+    t_opusdec_tilde* x = (t_opusdec_tilde*)(w[1]);
+    int n = (int)(w[2]);
+    t_sample** out = (t_sample**)(w + 3);
+
+    if (x->_hibernating)
+    {
+        memset(out[0], 0, n * sizeof(t_sample));
+        return w + x->_channels + 3;
+    }
+
+    if (x->_bus)
+        readPacketBus(x);
+
+    if (isDirectDecode(x))
+    {
+        decodeCustomFrames(x, out, n);
+        return w + x->_channels + 3;
+    }
+    
+    if (x->_deferred)
+        decodeQueuedFrames(x, n);
+
+    readFrameBuffer(x, out);
+    
+    return w + x->_channels + 3;
+}
+
+/* Mono perform routines for fixed block sizes. When a block can be read
+   from the frame buffer without wrapping or running dry, it is one copy of
+   a compile time length; hibernation, the packet bus, deferred and custom
+   decoding, underruns, wraparound and frames waiting for a latency report
+   all go through the generic routine. */
+#define DEFINE_PERFORM_ROUTINE(N) \
+static t_int* opusdec_tilde_perform_##N(t_int* w) \
+{ \
+    t_opusdec_tilde* x = (t_opusdec_tilde*)(w[1]); \
+    if (x->_hibernating || x->_bus || x->_deferred || x->_customDecoder || !x->_framesDecoded || x->_stampCount \
+        || x->_bufferedSamples < N || x->_readPosition + N > x->_frameBufferSize) \
+        return opusdec_tilde_perform(w); \
+    OPUSTRACE_BEGIN(read); \
+    copyFloatToSamples((t_sample*)(w[3]), x->_frameBuffer + x->_readPosition, N); \
+    x->_bufferedSamples -= N; \
+    x->_readPosition += N; \
+    if (x->_readPosition == x->_frameBufferSize) \
+        x->_readPosition = 0; \
+    OPUSTRACE_END(read, OPUSTRACE_READ, x, N); \
+    return w + 4; \
+}
+
+#ifndef PDOPUS_GENERIC_PERFORM
+DEFINE_PERFORM_ROUTINE(32)
+DEFINE_PERFORM_ROUTINE(64)
+DEFINE_PERFORM_ROUTINE(128)
+DEFINE_PERFORM_ROUTINE(256)
+#endif
+
+static t_perfroutine performRoutine(t_opusdec_tilde* x, int blockSize)
+{
+    // PDOPUS_GENERIC_PERFORM leaves only the generic routine, which is
+    // what pdopusbench-generic measures the specialised ones against
+#ifndef PDOPUS_GENERIC_PERFORM
+    if (x->_channels > 1)
+        return opusdec_tilde_perform;
+
+    switch (blockSize) {
+        case 32: return opusdec_tilde_perform_32;
+        case 64: return opusdec_tilde_perform_64;
+        case 128: return opusdec_tilde_perform_128;
+        case 256: return opusdec_tilde_perform_256;
+        default:
+            break;
+    }
+#endif
+    return opusdec_tilde_perform;
 }
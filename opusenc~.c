@@ -1,10 +1,36 @@
 #include "m_pd.h"
+#include "samplecopy.h"
+#include "opuscodec.h"
+#include "codecpool.h"
+#include "opustrace.h"
+#include "packetbus.h"
+#include "packetcapture.h"
+#include "latencyprobe.h"
 #include <opus.h>
 #include <opus_private.h>
+#include <opus_projection.h>
+#include <opus_custom.h>
+#include <modes.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define MAX_PACKET_SIZE 1024
+#define AMBISONICS_MAPPING_FAMILY 3
+#define MIN_FRAME_SIZE_MS 2.5f
+#define MAX_FRAME_SIZE_MS 120
+#define CUSTOM_BITRATE 128000
+#define ADAPT_MIN_BITRATE 6000
+#define ADAPT_MAX_BITRATE 256000
+#define ENCODE_JOB_POLL_MS 10
+#define ENCODE_JOB_OUTPUT_MS 1
+#define ENCODE_JOB_PACKETS_PER_TICK 32
+
+#define ENCODER_CTL(x, ...) ((x)->_customEncoder ? \
+    opus_custom_encoder_ctl((x)->_customEncoder, __VA_ARGS__) : \
+    (x)->_projectionEncoder ? \
+    opus_projection_encoder_ctl((x)->_projectionEncoder, __VA_ARGS__) : \
+    opus_encoder_ctl((x)->_encoder, __VA_ARGS__))
 
 static t_class* opusenc_tilde_class;
 
@@ -17,10 +43,66 @@ enum LOG_LEVEL
 typedef struct _packet
 {
     int _size;
-    unsigned char _data[MAX_PACKET_SIZE];
+    unsigned char* _data;
     float _dbov;
+    double _time;
 } Packet;
 
+/* An offline encode of a table on a background thread. The samples are
+   copied out of the array and the encoder state is copied from the live
+   one, so the thread shares nothing with Pd until it sets _done. Packets
+   go to a capture file or are collected in _packets as 16 bit size, dBov
+   byte and data records, which are output a few at a time once the
+   thread has been joined. */
+typedef struct _encodejob
+{
+    OpusEncoder* _encoder;
+    float* _samples;
+    int _sampleCount;
+    int _sampleRate;
+    int _frameSize;
+    int _maxPacketSize;
+    FILE* _file;
+    unsigned char* _packets;
+    size_t _packetsSize;
+    size_t _packetsCapacity;
+    int _packetCount;
+    size_t _outputPosition;
+    int _error;
+    pthread_t _thread;
+    int _joined;
+    _Atomic int _done;
+    _Atomic int _cancel;
+} EncodeJob;
+
+/* A named set of encoder settings that trade CPU against bits, applied as
+   a whole at a frame boundary. The bitrate is per channel. */
+typedef struct _encoderpreset
+{
+    const char* _name;
+    int _bitrate;
+    const char* _mode;
+    int _complexity;
+    int _maxBandwidth;
+    int _vbr;
+    int _vbrConstraint;
+    int _signal;
+    int _lsbDepth;
+    int _predictionDisabled;
+    int _fec;
+    int _dtx;
+    float _frameSizeMs;
+    int _lowDelay;
+} EncoderPreset;
+
+static const EncoderPreset encoderPresets[] =
+{
+    { "lowcpu-voice", 16000, "silk", 1, OPUS_BANDWIDTH_WIDEBAND, 1, 1, OPUS_SIGNAL_VOICE, 16, 0, 1, 1, 20, 0 },
+    { "voice", 24000, "hybrid", 5, OPUS_BANDWIDTH_SUPERWIDEBAND, 1, 1, OPUS_SIGNAL_VOICE, 24, 0, 1, 1, 20, 0 },
+    { "music-hq", 96000, "celt", 10, OPUS_BANDWIDTH_FULLBAND, 1, 0, OPUS_SIGNAL_MUSIC, 24, 0, 0, 0, 20, 0 },
+    { "lowlatency", 64000, "celt", 5, OPUS_BANDWIDTH_FULLBAND, 1, 1, OPUS_AUTO, 24, 0, 0, 0, 5, 1 }
+};
+
 typedef struct _opusenc_tilde
 {
     t_object x_obj;
@@ -29,24 +111,58 @@ typedef struct _opusenc_tilde
     t_outlet* _dbovOutlet;
     t_clock* _clock;
     OpusEncoder* _encoder;
-    int _bitrate;
-    t_symbol* _mode;
-    int _fec;
-    int _dtx;
-    int _packetLoss;
+    OpusProjectionEncoder* _projectionEncoder;
+    OpusCustomMode* _customMode;
+    OpusCustomEncoder* _customEncoder;
+    int _customFrameSize;
+    int _application;
+    PacketBus* _bus;
+    PacketCapture* _capture;
+    double _captureStart;
+    t_canvas* _canvas;
+    int _channels;
+    int _streams;
+    int _coupledStreams;
+    unsigned char* _demixingMatrix;
+    int _demixingMatrixSize;
+    int _demixingMatrixPending;
+    OpusEncoderSettings _settings;
+    int _lowDelayPreviousMode;
+    const EncoderPreset* _preset;
+    const EncoderPreset* _pendingPreset;
+    int _adapt;
+    int _adaptMinBitrate;
+    int _adaptMaxBitrate;
+    int _adaptStep;
+    float _adaptBackoff;
+    float _adaptLossThreshold;
+    float _adaptJitterThreshold;
+    float _adaptMinFrameMs;
+    float _adaptMaxFrameMs;
+    float _smoothedLoss;
+    float _smoothedJitter;
     float* _buffer;
     int _writePosition;
     Packet* _packetBuffer;
+    unsigned char* _packetData;
+    t_atom* _packetAtoms;
+    int _maxPacketSize;
     int _packetBufferSize;
     int _packetCount;
     int _sampleRate;
-    int _opusFrameSizeMs;
+    float _opusFrameSizeMs;
     int _opusFrameSize;
+    int _pendingFrameSize;
+    int _timestamps;
+    int _maxFrameSize;
     int _masterFrameSize;
+    EncodeJob* _job;
+    t_clock* _jobClock;
+    t_outlet* _doneOutlet;
 } t_opusenc_tilde;
 
 void opusenc_tilde_setup();
-void* opusenc_tilde_new(t_floatarg frameSize);
+void* opusenc_tilde_new(t_symbol* s, int argc, t_atom* argv);
 void opusenc_tilde_free(t_opusenc_tilde* x);
 void opusenc_tilde_dsp(t_opusenc_tilde* x, t_signal** sp);
 void opusenc_tilde_reset(t_opusenc_tilde* x);
@@ -56,14 +172,53 @@ void opusenc_tilde_mode(t_opusenc_tilde* x, t_symbol* s);
 void opusenc_tilde_fec(t_opusenc_tilde* x, t_floatarg enabled);
 void opusenc_tilde_dtx(t_opusenc_tilde* x, t_floatarg enabled);
 void opusenc_tilde_loss(t_opusenc_tilde* x, t_floatarg loss);
+void opusenc_tilde_complexity(t_opusenc_tilde* x, t_floatarg complexity);
+void opusenc_tilde_maxbandwidth(t_opusenc_tilde* x, t_symbol* s);
+void opusenc_tilde_vbr(t_opusenc_tilde* x, t_floatarg enabled);
+void opusenc_tilde_cvbr(t_opusenc_tilde* x, t_floatarg enabled);
+void opusenc_tilde_signal(t_opusenc_tilde* x, t_symbol* s);
+void opusenc_tilde_lsbdepth(t_opusenc_tilde* x, t_floatarg depth);
+void opusenc_tilde_prediction(t_opusenc_tilde* x, t_floatarg enabled);
+void opusenc_tilde_preset(t_opusenc_tilde* x, t_symbol* s);
+void opusenc_tilde_demixing(t_opusenc_tilde* x);
+void opusenc_tilde_framesize(t_opusenc_tilde* x, t_floatarg ms);
+void opusenc_tilde_lowdelay(t_opusenc_tilde* x, t_floatarg enabled);
+void opusenc_tilde_send(t_opusenc_tilde* x, t_symbol* s);
+void opusenc_tilde_adapt(t_opusenc_tilde* x, t_floatarg enabled);
+void opusenc_tilde_adaptrange(t_opusenc_tilde* x, t_floatarg minBitrate, t_floatarg maxBitrate);
+void opusenc_tilde_adaptpolicy(t_opusenc_tilde* x, t_symbol* s, int argc, t_atom* argv);
+void opusenc_tilde_feedback(t_opusenc_tilde* x, t_symbol* s, int argc, t_atom* argv);
+void opusenc_tilde_capture(t_opusenc_tilde* x, t_symbol* s);
+void opusenc_tilde_encodearray(t_opusenc_tilde* x, t_symbol* table, t_symbol* dest);
+void opusenc_tilde_trace(t_opusenc_tilde* x, t_symbol* s);
+void opusenc_tilde_timestamps(t_opusenc_tilde* x, t_floatarg enabled);
 t_int* opusenc_tilde_perform(t_int* w);
-void setEncoderOptions(t_opusenc_tilde* x);
-int setOpusSampleRate(t_opusenc_tilde* x, int sampleRate);
-int setBufferSizes(t_opusenc_tilde* x, int masterFrameSize, int opusFrameSize);
-void writeOpusBuffer(t_opusenc_tilde* x, const float* in);
-int isOpusFrameReady(t_opusenc_tilde* x);
-void processOpusFrame(t_opusenc_tilde* x);
-void outputPacket(t_opusenc_tilde* x);
+static t_perfroutine performRoutine(t_opusenc_tilde* x, int blockSize);
+static int isAmbisonicChannelCount(int channels);
+static int initEncoder(t_opusenc_tilde* x);
+static int initCustomEncoder(t_opusenc_tilde* x);
+static int opusFrameSize(t_opusenc_tilde* x);
+static int algorithmicDelay(t_opusenc_tilde* x);
+static void postLatency(t_opusenc_tilde* x);
+static void adaptEncoder(t_opusenc_tilde* x, float loss, float fill);
+static float adjacentFrameDuration(float ms, int direction);
+static int readDemixingMatrix(t_opusenc_tilde* x);
+static void setEncoderOptions(t_opusenc_tilde* x);
+static void readEncoderDefaults(t_opusenc_tilde* x);
+static int encoderCtl(void* x, int request, opus_int32 value);
+static int applyEncoderSettings(t_opusenc_tilde* x);
+static int applyPreset(t_opusenc_tilde* x, const EncoderPreset* preset);
+static int setApplication(t_opusenc_tilde* x, int lowDelay);
+static int setOpusSampleRate(t_opusenc_tilde* x, int sampleRate);
+static int setBufferSizes(t_opusenc_tilde* x, int masterFrameSize, int opusFrameSize);
+static void writeOpusBuffer(t_opusenc_tilde* x, t_sample** in, int offset, int count);
+static void processOpusFrame(t_opusenc_tilde* x, int frameEnd);
+static int stampPacket(t_opusenc_tilde* x, Packet* packet, int frameEnd);
+static void outputPacket(t_opusenc_tilde* x);
+static void outputDemixingMatrix(t_opusenc_tilde* x);
+static void* encodeJobThread(void* arg);
+static void encodeJobTick(t_opusenc_tilde* x);
+static void freeEncodeJob(EncodeJob* job);
 
 void opusenc_tilde_setup()
 {
@@ -72,7 +227,7 @@ void opusenc_tilde_setup()
                                    (t_method)opusenc_tilde_free,
                                    sizeof(t_opusenc_tilde),
                                    CLASS_DEFAULT,
-                                   A_FLOAT,
+                                   A_GIMME,
                                    0);
     
     class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_dsp, gensym("dsp"), A_CANT, 0);
@@ -84,36 +239,155 @@ void opusenc_tilde_setup()
     class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_fec, gensym("fec"), A_FLOAT, 0);
     class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_dtx, gensym("dtx"), A_FLOAT, 0);
     class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_loss, gensym("loss"), A_FLOAT, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_complexity, gensym("complexity"), A_FLOAT, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_maxbandwidth, gensym("maxbandwidth"), A_SYMBOL, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_vbr, gensym("vbr"), A_FLOAT, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_cvbr, gensym("cvbr"), A_FLOAT, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_signal, gensym("signal"), A_SYMBOL, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_lsbdepth, gensym("lsbdepth"), A_FLOAT, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_prediction, gensym("prediction"), A_FLOAT, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_preset, gensym("preset"), A_SYMBOL, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_demixing, gensym("demixing"), 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_framesize, gensym("framesize"), A_FLOAT, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_lowdelay, gensym("lowdelay"), A_FLOAT, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_send, gensym("send"), A_DEFSYMBOL, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_adapt, gensym("adapt"), A_FLOAT, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_adaptrange, gensym("adaptrange"), A_FLOAT, A_FLOAT, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_adaptpolicy, gensym("adaptpolicy"), A_GIMME, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_feedback, gensym("feedback"), A_GIMME, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_capture, gensym("capture"), A_DEFSYMBOL, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_encodearray, gensym("encodearray"), A_SYMBOL, A_DEFSYMBOL, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_trace, gensym("trace"), A_DEFSYMBOL, 0);
+    class_addmethod(opusenc_tilde_class, (t_method)opusenc_tilde_timestamps, gensym("timestamps"), A_FLOAT, 0);
 }
 
-void* opusenc_tilde_new(t_floatarg frameSize)
+void* opusenc_tilde_new(t_symbol* s, int argc, t_atom* argv)
 {
+    int customFrameSize = 0;
+    int lowDelay = 0;
+    while (argc && argv[0].a_type == A_SYMBOL)
+    {
+        const char* flag = argv[0].a_w.w_symbol->s_name;
+        if (!strcmp(flag, "-custom") && argc >= 2)
+        {
+            customFrameSize = atom_getint(&argv[1]);
+            argc -= 2;
+            argv += 2;
+        }
+        else if (!strcmp(flag, "-lowdelay"))
+        {
+            lowDelay = 1;
+            argc--;
+            argv++;
+        }
+        else
+        {
+            error("opusenc~: unknown flag %s", flag);
+            return 0;
+        }
+    }
+
+    t_float frameSize = atom_getfloatarg(0, argc, argv);
+    t_float channels = atom_getfloatarg(1, argc, argv);
+
+    if (customFrameSize && (customFrameSize < 0 || channels > 1 || frameSize))
+    {
+        error("opusenc~: custom mode takes only a frame size in samples and is mono");
+        return 0;
+    }
+
+    if (channels > 1 && !isAmbisonicChannelCount(channels))
+    {
+        error("opusenc~: %d channels is not a supported ambisonic layout (use 4, 6, 9, 11, 16 or 18)", (int)channels);
+        return 0;
+    }
+
+    if (frameSize && !isOpusFrameDuration(frameSize))
+    {
+        error("opusenc~: frame size must be 2.5, 5, 10, 20, 40, 60, 80, 100 or 120 ms");
+        return 0;
+    }
+
     t_opusenc_tilde* x = (t_opusenc_tilde*)pd_new(opusenc_tilde_class);
     if (!x)
         return 0;
     
+    x->_channels = channels > 1 ? channels : 1;
+    for (int i = 1; i < x->_channels; ++i)
+        inlet_new(&x->x_obj, &x->x_obj.ob_pd, &s_signal, &s_signal);
+
     x->_packetOutlet = outlet_new(&x->x_obj, &s_list);
     x->_dbovOutlet = outlet_new(&x->x_obj, &s_float);
+    x->_doneOutlet = outlet_new(&x->x_obj, &s_bang);
     x->_dc = 0;
     x->_clock = clock_new(x, (t_method)outputPacket);
     x->_encoder = 0;
-    x->_bitrate = 32000;
-    x->_mode = gensym("hybrid");
-    x->_fec = 1;
-    x->_dtx = 1;
-    x->_packetLoss = 0;
+    x->_projectionEncoder = 0;
+    x->_customMode = 0;
+    x->_customEncoder = 0;
+    x->_customFrameSize = customFrameSize;
+    x->_application = lowDelay ? OPUS_APPLICATION_RESTRICTED_LOWDELAY : OPUS_APPLICATION_VOIP;
+    x->_bus = 0;
+    x->_capture = 0;
+    x->_captureStart = 0;
+    x->_canvas = canvas_getcurrent();
+    x->_streams = 1;
+    x->_coupledStreams = 0;
+    x->_demixingMatrix = 0;
+    x->_demixingMatrixSize = 0;
+    x->_demixingMatrixPending = 0;
+    x->_lowDelayPreviousMode = MODE_HYBRID;
+    x->_preset = 0;
+    x->_pendingPreset = 0;
+    x->_adapt = 0;
+    x->_adaptMinBitrate = ADAPT_MIN_BITRATE;
+    x->_adaptMaxBitrate = ADAPT_MAX_BITRATE;
+    x->_adaptStep = 2000;
+    x->_adaptBackoff = 0.85f;
+    x->_adaptLossThreshold = 2;
+    x->_adaptJitterThreshold = 20;
+    x->_adaptMinFrameMs = 0;
+    x->_adaptMaxFrameMs = 60;
+    x->_smoothedLoss = 0;
+    x->_smoothedJitter = 0;
     x->_buffer = 0;
     x->_writePosition = 0;
     x->_packetBuffer = 0;
+    x->_packetData = 0;
+    x->_packetAtoms = 0;
+    x->_maxPacketSize = 0;
     x->_packetBufferSize = 0;
     x->_packetCount = 0;
     x->_sampleRate = (int)sys_getsr();
-    x->_opusFrameSizeMs = frameSize;
+    x->_opusFrameSizeMs = frameSize > 0 ? frameSize : 20;
     x->_opusFrameSize = 0;
+    x->_pendingFrameSize = 0;
+    x->_timestamps = 0;
+    x->_maxFrameSize = 0;
     x->_masterFrameSize = 0;
+    x->_job = 0;
+    x->_jobClock = clock_new(x, (t_method)encodeJobTick);
     
     int err = 0;
-    x->_encoder = opus_encoder_create(x->_sampleRate, 1, OPUS_APPLICATION_VOIP, &err);
+    if (x->_customFrameSize)
+    {
+        if (!initCustomEncoder(x))
+        {
+            opusenc_tilde_free(x);
+            return 0;
+        }
+    }
+    else if (x->_channels > 1)
+    {
+        x->_projectionEncoder = opus_projection_ambisonics_encoder_create(x->_sampleRate, x->_channels, AMBISONICS_MAPPING_FAMILY, &x->_streams, &x->_coupledStreams, x->_application, &err);
+    }
+    else
+    {
+        // mono encoder states come from the shared codec pool
+        x->_encoder = (OpusEncoder*)codecPoolAlloc(opus_encoder_get_size(1));
+        err = x->_encoder ? opus_encoder_init(x->_encoder, x->_sampleRate, 1, x->_application) : OPUS_ALLOC_FAIL;
+    }
+
     if (err)
     {
         error("Could not create OPUS encoder: %s", opus_strerror(err));
@@ -121,21 +395,77 @@ void* opusenc_tilde_new(t_floatarg frameSize)
         return 0;
     }
 
-    verbose(LOG_LEVEL_NORMAL, "OPUS encoder initialised @%dhz", x->_sampleRate);
+    if (x->_projectionEncoder && !readDemixingMatrix(x))
+    {
+        opusenc_tilde_free(x);
+        return 0;
+    }
+
+    verbose(LOG_LEVEL_NORMAL, "OPUS encoder initialised @%dhz with %d channel(s) in %d stream(s)", x->_sampleRate, x->_channels, x->_streams);
     
+    x->_maxPacketSize = MAX_PACKET_SIZE * x->_streams;
+    x->_packetAtoms = (t_atom*)malloc(x->_maxPacketSize * sizeof(t_atom));
+
+    readEncoderDefaults(x);
     setEncoderOptions(x);
-    setBufferSizes(x, sys_getblksize(), x->_opusFrameSizeMs * x->_sampleRate / 1000);
+    setBufferSizes(x, sys_getblksize(), opusFrameSize(x));
     
     return x;
 }
 
 void opusenc_tilde_free(t_opusenc_tilde* x)
 {
+    if (x->_job)
+    {
+        atomic_store(&x->_job->_cancel, 1);
+        if (!x->_job->_joined)
+            pthread_join(x->_job->_thread, 0);
+        freeEncodeJob(x->_job);
+        x->_job = 0;
+    }
+
+    if (x->_bus)
+    {
+        packetBusRelease(x->_bus, PACKETBUS_PRODUCER);
+        x->_bus = 0;
+    }
+
+    if (x->_capture)
+    {
+        packetCaptureClose(x->_capture);
+        x->_capture = 0;
+    }
+
     if (x->_encoder)
     {
-        opus_encoder_destroy(x->_encoder);
+        codecPoolFree(x->_encoder, opus_encoder_get_size(1));
         x->_encoder = 0;
     }
+
+    if (x->_projectionEncoder)
+    {
+        opus_projection_encoder_destroy(x->_projectionEncoder);
+        x->_projectionEncoder = 0;
+    }
+
+    if (x->_customEncoder)
+    {
+        opus_custom_encoder_destroy(x->_customEncoder);
+        x->_customEncoder = 0;
+    }
+
+    if (x->_customMode)
+    {
+        opus_custom_mode_destroy(x->_customMode);
+        x->_customMode = 0;
+    }
+
+    if (x->_demixingMatrix)
+    {
+        free(x->_demixingMatrix);
+        x->_demixingMatrix = 0;
+        x->_demixingMatrixSize = 0;
+    }
     
     if (x->_packetBuffer)
     {
@@ -143,6 +473,18 @@ void opusenc_tilde_free(t_opusenc_tilde* x)
         x->_packetBuffer = 0;
         x->_packetBufferSize = 0;
     }
+
+    if (x->_packetData)
+    {
+        free(x->_packetData);
+        x->_packetData = 0;
+    }
+
+    if (x->_packetAtoms)
+    {
+        free(x->_packetAtoms);
+        x->_packetAtoms = 0;
+    }
     
     if (x->_buffer)
     {
@@ -151,112 +493,341 @@ void opusenc_tilde_free(t_opusenc_tilde* x)
     }
 
     clock_free(x->_clock);
+    clock_free(x->_jobClock);
 }
 
 void opusenc_tilde_dsp(t_opusenc_tilde* x, t_signal** sp)
 {
     setOpusSampleRate(x, sp[0]->s_sr);
+    setBufferSizes(x, sp[0]->s_n, opusFrameSize(x));
     
-    dsp_add(opusenc_tilde_perform, 3, x, sp[0]->s_vec, sp[0]->s_n);
+    t_int* vec = (t_int*)getbytes((x->_channels + 2) * sizeof(t_int));
+    vec[0] = (t_int)x;
+    vec[1] = (t_int)sp[0]->s_n;
+    for (int c = 0; c < x->_channels; ++c)
+        vec[2 + c] = (t_int)sp[c]->s_vec;
+
+    dsp_addv(performRoutine(x, sp[0]->s_n), x->_channels + 2, vec);
+    freebytes(vec, (x->_channels + 2) * sizeof(t_int));
 }
 
 void opusenc_tilde_reset(t_opusenc_tilde* x)
 {
     x->_writePosition = 0;
     x->_packetCount = 0;
+    opusenc_tilde_demixing(x);
 }
 
-float frameDuration(int code)
+void opusenc_tilde_demixing(t_opusenc_tilde* x)
 {
-    switch (code) {
-        case OPUS_FRAMESIZE_2_5_MS: return 2.5f;
-        case OPUS_FRAMESIZE_5_MS: return 5;
-        case OPUS_FRAMESIZE_10_MS: return 10;
-        case OPUS_FRAMESIZE_20_MS: return 20;
-        case OPUS_FRAMESIZE_40_MS: return 40;
-        case OPUS_FRAMESIZE_60_MS: return 60;
-        case OPUS_FRAMESIZE_80_MS: return 80;
-        case OPUS_FRAMESIZE_100_MS: return 100;
-        case OPUS_FRAMESIZE_120_MS: return 120;
-        default:
-            break;
+    if (!x->_projectionEncoder)
+        return;
+
+    x->_demixingMatrixPending = 1;
+    clock_delay(x->_clock, 0);
+}
+
+void opusenc_tilde_framesize(t_opusenc_tilde* x, t_floatarg ms)
+{
+    if (x->_customEncoder)
+    {
+        error("frame size is fixed at %d samples in custom mode", x->_customFrameSize);
+        return;
     }
-    return 0;
+
+    if (!isOpusFrameDuration(ms))
+    {
+        error("frame size must be 2.5, 5, 10, 20, 40, 60, 80, 100 or 120 ms");
+        return;
+    }
+
+    x->_opusFrameSizeMs = ms;
+    x->_preset = 0;
+    x->_pendingFrameSize = ms * x->_sampleRate / 1000;
+
+    verbose(LOG_LEVEL_NORMAL, "set encoder frame size to %g ms at the next frame boundary", ms);
 }
 
-int bandwidth(int code)
+void opusenc_tilde_lowdelay(t_opusenc_tilde* x, t_floatarg enabled)
 {
-    switch (code) {
-        case OPUS_BANDWIDTH_NARROWBAND: return 4000;
-        case OPUS_BANDWIDTH_MEDIUMBAND: return 6000;
-        case OPUS_BANDWIDTH_WIDEBAND: return 8000;
-        case OPUS_BANDWIDTH_SUPERWIDEBAND: return 12000;
-        case OPUS_BANDWIDTH_FULLBAND: return 20000;
-        default:
-            break;
+    if (x->_customEncoder)
+    {
+        error("custom mode has no application profile");
+        return;
     }
-    return 0;
-    
+
+    int lowDelay = (enabled == 0 ? 0 : 1);
+    if (lowDelay == (x->_application == OPUS_APPLICATION_RESTRICTED_LOWDELAY))
+        return;
+
+    x->_preset = 0;
+    if (setApplication(x, lowDelay))
+        verbose(LOG_LEVEL_NORMAL, "%s low delay profile", lowDelay ? "enabled" : "disabled");
+}
+
+/* The application can only be chosen when the encoder is initialised, so
+   the partial frame is dropped; packets already encoded are still output.
+   The low delay profile is CELT only, and leaving it brings back the mode
+   it replaced. */
+static int setApplication(t_opusenc_tilde* x, int lowDelay)
+{
+    x->_application = lowDelay ? OPUS_APPLICATION_RESTRICTED_LOWDELAY : OPUS_APPLICATION_VOIP;
+    if (lowDelay)
+    {
+        x->_lowDelayPreviousMode = x->_settings._mode;
+        x->_settings._mode = MODE_CELT_ONLY;
+    }
+    else
+    {
+        x->_settings._mode = x->_lowDelayPreviousMode;
+    }
+
+    if (!initEncoder(x))
+        return 0;
+
+    setEncoderOptions(x);
+    x->_writePosition = 0;
+    opusenc_tilde_demixing(x);
+    return 1;
+}
+
+void opusenc_tilde_send(t_opusenc_tilde* x, t_symbol* s)
+{
+    if (x->_bus)
+    {
+        packetBusRelease(x->_bus, PACKETBUS_PRODUCER);
+        x->_bus = 0;
+    }
+
+    if (!*s->s_name)
+        return;
+
+    x->_bus = packetBusAcquire(s, PACKETBUS_PRODUCER);
+    if (x->_bus)
+        verbose(LOG_LEVEL_NORMAL, "writing packets to bus %s", s->s_name);
+}
+
+void opusenc_tilde_capture(t_opusenc_tilde* x, t_symbol* s)
+{
+    if (x->_capture)
+    {
+        int dropped = packetCaptureDropped(x->_capture);
+        packetCaptureClose(x->_capture);
+        x->_capture = 0;
+        verbose(LOG_LEVEL_NORMAL, "capture stopped, %d packet(s) dropped", dropped);
+    }
+
+    if (!*s->s_name)
+        return;
+
+    char path[MAXPDSTRING];
+    canvas_makefilename(x->_canvas, s->s_name, path, MAXPDSTRING);
+
+    x->_capture = packetCaptureOpen(path, x->_sampleRate, x->_channels);
+    if (!x->_capture)
+    {
+        error("could not open capture file %s", path);
+        return;
+    }
+
+    x->_captureStart = clock_getlogicaltime();
+    opusenc_tilde_demixing(x);
+
+    verbose(LOG_LEVEL_NORMAL, "capturing packets to %s", path);
+}
+
+void opusenc_tilde_timestamps(t_opusenc_tilde* x, t_floatarg enabled)
+{
+    if (x->_customEncoder)
+    {
+        error("custom mode packets have no room for timestamps");
+        return;
+    }
+
+    x->_timestamps = (enabled == 0 ? 0 : 1);
+
+    verbose(LOG_LEVEL_NORMAL, "%s packet timestamps", x->_timestamps ? "enabled" : "disabled");
+}
+
+void opusenc_tilde_trace(t_opusenc_tilde* x, t_symbol* s)
+{
+#ifdef PDOPUS_TRACE
+    if (!*s->s_name)
+    {
+        opusTraceFile(0);
+        verbose(LOG_LEVEL_NORMAL, "tracing stopped, %d span(s) dropped", opusTraceDropped());
+        return;
+    }
+
+    char path[MAXPDSTRING];
+    canvas_makefilename(x->_canvas, s->s_name, path, MAXPDSTRING);
+
+    if (!opusTraceFile(path))
+    {
+        error("could not open trace file %s", path);
+        return;
+    }
+
+    verbose(LOG_LEVEL_NORMAL, "tracing to %s", path);
+#else
+    error("opusenc~ was built without PDOPUS_TRACE");
+#endif
 }
 
-const char* mode(int code)
+static const char* signalName(int signal)
 {
-    switch (code) {
-        case MODE_SILK_ONLY: return "SILK only";
-        case MODE_HYBRID: return "HYBRID";
-        case MODE_CELT_ONLY: return "CELT only";
+    switch (signal) {
+        case OPUS_SIGNAL_VOICE: return "voice";
+        case OPUS_SIGNAL_MUSIC: return "music";
         default:
             break;
     }
-    return "";
+    return "auto";
 }
 
 void opusenc_tilde_status(t_opusenc_tilde* x)
 {
     int val, err;
+
+    if (x->_customEncoder)
+    {
+        // the CELT custom encoder accepts settings but can't report them back
+        post("custom mode: %d sample frames", x->_customFrameSize);
+        post("bitrate: %d", x->_settings._bitrate);
+        post("sample rate: %d", x->_sampleRate);
+        post("packet loss: %d", x->_settings._packetLoss);
+        post("complexity: %d, VBR: %d, constrained VBR: %d, LSB depth: %d", x->_settings._complexity, x->_settings._vbr, x->_settings._vbrConstraint, x->_settings._lsbDepth);
+        post("channels: %d", x->_channels);
+        postLatency(x);
+        return;
+    }
     
-    err = opus_encoder_ctl(x->_encoder, OPUS_GET_BITRATE(&val));
+    err = ENCODER_CTL(x, OPUS_GET_BITRATE(&val));
     if (err)
         error("failed to get encoder bitrate: %s", opus_strerror(err));
     else
         post("bitrate: %d", val);
     
-    err = opus_encoder_ctl(x->_encoder, OPUS_GET_SAMPLE_RATE(&val));
+    err = ENCODER_CTL(x, OPUS_GET_SAMPLE_RATE(&val));
     if (err)
         error("failed to get sample rate: %s", opus_strerror(err));
     else
         post("sample rate: %d", val);
     
-    err = opus_encoder_ctl(x->_encoder, OPUS_GET_BANDWIDTH(&val));
+    err = ENCODER_CTL(x, OPUS_GET_BANDWIDTH(&val));
     if (err)
         error("failed to get SILK bandwidth: %s", opus_strerror(err));
     else
-        post("bandwidth: %d", bandwidth(val));
+        post("bandwidth: %d", opusBandwidthHz(val));
     
-    err = opus_encoder_ctl(x->_encoder, OPUS_GET_INBAND_FEC(&val));
+    err = ENCODER_CTL(x, OPUS_GET_INBAND_FEC(&val));
     if (err)
         error("failed to get SILK encoder in-band FEC: %s", opus_strerror(err));
     else
         post("FEC: %d", val);
     
-    err = opus_encoder_ctl(x->_encoder, OPUS_GET_DTX(&val));
+    err = ENCODER_CTL(x, OPUS_GET_DTX(&val));
     if (err)
         error("failed to get DTX: %s", opus_strerror(err));
     else
         post("DTX: %d", val);
     
-    err = opus_encoder_ctl(x->_encoder, OPUS_GET_PACKET_LOSS_PERC(&val));
+    err = ENCODER_CTL(x, OPUS_GET_PACKET_LOSS_PERC(&val));
     if (err)
         error("failed to get packet loss: %s", opus_strerror(err));
     else
         post("packet loss: %d", val);
+
+    err = ENCODER_CTL(x, OPUS_GET_COMPLEXITY(&val));
+    if (err)
+        error("failed to get complexity: %s", opus_strerror(err));
+    else
+        post("complexity: %d", val);
+
+    err = ENCODER_CTL(x, OPUS_GET_MAX_BANDWIDTH(&val));
+    if (err)
+        error("failed to get maximum bandwidth: %s", opus_strerror(err));
+    else
+        post("max bandwidth: %d", opusBandwidthHz(val));
+
+    err = ENCODER_CTL(x, OPUS_GET_VBR(&val));
+    if (err)
+        error("failed to get VBR: %s", opus_strerror(err));
+    else
+        post("VBR: %d", val);
+
+    err = ENCODER_CTL(x, OPUS_GET_VBR_CONSTRAINT(&val));
+    if (err)
+        error("failed to get constrained VBR: %s", opus_strerror(err));
+    else
+        post("constrained VBR: %d", val);
+
+    err = ENCODER_CTL(x, OPUS_GET_SIGNAL(&val));
+    if (err)
+        error("failed to get signal type: %s", opus_strerror(err));
+    else
+        post("signal: %s", signalName(val));
+
+    err = ENCODER_CTL(x, OPUS_GET_LSB_DEPTH(&val));
+    if (err)
+        error("failed to get LSB depth: %s", opus_strerror(err));
+    else
+        post("LSB depth: %d", val);
+
+    err = ENCODER_CTL(x, OPUS_GET_PREDICTION_DISABLED(&val));
+    if (err)
+        error("failed to get prediction: %s", opus_strerror(err));
+    else
+        post("prediction disabled: %d", val);
+
+    if (x->_preset || x->_pendingPreset)
+        post("preset: %s%s", x->_pendingPreset ? x->_pendingPreset->_name : x->_preset->_name, x->_pendingPreset ? " (at the next frame)" : "");
+
+    post("frame size: %g ms (%d samples)", x->_opusFrameSizeMs, x->_pendingFrameSize ? x->_pendingFrameSize : x->_opusFrameSize);
+    post("channels: %d", x->_channels);
+    if (x->_projectionEncoder)
+        post("streams: %d (%d coupled), demixing matrix: %d bytes", x->_streams, x->_coupledStreams, x->_demixingMatrixSize);
+    post("application: %s", x->_application == OPUS_APPLICATION_RESTRICTED_LOWDELAY ? "restricted low delay" : "voip");
+    if (x->_adapt)
+        post("adaptive: %d-%d bps, smoothed loss %g%%, jitter %g ms", x->_adaptMinBitrate, x->_adaptMaxBitrate, x->_smoothedLoss, x->_smoothedJitter);
+    if (x->_encoder)
+    {
+        int inUse, allocated;
+        codecPoolUsage(opus_encoder_get_size(1), &inUse, &allocated);
+        post("codec pool: %d of %d encoder states in use", inUse, allocated);
+    }
+    postLatency(x);
+}
+
+static void postLatency(t_opusenc_tilde* x)
+{
+    // packets on the outlet leave at the next scheduler tick, one block
+    // later; the packet bus hands them to the sender in the same tick
+    int delay = algorithmicDelay(x);
+    int emission = x->_bus ? 0 : x->_masterFrameSize;
+
+    post("algorithmic delay: %d samples", delay);
+    post("packet emission: %s", x->_bus ? "same DSP tick (packet bus)" : "next scheduler tick");
+    post("total latency: %d samples (%g ms)", delay + emission, (delay + emission) * 1000.f / x->_sampleRate);
+}
+
+static int algorithmicDelay(t_opusenc_tilde* x)
+{
+    int frameSize = x->_pendingFrameSize ? x->_pendingFrameSize : x->_opusFrameSize;
+    if (x->_customMode)
+        return frameSize + x->_customMode->overlap;
+
+    opus_int32 lookahead = 0;
+    ENCODER_CTL(x, OPUS_GET_LOOKAHEAD(&lookahead));
+    return frameSize + lookahead;
 }
 
 void opusenc_tilde_bitrate(t_opusenc_tilde* x, t_floatarg bitrate)
 {
-    x->_bitrate = bitrate;
+    x->_settings._bitrate = bitrate;
+    x->_preset = 0;
 
-    int err = opus_encoder_ctl(x->_encoder, OPUS_SET_BITRATE(bitrate));
+    int err = ENCODER_CTL(x, OPUS_SET_BITRATE(bitrate));
     if (err)
         error("failed to set encoder bitrate to %d: %s", (int)bitrate, opus_strerror(err));
     else
@@ -265,22 +836,17 @@ void opusenc_tilde_bitrate(t_opusenc_tilde* x, t_floatarg bitrate)
 
 void opusenc_tilde_mode(t_opusenc_tilde* x, t_symbol* s)
 {
-    int mode = MODE_HYBRID;
-    if (!strcmp(s->s_name, "hybrid"))
-        mode = MODE_HYBRID;
-    else if (!strcmp(s->s_name, "silk"))
-        mode = MODE_SILK_ONLY;
-    else if (!strcmp(s->s_name, "celt"))
-        mode = MODE_CELT_ONLY;
-    else
+    int mode = opusModeFromName(s->s_name);
+    if (!mode)
     {
         error("mode must be 'hybrid', 'silk' or 'celt'");
         return;
     }
 
-    x->_mode = s;
+    x->_settings._mode = mode;
+    x->_preset = 0;
 
-    int err = opus_encoder_ctl(x->_encoder, OPUS_SET_FORCE_MODE(mode));
+    int err = ENCODER_CTL(x, OPUS_SET_FORCE_MODE(mode));
     if (err)
         error("failed to set encoder mode to %s: %s", s->s_name, opus_strerror(err));
     else
@@ -291,9 +857,10 @@ void opusenc_tilde_fec(t_opusenc_tilde* x, t_floatarg enabled)
 {
     int f = (enabled == 0 ? 0 : 1);
 
-    x->_fec = f;
+    x->_settings._fec = f;
+    x->_preset = 0;
 
-    int err = opus_encoder_ctl(x->_encoder, OPUS_SET_INBAND_FEC_REQUEST, f);
+    int err = ENCODER_CTL(x, OPUS_SET_INBAND_FEC_REQUEST, f);
     if (err)
         error("failed to set encoder FEC to %d: %s", f, opus_strerror(err));
     else
@@ -304,9 +871,10 @@ void opusenc_tilde_dtx(t_opusenc_tilde* x, t_floatarg enabled)
 {
     int f = (enabled == 0 ? 0 : 1);
 
-    x->_dtx = f;
+    x->_settings._dtx = f;
+    x->_preset = 0;
 
-    int err = opus_encoder_ctl(x->_encoder, OPUS_SET_DTX_REQUEST, f);
+    int err = ENCODER_CTL(x, OPUS_SET_DTX_REQUEST, f);
     if (err)
         error("failed to set encoder DTX to %d: %s", f, opus_strerror(err));
     else
@@ -315,127 +883,878 @@ void opusenc_tilde_dtx(t_opusenc_tilde* x, t_floatarg enabled)
 
 void opusenc_tilde_loss(t_opusenc_tilde* x, t_floatarg loss)
 {
-    x->_packetLoss = loss;
+    x->_settings._packetLoss = loss;
     
-    int err = opus_encoder_ctl(x->_encoder, OPUS_SET_PACKET_LOSS_PERC(loss));
+    int err = ENCODER_CTL(x, OPUS_SET_PACKET_LOSS_PERC(loss));
     if (err)
         error("failed to set encoder packet loss to %d: %s", (int)loss, opus_strerror(err));
     else
         verbose(LOG_LEVEL_NORMAL, "set encoder packet loss to %d", (int)loss);
 }
 
-void setEncoderOptions(t_opusenc_tilde* x)
-{
-    opusenc_tilde_bitrate(x, x->_bitrate);
-    opusenc_tilde_mode(x, x->_mode);
-    opusenc_tilde_fec(x, x->_fec);
-    opusenc_tilde_dtx(x, x->_dtx);
-    opusenc_tilde_loss(x, x->_packetLoss);
-}
-
-int setOpusSampleRate(t_opusenc_tilde* x, int sampleRate)
+void opusenc_tilde_complexity(t_opusenc_tilde* x, t_floatarg complexity)
 {
-    if (x->_sampleRate == sampleRate)
-    {
-        return 1;
-    }
-    
-    x->_sampleRate = sampleRate;
-    
-    int err = opus_encoder_init(x->_encoder, sampleRate, 1, OPUS_APPLICATION_VOIP);
-    if (err)
+    if (complexity < 0 || complexity > 10)
     {
-        error("could not initialise OPUS encoder @%dhz: %s", sampleRate, opus_strerror(err));
-        return 0;
+        error("complexity must be between 0 and 10");
+        return;
     }
 
-    verbose(LOG_LEVEL_NORMAL, "OPUS encoder initialised @%dhz", sampleRate);
-    
-    setEncoderOptions(x);
+    x->_settings._complexity = complexity;
+    x->_preset = 0;
 
-    return setBufferSizes(x, x->_masterFrameSize, x->_opusFrameSizeMs * x->_sampleRate / 1000);
+    int err = ENCODER_CTL(x, OPUS_SET_COMPLEXITY(x->_settings._complexity));
+    if (err)
+        error("failed to set encoder complexity to %d: %s", x->_settings._complexity, opus_strerror(err));
+    else
+        verbose(LOG_LEVEL_NORMAL, "set encoder complexity to %d", x->_settings._complexity);
 }
 
-int setBufferSizes(t_opusenc_tilde* x, int masterFrameSize, int opusFrameSize)
+static int bandwidthFromName(const char* name)
 {
-    if (x->_masterFrameSize == masterFrameSize && x->_opusFrameSize == opusFrameSize)
-        return 1;
-    
-    x->_masterFrameSize = masterFrameSize;
-    x->_opusFrameSize = opusFrameSize;
-    
-    if (x->_buffer)
-        free(x->_buffer);
-
-    x->_buffer = (float*)malloc(x->_opusFrameSize * sizeof(float));
-
-    if (x->_packetBuffer)
-        free(x->_packetBuffer);
-
-    x->_packetBufferSize = x->_masterFrameSize / x->_opusFrameSize + 1;
-    x->_packetBuffer = (Packet*)malloc(x->_packetBufferSize * sizeof(Packet));
-    
-    opusenc_tilde_reset(x);
-
-    verbose(LOG_LEVEL_NORMAL, "pd~ buffer size: %d, OPUS frame size: %d", x->_masterFrameSize, x->_opusFrameSize);
-    verbose(LOG_LEVEL_NORMAL, "%d packet buffer(s) allocated", x->_packetBufferSize);
-    
-    return 1;
+    if (!strcmp(name, "nb"))
+        return OPUS_BANDWIDTH_NARROWBAND;
+    if (!strcmp(name, "mb"))
+        return OPUS_BANDWIDTH_MEDIUMBAND;
+    if (!strcmp(name, "wb"))
+        return OPUS_BANDWIDTH_WIDEBAND;
+    if (!strcmp(name, "swb"))
+        return OPUS_BANDWIDTH_SUPERWIDEBAND;
+    if (!strcmp(name, "fb"))
+        return OPUS_BANDWIDTH_FULLBAND;
+    return 0;
 }
 
-void processOpusFrame(t_opusenc_tilde* x)
+void opusenc_tilde_maxbandwidth(t_opusenc_tilde* x, t_symbol* s)
 {
-    if (x->_packetCount == x->_packetBufferSize)
+    int maxBandwidth = bandwidthFromName(s->s_name);
+    if (!maxBandwidth)
     {
-        error("packet overflow");
+        error("maximum bandwidth must be 'nb', 'mb', 'wb', 'swb' or 'fb'");
         return;
     }
 
-    Packet* packet = &x->_packetBuffer[x->_packetCount];
-
-    packet->_size = opus_encode_float(x->_encoder, x->_buffer, x->_opusFrameSize, packet->_data, MAX_PACKET_SIZE);
-    
-    packet->_dbov = 0;
-    for (int i = 0; i < x->_opusFrameSize; ++i)
-        packet->_dbov += x->_buffer[i] * x->_buffer[i];
-    packet->_dbov /= x->_opusFrameSize;
+    x->_settings._maxBandwidth = maxBandwidth;
+    x->_preset = 0;
 
-    if (packet->_dbov == 0)
-    {
-        packet->_dbov = 127;
-    }
-    else if (packet->_dbov >= 1)
-    {
-        packet->_dbov = 0;
-    }
+    int err = ENCODER_CTL(x, OPUS_SET_MAX_BANDWIDTH(maxBandwidth));
+    if (err)
+        error("failed to set encoder maximum bandwidth to %s: %s", s->s_name, opus_strerror(err));
     else
-    {
-        packet->_dbov = -10 * log10(packet->_dbov);
-        packet->_dbov = packet->_dbov > 127 ? 127 : (int)(packet->_dbov + 0.5f);
-    }
+        verbose(LOG_LEVEL_NORMAL, "set encoder maximum bandwidth to %s", s->s_name);
+}
+
+void opusenc_tilde_vbr(t_opusenc_tilde* x, t_floatarg enabled)
+{
+    int f = (enabled == 0 ? 0 : 1);
+
+    x->_settings._vbr = f;
+    x->_preset = 0;
+
+    int err = ENCODER_CTL(x, OPUS_SET_VBR_REQUEST, f);
+    if (err)
+        error("failed to set encoder VBR to %d: %s", f, opus_strerror(err));
+    else
+        verbose(LOG_LEVEL_NORMAL, "set encoder VBR to %d", f);
+}
+
+void opusenc_tilde_cvbr(t_opusenc_tilde* x, t_floatarg enabled)
+{
+    int f = (enabled == 0 ? 0 : 1);
+
+    x->_settings._vbrConstraint = f;
+    x->_preset = 0;
+
+    int err = ENCODER_CTL(x, OPUS_SET_VBR_CONSTRAINT_REQUEST, f);
+    if (err)
+        error("failed to set encoder constrained VBR to %d: %s", f, opus_strerror(err));
+    else
+        verbose(LOG_LEVEL_NORMAL, "set encoder constrained VBR to %d", f);
+}
+
+static int signalFromName(const char* name)
+{
+    if (!strcmp(name, "auto"))
+        return OPUS_AUTO;
+    if (!strcmp(name, "voice"))
+        return OPUS_SIGNAL_VOICE;
+    if (!strcmp(name, "music"))
+        return OPUS_SIGNAL_MUSIC;
+    return 0;
+}
+
+void opusenc_tilde_signal(t_opusenc_tilde* x, t_symbol* s)
+{
+    int signal = signalFromName(s->s_name);
+    if (!signal)
+    {
+        error("signal must be 'auto', 'voice' or 'music'");
+        return;
+    }
+
+    x->_settings._signal = signal;
+    x->_preset = 0;
+
+    int err = ENCODER_CTL(x, OPUS_SET_SIGNAL(signal));
+    if (err)
+        error("failed to set encoder signal type to %s: %s", s->s_name, opus_strerror(err));
+    else
+        verbose(LOG_LEVEL_NORMAL, "set encoder signal type to %s", s->s_name);
+}
+
+void opusenc_tilde_lsbdepth(t_opusenc_tilde* x, t_floatarg depth)
+{
+    if (depth < 8 || depth > 24)
+    {
+        error("LSB depth must be between 8 and 24 bits");
+        return;
+    }
+
+    x->_settings._lsbDepth = depth;
+    x->_preset = 0;
+
+    int err = ENCODER_CTL(x, OPUS_SET_LSB_DEPTH(x->_settings._lsbDepth));
+    if (err)
+        error("failed to set encoder LSB depth to %d: %s", x->_settings._lsbDepth, opus_strerror(err));
+    else
+        verbose(LOG_LEVEL_NORMAL, "set encoder LSB depth to %d", x->_settings._lsbDepth);
+}
+
+void opusenc_tilde_prediction(t_opusenc_tilde* x, t_floatarg enabled)
+{
+    int f = (enabled == 0 ? 1 : 0);
+
+    x->_settings._predictionDisabled = f;
+    x->_preset = 0;
+
+    int err = ENCODER_CTL(x, OPUS_SET_PREDICTION_DISABLED_REQUEST, f);
+    if (err)
+        error("failed to set encoder prediction disabled to %d: %s", f, opus_strerror(err));
+    else
+        verbose(LOG_LEVEL_NORMAL, "set encoder prediction disabled to %d", f);
+}
+
+void opusenc_tilde_preset(t_opusenc_tilde* x, t_symbol* s)
+{
+    if (x->_customEncoder)
+    {
+        error("presets are not available in custom mode");
+        return;
+    }
+
+    const EncoderPreset* preset = 0;
+    for (int i = 0; i < (int)(sizeof(encoderPresets) / sizeof(encoderPresets[0])); ++i)
+    {
+        if (!strcmp(s->s_name, encoderPresets[i]._name))
+            preset = &encoderPresets[i];
+    }
+
+    if (!preset)
+    {
+        error("preset must be 'lowcpu-voice', 'voice', 'music-hq' or 'lowlatency'");
+        return;
+    }
+
+    // a new application profile initialises the encoder here rather than
+    // in perform; that starts a new frame, so the rest applies at once
+    int lowDelay = x->_application == OPUS_APPLICATION_RESTRICTED_LOWDELAY;
+    if (preset->_lowDelay != lowDelay)
+    {
+        const EncoderPreset* previousPreset = x->_preset;
+        x->_pendingPreset = 0;
+        if (!setApplication(x, preset->_lowDelay))
+            return;
+        if (!applyPreset(x, preset))
+        {
+            setApplication(x, lowDelay);
+            x->_preset = previousPreset;
+        }
+        return;
+    }
+
+    // between frames it can be applied right away, otherwise perform
+    // applies it before the next frame starts
+    if (x->_writePosition)
+    {
+        x->_pendingPreset = preset;
+        verbose(LOG_LEVEL_NORMAL, "applying preset %s at the next frame boundary", preset->_name);
+        return;
+    }
+
+    x->_pendingPreset = 0;
+    applyPreset(x, preset);
+}
+
+void opusenc_tilde_adapt(t_opusenc_tilde* x, t_floatarg enabled)
+{
+    x->_adapt = (enabled == 0 ? 0 : 1);
+    x->_adaptMinFrameMs = x->_opusFrameSizeMs;
+    x->_smoothedLoss = 0;
+    x->_smoothedJitter = 0;
+
+    verbose(LOG_LEVEL_NORMAL, "%s adaptive bitrate control", x->_adapt ? "enabled" : "disabled");
+}
+
+void opusenc_tilde_adaptrange(t_opusenc_tilde* x, t_floatarg minBitrate, t_floatarg maxBitrate)
+{
+    if (minBitrate <= 0 || maxBitrate < minBitrate)
+    {
+        error("adaptrange needs a minimum and a larger maximum bitrate");
+        return;
+    }
+
+    x->_adaptMinBitrate = minBitrate;
+    x->_adaptMaxBitrate = maxBitrate;
+}
+
+void opusenc_tilde_adaptpolicy(t_opusenc_tilde* x, t_symbol* s, int argc, t_atom* argv)
+{
+    // step (bps), backoff factor, loss threshold (%), jitter threshold (ms)
+    // and longest frame (ms); missing values keep their setting
+    if (argc > 0)
+        x->_adaptStep = atom_getfloat(&argv[0]);
+    if (argc > 1)
+        x->_adaptBackoff = atom_getfloat(&argv[1]);
+    if (argc > 2)
+        x->_adaptLossThreshold = atom_getfloat(&argv[2]);
+    if (argc > 3)
+        x->_adaptJitterThreshold = atom_getfloat(&argv[3]);
+    if (argc > 4)
+        x->_adaptMaxFrameMs = atom_getfloat(&argv[4]);
+
+    if (x->_adaptBackoff <= 0 || x->_adaptBackoff >= 1)
+    {
+        error("adaptpolicy backoff must be between 0 and 1");
+        x->_adaptBackoff = 0.85f;
+    }
+}
+
+void opusenc_tilde_feedback(t_opusenc_tilde* x, t_symbol* s, int argc, t_atom* argv)
+{
+    if (argc < 3)
+    {
+        error("feedback needs loss (%%), jitter (ms) and buffer fill (ms)");
+        return;
+    }
+
+    if (!x->_adapt)
+        return;
+
+    float loss = atom_getfloat(&argv[0]);
+    float jitter = atom_getfloat(&argv[1]);
+    float fill = atom_getfloat(&argv[2]);
+
+    x->_smoothedLoss += (loss - x->_smoothedLoss) / 4;
+    x->_smoothedJitter += (jitter - x->_smoothedJitter) / 4;
+
+    adaptEncoder(x, loss, fill);
+}
+
+static void adaptEncoder(t_opusenc_tilde* x, float loss, float fill)
+{
+    // additive increase while the path is clear, multiplicative decrease
+    // as soon as a report shows loss or jitter above the policy thresholds
+    int congested = loss > x->_adaptLossThreshold || x->_smoothedJitter > x->_adaptJitterThreshold;
+    int bitrate = congested ? x->_settings._bitrate * x->_adaptBackoff : x->_settings._bitrate + x->_adaptStep;
+    if (bitrate < x->_adaptMinBitrate)
+        bitrate = x->_adaptMinBitrate;
+    if (bitrate > x->_adaptMaxBitrate)
+        bitrate = x->_adaptMaxBitrate;
+    if (bitrate != x->_settings._bitrate)
+        opusenc_tilde_bitrate(x, bitrate);
+
+    int packetLoss = (int)(x->_smoothedLoss + 0.5f);
+    if (packetLoss > 100)
+        packetLoss = 100;
+    if (packetLoss != x->_settings._packetLoss)
+        opusenc_tilde_loss(x, packetLoss);
+
+    if (x->_customEncoder)
+        return;
+
+    int fec = x->_smoothedLoss >= 1;
+    if (fec != x->_settings._fec)
+        opusenc_tilde_fec(x, fec);
+
+    // longer frames ride out jitter the receiver can't absorb; shorter ones
+    // come back once arrivals are steady and the receiver has headroom
+    float frameMs = x->_opusFrameSizeMs;
+    float nextMs = frameMs;
+    if (x->_smoothedJitter > frameMs || fill < x->_smoothedJitter)
+        nextMs = adjacentFrameDuration(frameMs, 1);
+    else if (!congested && x->_smoothedJitter < frameMs / 4 && fill >= 2 * frameMs)
+        nextMs = adjacentFrameDuration(frameMs, -1);
+
+    if (nextMs != frameMs && nextMs >= x->_adaptMinFrameMs && nextMs <= x->_adaptMaxFrameMs)
+        opusenc_tilde_framesize(x, nextMs);
+}
+
+static float adjacentFrameDuration(float ms, int direction)
+{
+    for (int code = OPUS_FRAMESIZE_2_5_MS; code <= OPUS_FRAMESIZE_120_MS; ++code)
+    {
+        if (opusFrameDuration(code) != ms)
+            continue;
+
+        code += direction;
+        return code >= OPUS_FRAMESIZE_2_5_MS && code <= OPUS_FRAMESIZE_120_MS ? opusFrameDuration(code) : ms;
+    }
+    return ms;
+}
+
+static void setEncoderOptions(t_opusenc_tilde* x)
+{
+    int err = applyEncoderSettings(x);
+    if (err)
+        error("failed to set encoder options: %s", opus_strerror(err));
+    else
+        verbose(LOG_LEVEL_NORMAL, "set encoder options");
+}
+
+static void readEncoderDefaults(t_opusenc_tilde* x)
+{
+    // the same starting point as the offline tools; an ambisonic encoder
+    // reports the library's defaults through its first stream
+    OpusEncoder* encoder = x->_encoder;
+    if (x->_projectionEncoder)
+        ENCODER_CTL(x, OPUS_MULTISTREAM_GET_ENCODER_STATE(0, &encoder));
+
+    opusDefaultEncoderSettings(&x->_settings, encoder, x->_application);
+    if (x->_customEncoder)
+        x->_settings._bitrate = CUSTOM_BITRATE;
+}
+
+static int encoderCtl(void* x, int request, opus_int32 value)
+{
+    return ENCODER_CTL((t_opusenc_tilde*)x, request, value);
+}
+
+// every setting, including those a preset touches; returns the first
+// error the encoder reports
+static int applyEncoderSettings(t_opusenc_tilde* x)
+{
+    return opusApplyEncoderSettings(encoderCtl, x, &x->_settings, x->_customEncoder != 0);
+}
+
+static void storePreset(t_opusenc_tilde* x, const EncoderPreset* preset, int bitrate)
+{
+    x->_settings._bitrate = bitrate;
+    x->_settings._mode = opusModeFromName(preset->_mode);
+    x->_settings._complexity = preset->_complexity;
+    x->_settings._maxBandwidth = preset->_maxBandwidth;
+    x->_settings._vbr = preset->_vbr;
+    x->_settings._vbrConstraint = preset->_vbrConstraint;
+    x->_settings._signal = preset->_signal;
+    x->_settings._lsbDepth = preset->_lsbDepth;
+    x->_settings._predictionDisabled = preset->_predictionDisabled;
+    x->_settings._fec = preset->_fec;
+    x->_settings._dtx = preset->_dtx;
+}
+
+/* Applies all of a preset's settings or none of them: if the encoder turns
+   one down, the previous settings are put back. Only called between
+   frames, so no frame is encoded with a mix of the two. */
+static int applyPreset(t_opusenc_tilde* x, const EncoderPreset* preset)
+{
+    int lowDelay = x->_application == OPUS_APPLICATION_RESTRICTED_LOWDELAY;
+    EncoderPreset previous = { 0, x->_settings._bitrate, opusModeName(x->_settings._mode), x->_settings._complexity, x->_settings._maxBandwidth, x->_settings._vbr, x->_settings._vbrConstraint,
+                               x->_settings._signal, x->_settings._lsbDepth, x->_settings._predictionDisabled, x->_settings._fec, x->_settings._dtx, x->_opusFrameSizeMs, lowDelay };
+    const EncoderPreset* previousPreset = x->_preset;
+
+    storePreset(x, preset, preset->_bitrate * x->_channels);
+    int err = applyEncoderSettings(x);
+    if (err)
+    {
+        storePreset(x, &previous, previous._bitrate);
+        applyEncoderSettings(x);
+        x->_preset = previousPreset;
+        error("failed to apply preset %s: %s", preset->_name, opus_strerror(err));
+        return 0;
+    }
+
+    // the new frame size takes effect at this same frame boundary
+    if (preset->_frameSizeMs != x->_opusFrameSizeMs)
+        opusenc_tilde_framesize(x, preset->_frameSizeMs);
+
+    x->_preset = preset;
+    verbose(LOG_LEVEL_NORMAL, "applied preset %s", preset->_name);
+    return 1;
+}
+
+static int isAmbisonicChannelCount(int channels)
+{
+    for (int order = 1; order <= 3; ++order)
+    {
+        int harmonics = (order + 1) * (order + 1);
+        if (channels == harmonics || channels == harmonics + 2)
+            return 1;
+    }
+    return 0;
+}
+
+static int initEncoder(t_opusenc_tilde* x)
+{
+    if (x->_customEncoder)
+        return initCustomEncoder(x);
+
+    int err = 0;
+    if (x->_projectionEncoder)
+        err = opus_projection_ambisonics_encoder_init(x->_projectionEncoder, x->_sampleRate, x->_channels, AMBISONICS_MAPPING_FAMILY, &x->_streams, &x->_coupledStreams, x->_application);
+    else
+        err = opus_encoder_init(x->_encoder, x->_sampleRate, 1, x->_application);
+
+    if (err)
+    {
+        error("could not initialise OPUS encoder @%dhz: %s", x->_sampleRate, opus_strerror(err));
+        return 0;
+    }
+
+    if (x->_projectionEncoder && !readDemixingMatrix(x))
+        return 0;
+
+    verbose(LOG_LEVEL_NORMAL, "OPUS encoder initialised @%dhz", x->_sampleRate);
+    return 1;
+}
+
+static int initCustomEncoder(t_opusenc_tilde* x)
+{
+    // a custom mode is tied to its sample rate, so it is created anew
+    if (x->_customEncoder)
+        opus_custom_encoder_destroy(x->_customEncoder);
+    if (x->_customMode)
+        opus_custom_mode_destroy(x->_customMode);
+    x->_customEncoder = 0;
+
+    int err = 0;
+    x->_customMode = opus_custom_mode_create(x->_sampleRate, x->_customFrameSize, &err);
+    if (!err)
+        x->_customEncoder = opus_custom_encoder_create(x->_customMode, 1, &err);
+
+    if (err)
+    {
+        error("could not create OPUS custom encoder for %d sample frames @%dhz: %s", x->_customFrameSize, x->_sampleRate, opus_strerror(err));
+        return 0;
+    }
+
+    x->_opusFrameSizeMs = x->_customFrameSize * 1000.f / x->_sampleRate;
+
+    verbose(LOG_LEVEL_NORMAL, "OPUS custom encoder initialised @%dhz with %d sample frames and %d samples overlap", x->_sampleRate, x->_customFrameSize, x->_customMode->overlap);
+    return 1;
+}
+
+static int opusFrameSize(t_opusenc_tilde* x)
+{
+    if (x->_customFrameSize)
+        return x->_customFrameSize;
+
+    return x->_opusFrameSizeMs * x->_sampleRate / 1000;
+}
+
+static int readDemixingMatrix(t_opusenc_tilde* x)
+{
+    opus_int32 size = 0;
+    int err = opus_projection_encoder_ctl(x->_projectionEncoder, OPUS_PROJECTION_GET_DEMIXING_MATRIX_SIZE(&size));
+    if (err)
+    {
+        error("failed to get demixing matrix size: %s", opus_strerror(err));
+        return 0;
+    }
+
+    if (size != x->_demixingMatrixSize)
+    {
+        if (x->_demixingMatrix)
+            free(x->_demixingMatrix);
+        x->_demixingMatrix = (unsigned char*)malloc(size);
+        x->_demixingMatrixSize = size;
+    }
+
+    err = opus_projection_encoder_ctl(x->_projectionEncoder, OPUS_PROJECTION_GET_DEMIXING_MATRIX(x->_demixingMatrix, size));
+    if (err)
+    {
+        error("failed to get demixing matrix: %s", opus_strerror(err));
+        return 0;
+    }
+
+    verbose(LOG_LEVEL_NORMAL, "demixing matrix of %d bytes for %d stream(s), %d coupled", size, x->_streams, x->_coupledStreams);
+    return 1;
+}
+
+static int setOpusSampleRate(t_opusenc_tilde* x, int sampleRate)
+{
+    if (x->_sampleRate == sampleRate)
+    {
+        return 1;
+    }
+    
+    x->_sampleRate = sampleRate;
+    
+    if (!initEncoder(x))
+        return 0;
+    
+    setEncoderOptions(x);
+    opusenc_tilde_demixing(x);
+
+    return setBufferSizes(x, x->_masterFrameSize, opusFrameSize(x));
+}
+
+static int setBufferSizes(t_opusenc_tilde* x, int masterFrameSize, int opusFrameSize)
+{
+    int maxFrameSize = MAX_FRAME_SIZE_MS * x->_sampleRate / 1000;
+    int minFrameSize = x->_customFrameSize ? x->_customFrameSize : MIN_FRAME_SIZE_MS * x->_sampleRate / 1000;
+
+    if (x->_masterFrameSize == masterFrameSize && x->_opusFrameSize == opusFrameSize && x->_maxFrameSize == maxFrameSize)
+        return 1;
+
+    // a new block size only needs more packet slots if it can hold more
+    // frames; the partial frame in the buffer carries over
+    int packetBufferSize = masterFrameSize / minFrameSize + 1;
+    if (x->_buffer && x->_opusFrameSize == opusFrameSize && x->_maxFrameSize == maxFrameSize && packetBufferSize <= x->_packetBufferSize)
+    {
+        x->_masterFrameSize = masterFrameSize;
+        verbose(LOG_LEVEL_NORMAL, "pd~ buffer size: %d, OPUS frame size: %d", x->_masterFrameSize, x->_opusFrameSize);
+        return 1;
+    }
+    
+    x->_masterFrameSize = masterFrameSize;
+    x->_opusFrameSize = opusFrameSize;
+    x->_pendingFrameSize = 0;
+    x->_maxFrameSize = maxFrameSize;
+    
+    // buffers are sized for the longest and shortest OPUS frames so the
+    // frame size can change in perform without reallocating
+    if (x->_buffer)
+        free(x->_buffer);
+
+    x->_buffer = (float*)malloc(x->_maxFrameSize * x->_channels * sizeof(float));
+
+    if (x->_packetBuffer)
+        free(x->_packetBuffer);
+
+    if (x->_packetData)
+        free(x->_packetData);
+
+    x->_packetBufferSize = packetBufferSize;
+    x->_packetBuffer = (Packet*)malloc(x->_packetBufferSize * sizeof(Packet));
+    x->_packetData = (unsigned char*)malloc(x->_packetBufferSize * x->_maxPacketSize);
+    for (int i = 0; i < x->_packetBufferSize; ++i)
+        x->_packetBuffer[i]._data = x->_packetData + i * x->_maxPacketSize;
+    
+    opusenc_tilde_reset(x);
+
+    verbose(LOG_LEVEL_NORMAL, "pd~ buffer size: %d, OPUS frame size: %d", x->_masterFrameSize, x->_opusFrameSize);
+    verbose(LOG_LEVEL_NORMAL, "%d packet buffer(s) allocated", x->_packetBufferSize);
+    
+    return 1;
+}
+
+void opusenc_tilde_encodearray(t_opusenc_tilde* x, t_symbol* table, t_symbol* dest)
+{
+    if (x->_job)
+    {
+        error("%s: still encoding the last table", table->s_name);
+        return;
+    }
+
+    if (!x->_encoder)
+    {
+        error("encodearray needs a mono encoder");
+        return;
+    }
+
+    t_garray* array = (t_garray*)pd_findbyclass(table, garray_class);
+    int size = 0;
+    t_word* words = 0;
+    if (!array || !garray_getfloatwords(array, &size, &words))
+    {
+        error("%s: no such array", table->s_name);
+        return;
+    }
+
+    // a frame size sent just before is already the one to encode with
+    int frameSize = x->_pendingFrameSize ? x->_pendingFrameSize : x->_opusFrameSize;
+    EncodeJob* job = (EncodeJob*)calloc(1, sizeof(EncodeJob));
+    float* samples = (float*)malloc((size + frameSize) * sizeof(float));
+    if (!job || !samples)
+    {
+        error("%s: out of memory", table->s_name);
+        free(job);
+        free(samples);
+        return;
+    }
+
+    job->_sampleRate = x->_sampleRate;
+    job->_frameSize = frameSize;
+    job->_maxPacketSize = x->_maxPacketSize;
+    job->_sampleCount = size;
+    job->_samples = samples;
+    for (int i = 0; i < size; ++i)
+        job->_samples[i] = words[i].w_float;
+    memset(job->_samples + size, 0, job->_frameSize * sizeof(float));
+
+    // OPUS states hold offsets rather than pointers, so a copy of the live
+    // encoder is a working encoder with all of its settings
+    job->_encoder = (OpusEncoder*)codecPoolAlloc(opus_encoder_get_size(1));
+    if (job->_encoder)
+    {
+        memcpy(job->_encoder, x->_encoder, opus_encoder_get_size(1));
+        opus_encoder_ctl(job->_encoder, OPUS_RESET_STATE);
+    }
+
+    if (*dest->s_name)
+    {
+        char path[MAXPDSTRING];
+        canvas_makefilename(x->_canvas, dest->s_name, path, MAXPDSTRING);
+        job->_file = fopen(path, "wb");
+        if (!job->_file)
+        {
+            error("could not open %s", path);
+            freeEncodeJob(job);
+            return;
+        }
+    }
+
+    atomic_init(&job->_done, 0);
+    atomic_init(&job->_cancel, 0);
+    if (!job->_encoder || pthread_create(&job->_thread, 0, encodeJobThread, job))
+    {
+        error("could not start encoding %s", table->s_name);
+        freeEncodeJob(job);
+        return;
+    }
+
+    x->_job = job;
+    clock_delay(x->_jobClock, ENCODE_JOB_POLL_MS);
+    verbose(LOG_LEVEL_NORMAL, "encoding %d samples from %s", size, table->s_name);
+}
+
+static void* encodeJobThread(void* arg)
+{
+    EncodeJob* job = (EncodeJob*)arg;
+    unsigned char* packet = (unsigned char*)malloc(job->_maxPacketSize);
+    unsigned char* record = (unsigned char*)malloc(PACKETBUS_MAX_PACKET_SIZE);
+    float frameMs = job->_frameSize * 1000.f / job->_sampleRate;
+
+    if (!packet || !record)
+    {
+        job->_error = OPUS_ALLOC_FAIL;
+        free(packet);
+        free(record);
+        atomic_store(&job->_done, 1);
+        return 0;
+    }
+
+    if (job->_file)
+        packetCaptureWriteHeader(job->_file, job->_sampleRate, 1);
+
+    for (int offset = 0; offset < job->_sampleCount && !atomic_load(&job->_cancel); offset += job->_frameSize)
+    {
+        const float* pcm = job->_samples + offset;
+        int size = opusEncodeFrame(job->_encoder, pcm, job->_frameSize, packet, job->_maxPacketSize);
+        if (size < 0)
+        {
+            job->_error = size;
+            break;
+        }
+
+        int dbov = frameDbov(pcm, job->_frameSize);
+        if (job->_file)
+        {
+            int recordSize = packetCaptureMakeRecord(record, job->_packetCount * frameMs, dbov, 0, packet, size);
+            fwrite(record, 1, recordSize, job->_file);
+        }
+        else
+        {
+            if (job->_packetsSize + size + 3 > job->_packetsCapacity)
+            {
+                size_t capacity = 2 * job->_packetsCapacity + size + 3;
+                unsigned char* packets = (unsigned char*)realloc(job->_packets, capacity);
+                if (!packets)
+                {
+                    job->_error = OPUS_ALLOC_FAIL;
+                    break;
+                }
+                job->_packets = packets;
+                job->_packetsCapacity = capacity;
+            }
+            unsigned char* p = job->_packets + job->_packetsSize;
+            p[0] = (unsigned char)(size >> 8);
+            p[1] = (unsigned char)size;
+            p[2] = (unsigned char)dbov;
+            memcpy(p + 3, packet, size);
+            job->_packetsSize += size + 3;
+        }
+        job->_packetCount++;
+    }
+
+    free(packet);
+    free(record);
+    atomic_store(&job->_done, 1);
+    return 0;
+}
+
+static void freeEncodeJob(EncodeJob* job)
+{
+    if (job->_file)
+        fclose(job->_file);
+    codecPoolFree(job->_encoder, opus_encoder_get_size(1));
+    free(job->_samples);
+    free(job->_packets);
+    free(job);
+}
+
+static void encodeJobTick(t_opusenc_tilde* x)
+{
+    EncodeJob* job = x->_job;
+    if (!job->_joined)
+    {
+        if (!atomic_load(&job->_done))
+        {
+            clock_delay(x->_jobClock, ENCODE_JOB_POLL_MS);
+            return;
+        }
+
+        pthread_join(job->_thread, 0);
+        job->_joined = 1;
+
+        if (job->_error)
+        {
+            error("encodearray failed after %d packet(s): %s", job->_packetCount, opus_strerror(job->_error));
+            x->_job = 0;
+            freeEncodeJob(job);
+            return;
+        }
+    }
+
+    // in-memory packets come out like live ones, dBov first, a few per
+    // scheduler tick so a long table doesn't hold up DSP
+    t_atom* list = (t_atom*)getbytes(job->_maxPacketSize * sizeof(t_atom));
+    for (int count = 0; job->_outputPosition < job->_packetsSize && count < ENCODE_JOB_PACKETS_PER_TICK; ++count)
+    {
+        const unsigned char* p = job->_packets + job->_outputPosition;
+        int size = p[0] << 8 | p[1];
+        outlet_float(x->_dbovOutlet, p[2]);
+        for (int i = 0; i < size; ++i)
+            SETFLOAT(&list[i], p[3 + i]);
+        outlet_list(x->_packetOutlet, &s_list, size, list);
+        job->_outputPosition += size + 3;
+    }
+    freebytes(list, job->_maxPacketSize * sizeof(t_atom));
+
+    if (job->_outputPosition < job->_packetsSize)
+    {
+        clock_delay(x->_jobClock, ENCODE_JOB_OUTPUT_MS);
+        return;
+    }
+
+    x->_job = 0;
+    verbose(LOG_LEVEL_NORMAL, "encoded %d packet(s) from %d samples", job->_packetCount, job->_sampleCount);
+    freeEncodeJob(job);
+    outlet_bang(x->_doneOutlet);
+}
+
+// frameEnd is the offset in the current block where the frame ended
+static void processOpusFrame(t_opusenc_tilde* x, int frameEnd)
+{
+    if (x->_packetCount == x->_packetBufferSize)
+    {
+        error("packet overflow");
+        return;
+    }
+
+    Packet* packet = &x->_packetBuffer[x->_packetCount];
+    packet->_time = clock_getlogicaltime();
+
+    // stamped packets keep room for the padding
+    int maxPacketSize = x->_timestamps ? x->_maxPacketSize - LATENCYPROBE_PADDING : x->_maxPacketSize;
+
+    OPUSTRACE_BEGIN(encode);
+    if (x->_customEncoder)
+        packet->_size = opus_custom_encode_float(x->_customEncoder, x->_buffer, x->_opusFrameSize, packet->_data, maxPacketSize);
+    else if (x->_projectionEncoder)
+        packet->_size = opus_projection_encode_float(x->_projectionEncoder, x->_buffer, x->_opusFrameSize, packet->_data, maxPacketSize);
+    else
+        packet->_size = opusEncodeFrame(x->_encoder, x->_buffer, x->_opusFrameSize, packet->_data, maxPacketSize);
+    OPUSTRACE_END(encode, OPUSTRACE_ENCODE, x, packet->_size);
+
+    if (packet->_size < 0)
+    {
+        error("failed to encode OPUS frame: %s", opus_strerror(packet->_size));
+        return;
+    }
+    
+    packet->_dbov = frameDbov(x->_buffer, x->_opusFrameSize * x->_channels);
+
+    if (x->_timestamps)
+        packet->_size = stampPacket(x, packet, frameEnd);
 
     verbose(LOG_LEVEL_NORMAL, "OPUS encoded %d samples into a packet of size %d bytes starting with 0x%02x", x->_opusFrameSize, packet->_size, packet->_data[0]);
 
+    if (x->_bus)
+        packetBusWrite(x->_bus, packet->_data, packet->_size);
+
     x->_packetCount++;
 }
 
+static int stampPacket(t_opusenc_tilde* x, Packet* packet, int frameEnd)
+{
+    int padded = packet->_size + LATENCYPROBE_PADDING;
+    int err = x->_projectionEncoder ? opus_multistream_packet_pad(packet->_data, packet->_size, padded, x->_streams)
+                                    : opus_packet_pad(packet->_data, packet->_size, padded);
+    if (err)
+        return packet->_size;
+
+    // perform runs at the logical time the block ends at
+    int64_t start = (int64_t)(frameEnd - x->_opusFrameSize - x->_masterFrameSize) * LATENCYPROBE_RATE / x->_sampleRate;
+    opus_int32 lookahead = 0;
+    ENCODER_CTL(x, OPUS_GET_LOOKAHEAD(&lookahead));
+
+    latencyProbeWrite(packet->_data, padded, latencyProbeClock() + start, (int)((int64_t)lookahead * LATENCYPROBE_RATE / x->_sampleRate));
+    return padded;
+}
+
+static void writeOpusBuffer(t_opusenc_tilde* x, t_sample** in, int offset, int count)
+{
+    if (x->_channels == 1)
+    {
+        copySamplesToFloat(x->_buffer + x->_writePosition, in[0] + offset, count);
+        return;
+    }
+
+    float* buffer = x->_buffer + x->_writePosition * x->_channels;
+    for (int i = 0; i < count; ++i)
+        for (int c = 0; c < x->_channels; ++c)
+            *buffer++ = in[c][offset + i];
+}
+
 t_int* opusenc_tilde_perform(t_int* w)
 {
     t_opusenc_tilde* x = (t_opusenc_tilde*)(w[1]);
-    t_sample* in = (t_sample*)(w[2]);
-    int n = (int)(w[3]);
-    
-    setBufferSizes(x, n, x->_opusFrameSize);
+    int n = (int)(w[2]);
+    t_sample** in = (t_sample**)(w + 3);
+    int offset = 0;
     
     while (n)
     {
+        if (x->_pendingPreset && !x->_writePosition)
+        {
+            applyPreset(x, x->_pendingPreset);
+            x->_pendingPreset = 0;
+        }
+
+        if (x->_pendingFrameSize && !x->_writePosition)
+        {
+            x->_opusFrameSize = x->_pendingFrameSize;
+            x->_pendingFrameSize = 0;
+        }
+
         int count = x->_writePosition + n > x->_opusFrameSize ? x->_opusFrameSize - x->_writePosition : n; 
-        memcpy(x->_buffer + x->_writePosition, in, count * sizeof(t_sample));
+        writeOpusBuffer(x, in, offset, count);
         x->_writePosition += count;
+        offset += count;
         n -= count;
         if (x->_writePosition == x->_opusFrameSize)
         {
-            processOpusFrame(x);
+            processOpusFrame(x, offset);
             x->_writePosition = 0;
         }
     }
@@ -443,21 +1762,111 @@ t_int* opusenc_tilde_perform(t_int* w)
     if (x->_packetCount)
     	clock_delay(x->_clock, 0);
 
-    return w + 4;
+    return w + x->_channels + 3;
 }
 
-void outputPacket(t_opusenc_tilde* x)
+/* Mono perform routines for fixed block sizes. As long as the block fits
+   into the rest of the current frame, the whole block is one copy of a
+   compile time length and at most one frame to encode; anything else
+   (a pending frame size change, a frame that isn't a multiple of the
+   block) goes through the generic routine. */
+#define DEFINE_PERFORM_ROUTINE(N) \
+static t_int* opusenc_tilde_perform_##N(t_int* w) \
+{ \
+    t_opusenc_tilde* x = (t_opusenc_tilde*)(w[1]); \
+    if (x->_pendingPreset || x->_pendingFrameSize || x->_writePosition + N > x->_opusFrameSize) \
+        return opusenc_tilde_perform(w); \
+    copySamplesToFloat(x->_buffer + x->_writePosition, (t_sample*)(w[3]), N); \
+    x->_writePosition += N; \
+    if (x->_writePosition == x->_opusFrameSize) \
+    { \
+        processOpusFrame(x, N); \
+        x->_writePosition = 0; \
+        clock_delay(x->_clock, 0); \
+    } \
+    return w + 4; \
+}
+
+#ifndef PDOPUS_GENERIC_PERFORM
+DEFINE_PERFORM_ROUTINE(32)
+DEFINE_PERFORM_ROUTINE(64)
+DEFINE_PERFORM_ROUTINE(128)
+DEFINE_PERFORM_ROUTINE(256)
+#endif
+
+static t_perfroutine performRoutine(t_opusenc_tilde* x, int blockSize)
+{
+    // PDOPUS_GENERIC_PERFORM leaves only the generic routine, which is
+    // what pdopusbench-generic measures the specialised ones against
+#ifndef PDOPUS_GENERIC_PERFORM
+    if (x->_channels > 1)
+        return opusenc_tilde_perform;
+
+    switch (blockSize) {
+        case 32: return opusenc_tilde_perform_32;
+        case 64: return opusenc_tilde_perform_64;
+        case 128: return opusenc_tilde_perform_128;
+        case 256: return opusenc_tilde_perform_256;
+        default:
+            break;
+    }
+#endif
+    return opusenc_tilde_perform;
+}
+
+static void outputDemixingMatrix(t_opusenc_tilde* x)
 {
+    int argc = x->_demixingMatrixSize + 3;
+    t_atom* argv = (t_atom*)getbytes(argc * sizeof(t_atom));
+
+    SETFLOAT(&argv[0], x->_channels);
+    SETFLOAT(&argv[1], x->_streams);
+    SETFLOAT(&argv[2], x->_coupledStreams);
+    for (int i = 0; i < x->_demixingMatrixSize; ++i)
+        SETFLOAT(&argv[3 + i], x->_demixingMatrix[i]);
+
+    outlet_anything(x->_packetOutlet, gensym("demixing"), argc, argv);
+    freebytes(argv, argc * sizeof(t_atom));
+
+    if (x->_capture)
+    {
+        unsigned char* record = (unsigned char*)getbytes(argc);
+        record[0] = x->_channels;
+        record[1] = x->_streams;
+        record[2] = x->_coupledStreams;
+        memcpy(record + 3, x->_demixingMatrix, x->_demixingMatrixSize);
+        packetCaptureWrite(x->_capture, clock_gettimesince(x->_captureStart), 0, PACKETCAPTURE_DEMIXING, record, argc);
+        freebytes(record, argc);
+    }
+
+    x->_demixingMatrixPending = 0;
+}
+
+static void outputPacket(t_opusenc_tilde* x)
+{
+    if (x->_demixingMatrixPending)
+        outputDemixingMatrix(x);
+
+    OPUSTRACE_BEGIN(output);
     for (int i = 0; i < x->_packetCount; ++i)
     {
         outlet_float(x->_dbovOutlet, x->_packetBuffer[i]._dbov);
 
-        t_atom list[MAX_PACKET_SIZE];
+        t_atom* list = x->_packetAtoms;
 
         for (int c = 0; c < x->_packetBuffer[i]._size; ++c)
             SETFLOAT(&list[c], x->_packetBuffer[i]._data[c]);
         
         outlet_list(x->_packetOutlet, &s_list, x->_packetBuffer[i]._size, list);
+
+        // timestamps are the DSP time the packet was encoded at, not when
+        // the clock got around to sending it
+        if (x->_capture)
+        {
+            double time = clock_gettimesince(x->_captureStart) - clock_gettimesince(x->_packetBuffer[i]._time);
+            packetCaptureWrite(x->_capture, time, x->_packetBuffer[i]._dbov, 0, x->_packetBuffer[i]._data, x->_packetBuffer[i]._size);
+        }
     }
+    OPUSTRACE_END(output, OPUSTRACE_OUTPUT, x, x->_packetCount);
     x->_packetCount = 0;
 }
@@ -0,0 +1,583 @@
+#include "m_pd.h"
+#include "packetfec.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define GROUP_WINDOW 8
+#define DEFAULT_DEPTH 1
+#define RESYNC_GROUPS (2 * GROUP_WINDOW)
+#define DEFAULT_MAX_WAIT_MS 100
+
+static t_class* opusfecdec_class;
+
+enum LOG_LEVEL
+{
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_NORMAL
+};
+
+typedef struct _fecgroup
+{
+    int _group;
+    int _dataCount;
+    int _parityCount;
+    int _symbolSize;
+    int _received;
+    int _arrived[PACKETFEC_MAX_DATA + PACKETFEC_MAX_PARITY];
+    int _dataPresent[PACKETFEC_MAX_DATA];
+    int _parityPresent[PACKETFEC_MAX_PARITY];
+    unsigned char* _data[PACKETFEC_MAX_DATA];
+    unsigned char* _parity[PACKETFEC_MAX_PARITY];
+} FecGroup;
+
+typedef struct _opusfecdec
+{
+    t_object x_obj;
+    t_outlet* _packetOutlet;
+    t_outlet* _statsOutlet;
+    t_clock* _feedbackClock;
+    double _feedbackInterval;
+    t_clock* _flushClock;
+    double _maxWait;
+    int _holding;
+    int _holdGroup;
+    int _holdIndex;
+    FecGroup _groups[GROUP_WINDOW];
+    unsigned char* _groupData;
+    unsigned char* _scratchData;
+    unsigned char* _scratch[PACKETFEC_MAX_PARITY];
+    unsigned char* _packet;
+    t_atom* _atoms;
+    int _depth;
+    int _synced;
+    int _nextGroup;
+    int _nextIndex;
+    int _newestGroup;
+    int _newestIndex;
+    int _lastDataCount;
+    int _lastParityCount;
+    int _packetsExpected;
+    int _packetsArrived;
+    int _dataExpected;
+    int _recovered;
+    int _lost;
+    int _late;
+    int _invalid;
+    int _intervalExpected;
+    int _intervalArrived;
+} t_opusfecdec;
+
+void opusfecdec_setup();
+void* opusfecdec_new(t_floatarg depth, t_floatarg maxWait);
+void opusfecdec_free(t_opusfecdec* x);
+void opusfecdec_packet(t_opusfecdec* x, t_symbol* s, int argc, t_atom* argv);
+void opusfecdec_anything(t_opusfecdec* x, t_symbol* s, int argc, t_atom* argv);
+void opusfecdec_depth(t_opusfecdec* x, t_floatarg depth);
+void opusfecdec_reset(t_opusfecdec* x);
+void opusfecdec_stats(t_opusfecdec* x);
+void opusfecdec_resetstats(t_opusfecdec* x);
+void opusfecdec_feedbackinterval(t_opusfecdec* x, t_floatarg interval);
+void opusfecdec_maxwait(t_opusfecdec* x, t_floatarg maxWait);
+static void feedbackTick(t_opusfecdec* x);
+static void flushTick(t_opusfecdec* x);
+static void scheduleFlush(t_opusfecdec* x);
+static int loadPacket(t_opusfecdec* x, int argc, t_atom* argv);
+static int unwrapGroup(t_opusfecdec* x, int group);
+static FecGroup* groupSlot(t_opusfecdec* x, int group);
+static void accountGroup(t_opusfecdec* x, int dataCount, int parityCount, int received);
+static void resetGroup(t_opusfecdec* x, FecGroup* g, int group, int dataCount, int parityCount);
+static int storePacket(t_opusfecdec* x, FecGroup* g, int index, const unsigned char* data, int size);
+static void recoverGroup(t_opusfecdec* x, FecGroup* g);
+static void outputData(t_opusfecdec* x, FecGroup* g, int index);
+static void drainGroups(t_opusfecdec* x, int giveUpBelow);
+static void resync(t_opusfecdec* x, int group, int index, int dataCount);
+
+void opusfecdec_setup()
+{
+    packetFecInit();
+
+    opusfecdec_class = class_new(gensym("opusfecdec"),
+                                 (t_newmethod)opusfecdec_new,
+                                 (t_method)opusfecdec_free,
+                                 sizeof(t_opusfecdec),
+                                 CLASS_DEFAULT,
+                                 A_DEFFLOAT,
+                                 A_DEFFLOAT,
+                                 0);
+
+    class_addlist(opusfecdec_class, (t_method)opusfecdec_packet);
+    class_addanything(opusfecdec_class, (t_method)opusfecdec_anything);
+    class_addmethod(opusfecdec_class, (t_method)opusfecdec_depth, gensym("depth"), A_FLOAT, 0);
+    class_addmethod(opusfecdec_class, (t_method)opusfecdec_reset, gensym("reset"), 0);
+    class_addmethod(opusfecdec_class, (t_method)opusfecdec_stats, gensym("stats"), 0);
+    class_addmethod(opusfecdec_class, (t_method)opusfecdec_resetstats, gensym("resetstats"), 0);
+    class_addmethod(opusfecdec_class, (t_method)opusfecdec_feedbackinterval, gensym("feedbackinterval"), A_FLOAT, 0);
+    class_addmethod(opusfecdec_class, (t_method)opusfecdec_maxwait, gensym("maxwait"), A_FLOAT, 0);
+}
+
+void* opusfecdec_new(t_floatarg depth, t_floatarg maxWait)
+{
+    t_opusfecdec* x = (t_opusfecdec*)pd_new(opusfecdec_class);
+    if (!x)
+        return 0;
+
+    x->_packetOutlet = outlet_new(&x->x_obj, &s_list);
+    x->_statsOutlet = outlet_new(&x->x_obj, 0);
+    x->_feedbackClock = clock_new(x, (t_method)feedbackTick);
+    x->_feedbackInterval = 0;
+    x->_flushClock = clock_new(x, (t_method)flushTick);
+    x->_maxWait = DEFAULT_MAX_WAIT_MS;
+
+    int symbols = PACKETFEC_MAX_DATA + PACKETFEC_MAX_PARITY;
+    x->_groupData = (unsigned char*)malloc(GROUP_WINDOW * symbols * PACKETFEC_SYMBOL_SIZE);
+    for (int i = 0; i < GROUP_WINDOW; ++i)
+    {
+        unsigned char* data = x->_groupData + i * symbols * PACKETFEC_SYMBOL_SIZE;
+        for (int s = 0; s < PACKETFEC_MAX_DATA; ++s)
+            x->_groups[i]._data[s] = data + s * PACKETFEC_SYMBOL_SIZE;
+        for (int j = 0; j < PACKETFEC_MAX_PARITY; ++j)
+            x->_groups[i]._parity[j] = data + (PACKETFEC_MAX_DATA + j) * PACKETFEC_SYMBOL_SIZE;
+    }
+    x->_scratchData = (unsigned char*)malloc(PACKETFEC_MAX_PARITY * PACKETFEC_SYMBOL_SIZE);
+    for (int j = 0; j < PACKETFEC_MAX_PARITY; ++j)
+        x->_scratch[j] = x->_scratchData + j * PACKETFEC_SYMBOL_SIZE;
+    x->_packet = (unsigned char*)malloc(PACKETFEC_HEADER_SIZE + PACKETFEC_SYMBOL_SIZE);
+    x->_atoms = (t_atom*)malloc(PACKETFEC_MAX_PACKET_SIZE * sizeof(t_atom));
+
+    x->_depth = DEFAULT_DEPTH;
+    if (depth)
+        opusfecdec_depth(x, depth);
+    if (maxWait)
+        opusfecdec_maxwait(x, maxWait);
+
+    opusfecdec_reset(x);
+    opusfecdec_resetstats(x);
+
+    return x;
+}
+
+void opusfecdec_free(t_opusfecdec* x)
+{
+    clock_free(x->_feedbackClock);
+    clock_free(x->_flushClock);
+    free(x->_groupData);
+    free(x->_scratchData);
+    free(x->_packet);
+    free(x->_atoms);
+}
+
+void opusfecdec_depth(t_opusfecdec* x, t_floatarg depth)
+{
+    if (depth < 1 || depth > GROUP_WINDOW - 2)
+    {
+        error("depth must be 1 to %d groups", GROUP_WINDOW - 2);
+        return;
+    }
+
+    x->_depth = depth;
+    verbose(LOG_LEVEL_NORMAL, "waiting for up to %d later group(s) before giving up on a packet", (int)depth);
+}
+
+void opusfecdec_maxwait(t_opusfecdec* x, t_floatarg maxWait)
+{
+    if (maxWait < 0)
+    {
+        error("maximum wait must be 0 (off) or more ms");
+        return;
+    }
+
+    x->_maxWait = maxWait;
+    x->_holding = 0;
+    clock_unset(x->_flushClock);
+    if (x->_synced)
+        scheduleFlush(x);
+}
+
+void opusfecdec_reset(t_opusfecdec* x)
+{
+    for (int i = 0; i < GROUP_WINDOW; ++i)
+        x->_groups[i]._group = -1;
+    clock_unset(x->_flushClock);
+    x->_holding = 0;
+    x->_synced = 0;
+    x->_nextGroup = 0;
+    x->_nextIndex = 0;
+    x->_newestGroup = 0;
+    x->_newestIndex = -1;
+    x->_lastDataCount = 0;
+    x->_lastParityCount = 0;
+}
+
+void opusfecdec_resetstats(t_opusfecdec* x)
+{
+    x->_packetsExpected = 0;
+    x->_packetsArrived = 0;
+    x->_dataExpected = 0;
+    x->_recovered = 0;
+    x->_lost = 0;
+    x->_late = 0;
+    x->_invalid = 0;
+    x->_intervalExpected = 0;
+    x->_intervalArrived = 0;
+}
+
+static void outputStat(t_opusfecdec* x, const char* name, t_float value)
+{
+    t_atom a;
+    SETFLOAT(&a, value);
+    outlet_anything(x->_statsOutlet, gensym(name), 1, &a);
+}
+
+void opusfecdec_stats(t_opusfecdec* x)
+{
+    float loss = x->_packetsExpected ? 100.f * (x->_packetsExpected - x->_packetsArrived) / x->_packetsExpected : 0;
+    float residual = x->_dataExpected ? 100.f * x->_lost / x->_dataExpected : 0;
+
+    post("packets: %d of %d arrived (%g%% loss), %d recovered, %d lost after recovery (%g%%)",
+         x->_packetsArrived, x->_packetsExpected, loss, x->_recovered, x->_lost, residual);
+    post("late: %d, invalid: %d", x->_late, x->_invalid);
+
+    outputStat(x, "loss", loss);
+    outputStat(x, "residual", residual);
+    outputStat(x, "recovered", x->_recovered);
+    outputStat(x, "lost", x->_lost);
+    outputStat(x, "late", x->_late);
+    outputStat(x, "invalid", x->_invalid);
+}
+
+void opusfecdec_feedbackinterval(t_opusfecdec* x, t_floatarg interval)
+{
+    x->_feedbackInterval = interval;
+    if (interval > 0)
+        clock_delay(x->_feedbackClock, interval);
+    else
+        clock_unset(x->_feedbackClock);
+}
+
+static void feedbackTick(t_opusfecdec* x)
+{
+    // the loss before recovery is what opusfecenc adapts its parity to
+    if (x->_intervalExpected)
+    {
+        outputStat(x, "loss", 100.f * (x->_intervalExpected - x->_intervalArrived) / x->_intervalExpected);
+        x->_intervalExpected = 0;
+        x->_intervalArrived = 0;
+    }
+
+    if (x->_feedbackInterval > 0)
+        clock_delay(x->_feedbackClock, x->_feedbackInterval);
+}
+
+static int loadPacket(t_opusfecdec* x, int argc, t_atom* argv)
+{
+    if (argc > PACKETFEC_HEADER_SIZE + PACKETFEC_SYMBOL_SIZE)
+        return 0;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        t_float f = atom_getfloat(&argv[i]);
+        if (argv[i].a_type != A_FLOAT || f != (int)f || f < 0 || f > 255)
+            return 0;
+        x->_packet[i] = (int)f;
+    }
+    return 1;
+}
+
+static int unwrapGroup(t_opusfecdec* x, int group)
+{
+    // group numbers are 16 bit on the wire
+    return x->_nextGroup + (short)(group - (x->_nextGroup & 0xffff));
+}
+
+static FecGroup* groupSlot(t_opusfecdec* x, int group)
+{
+    return &x->_groups[(group % GROUP_WINDOW + GROUP_WINDOW) % GROUP_WINDOW];
+}
+
+static void accountGroup(t_opusfecdec* x, int dataCount, int parityCount, int received)
+{
+    x->_packetsExpected += dataCount + parityCount;
+    x->_packetsArrived += received;
+    x->_dataExpected += dataCount;
+    x->_intervalExpected += dataCount + parityCount;
+    x->_intervalArrived += received;
+}
+
+static void resetGroup(t_opusfecdec* x, FecGroup* g, int group, int dataCount, int parityCount)
+{
+    // groups are counted when their slot is reused, so late parity counts
+    if (g->_group >= 0)
+        accountGroup(x, g->_dataCount, g->_parityCount, g->_received);
+
+    g->_group = group;
+    g->_dataCount = dataCount;
+    g->_parityCount = parityCount;
+    g->_symbolSize = 0;
+    g->_received = 0;
+    memset(g->_arrived, 0, sizeof(g->_arrived));
+    memset(g->_dataPresent, 0, sizeof(g->_dataPresent));
+    memset(g->_parityPresent, 0, sizeof(g->_parityPresent));
+}
+
+static int storePacket(t_opusfecdec* x, FecGroup* g, int index, const unsigned char* data, int size)
+{
+    int j = index - g->_dataCount;
+    if (index < g->_dataCount ? size > PACKETFEC_MAX_PACKET_SIZE
+                              : size < 2 || size > PACKETFEC_SYMBOL_SIZE || (g->_symbolSize && size != g->_symbolSize))
+        return 0;
+
+    // data rebuilt from parity may still arrive; it counts, but isn't stored again
+    if (!g->_arrived[index])
+    {
+        g->_arrived[index] = 1;
+        g->_received++;
+    }
+
+    if (index < g->_dataCount && !g->_dataPresent[index])
+    {
+        packetFecMakeSymbol(g->_data[index], data, size, size + 2);
+        g->_dataPresent[index] = 1;
+    }
+    else if (index >= g->_dataCount && !g->_parityPresent[j])
+    {
+        memcpy(g->_parity[j], data, size);
+        g->_parityPresent[j] = 1;
+        g->_symbolSize = size;
+    }
+    return 1;
+}
+
+static void recoverGroup(t_opusfecdec* x, FecGroup* g)
+{
+    if (!g->_symbolSize || g->_received < g->_dataCount)
+        return;
+
+    int missing = 0;
+    for (int s = 0; s < g->_dataCount; ++s)
+    {
+        if (g->_dataPresent[s])
+        {
+            int size = packetFecSymbolLength(g->_data[s]) + 2;
+            if (size > g->_symbolSize)
+                return;
+            memset(g->_data[s] + size, 0, g->_symbolSize - size);
+        }
+        else
+        {
+            missing++;
+        }
+    }
+
+    if (!missing)
+        return;
+
+    int recovered = packetFecRecover(g->_data, g->_dataPresent, g->_dataCount, g->_parity, g->_parityPresent, g->_parityCount, x->_scratch, g->_symbolSize);
+    if (recovered <= 0)
+        return;
+
+    // a corrupt parity packet could claim any length
+    for (int s = 0; s < g->_dataCount; ++s)
+    {
+        if (!g->_dataPresent[s] && packetFecSymbolLength(g->_data[s]) + 2 <= g->_symbolSize)
+        {
+            g->_dataPresent[s] = 1;
+            x->_recovered++;
+        }
+    }
+
+    verbose(LOG_LEVEL_NORMAL, "recovered %d packet(s) of group %d", recovered, g->_group);
+}
+
+static void outputData(t_opusfecdec* x, FecGroup* g, int index)
+{
+    const unsigned char* symbol = g->_data[index];
+    int size = packetFecSymbolLength(symbol);
+    for (int i = 0; i < size; ++i)
+        SETFLOAT(&x->_atoms[i], symbol[2 + i]);
+
+    outlet_list(x->_packetOutlet, &s_list, size, x->_atoms);
+}
+
+static void drainGroups(t_opusfecdec* x, int giveUpBelow)
+{
+    // packets go out in order as soon as they are there; groups older than
+    // giveUpBelow go out with a loss marker for each packet still missing
+    for (;;)
+    {
+        FecGroup* g = groupSlot(x, x->_nextGroup);
+        int known = g->_group == x->_nextGroup;
+        int dataCount = known ? g->_dataCount : x->_lastDataCount;
+
+        while (known && x->_nextIndex < dataCount && g->_dataPresent[x->_nextIndex])
+            outputData(x, g, x->_nextIndex++);
+
+        if (x->_nextIndex < dataCount)
+        {
+            if (x->_nextGroup >= giveUpBelow)
+                return;
+
+            for (; x->_nextIndex < dataCount; ++x->_nextIndex)
+            {
+                if (known && g->_dataPresent[x->_nextIndex])
+                {
+                    outputData(x, g, x->_nextIndex);
+                    continue;
+                }
+                x->_lost++;
+                outlet_bang(x->_packetOutlet);
+            }
+        }
+
+        if (!known)
+            accountGroup(x, x->_lastDataCount, x->_lastParityCount, 0);
+
+        x->_nextGroup++;
+        x->_nextIndex = 0;
+        if (x->_nextGroup >= giveUpBelow && groupSlot(x, x->_nextGroup)->_group != x->_nextGroup)
+            return;
+    }
+}
+
+static void resync(t_opusfecdec* x, int group, int index, int dataCount)
+{
+    for (int i = 0; i < GROUP_WINDOW; ++i)
+    {
+        FecGroup* g = &x->_groups[i];
+        if (g->_group >= 0)
+            accountGroup(x, g->_dataCount, g->_parityCount, g->_received);
+        g->_group = -1;
+    }
+
+    // a parity packet comes after its group's data, so start with the next
+    x->_synced = 1;
+    x->_nextGroup = index < dataCount ? group : group + 1;
+    x->_nextIndex = index < dataCount ? index : 0;
+    x->_newestGroup = x->_nextGroup;
+    x->_newestIndex = x->_nextIndex - 1;
+
+    verbose(LOG_LEVEL_NORMAL, "synchronised to FEC group %d", group);
+}
+
+void opusfecdec_packet(t_opusfecdec* x, t_symbol* s, int argc, t_atom* argv)
+{
+    // upstream loss markers carry nothing; gaps show in the group numbers
+    if (!argc)
+        return;
+
+    int wireGroup, dataCount, parityCount, index;
+    if (!loadPacket(x, argc, argv) || !packetFecReadHeader(x->_packet, argc, &wireGroup, &dataCount, &parityCount, &index))
+    {
+        x->_invalid++;
+        return;
+    }
+
+    const unsigned char* data = x->_packet + PACKETFEC_HEADER_SIZE;
+    int size = argc - PACKETFEC_HEADER_SIZE;
+    int group = unwrapGroup(x, wireGroup);
+
+    // a restarted sender or a long outage starts over rather than
+    // emitting a loss marker for every packet in between
+    if (!x->_synced || group < x->_nextGroup - RESYNC_GROUPS || group >= x->_nextGroup + RESYNC_GROUPS)
+    {
+        if (x->_synced)
+            x->_lost += (group - x->_nextGroup > 0 ? group - x->_nextGroup : 0) * x->_lastDataCount;
+        resync(x, wireGroup, index, dataCount);
+        group = unwrapGroup(x, wireGroup);
+    }
+
+    FecGroup* g = groupSlot(x, group);
+    if (group < x->_nextGroup)
+    {
+        // too late to be output, but still counts as arrived; data that
+        // was rebuilt in time isn't late
+        int known = g->_group == group && g->_dataCount == dataCount;
+        if (index < dataCount && !(known && g->_dataPresent[index]))
+            x->_late++;
+        if (known)
+            storePacket(x, g, index, data, size);
+        return;
+    }
+
+    if (group >= x->_nextGroup + GROUP_WINDOW)
+        drainGroups(x, group - GROUP_WINDOW + 1);
+
+    if (g->_group != group)
+        resetGroup(x, g, group, dataCount, parityCount);
+
+    if (g->_dataCount != dataCount || g->_parityCount != parityCount || !storePacket(x, g, index, data, size))
+    {
+        x->_invalid++;
+        return;
+    }
+
+    x->_lastDataCount = dataCount;
+    x->_lastParityCount = parityCount;
+
+    // parity is sent after all of its group's data
+    int position = index < dataCount ? index : dataCount - 1;
+    if (group > x->_newestGroup || (group == x->_newestGroup && position > x->_newestIndex))
+    {
+        x->_newestGroup = group;
+        x->_newestIndex = position;
+    }
+
+    recoverGroup(x, g);
+    drainGroups(x, group - x->_depth + 1);
+    scheduleFlush(x);
+}
+
+/* Packets that arrived after a missing one are held until it is rebuilt
+   or "depth" later groups show up, which never happens when the sender
+   pauses or stops. A clock releases them maxwait ms after the stream got
+   stuck, whether or not anything else arrives. */
+static void scheduleFlush(t_opusfecdec* x)
+{
+    int holding = x->_newestGroup > x->_nextGroup || (x->_newestGroup == x->_nextGroup && x->_newestIndex >= x->_nextIndex);
+    if (!holding || x->_maxWait <= 0)
+    {
+        clock_unset(x->_flushClock);
+        x->_holding = 0;
+        return;
+    }
+
+    // the wait starts over whenever the output moves on
+    if (!x->_holding || x->_holdGroup != x->_nextGroup || x->_holdIndex != x->_nextIndex)
+    {
+        clock_delay(x->_flushClock, x->_maxWait);
+        x->_holding = 1;
+        x->_holdGroup = x->_nextGroup;
+        x->_holdIndex = x->_nextIndex;
+    }
+}
+
+static void flushTick(t_opusfecdec* x)
+{
+    x->_holding = 0;
+
+    // everything before the newest group was sent long ago, and in it
+    // only what was sent before the newest packet is given up on
+    drainGroups(x, x->_newestGroup);
+
+    FecGroup* g = groupSlot(x, x->_nextGroup);
+    if (x->_nextGroup == x->_newestGroup && g->_group == x->_nextGroup)
+    {
+        for (; x->_nextIndex <= x->_newestIndex && x->_nextIndex < g->_dataCount; ++x->_nextIndex)
+        {
+            if (g->_dataPresent[x->_nextIndex])
+            {
+                outputData(x, g, x->_nextIndex);
+                continue;
+            }
+            x->_lost++;
+            outlet_bang(x->_packetOutlet);
+        }
+    }
+
+    drainGroups(x, x->_nextGroup);
+    verbose(LOG_LEVEL_NORMAL, "released held packets after %g ms", x->_maxWait);
+}
+
+void opusfecdec_anything(t_opusfecdec* x, t_symbol* s, int argc, t_atom* argv)
+{
+    outlet_anything(x->_packetOutlet, s, argc, argv);
+}
@@ -0,0 +1,323 @@
+#include "m_pd.h"
+#include "packetfec.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_DATA_COUNT 8
+#define DEFAULT_PARITY_COUNT 2
+#define DEFAULT_TARGET_RESIDUAL 0.1f
+#define LOSS_DECAY 0.8f
+
+static t_class* opusfecenc_class;
+
+enum LOG_LEVEL
+{
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_NORMAL
+};
+
+typedef struct _opusfecenc
+{
+    t_object x_obj;
+    t_outlet* _packetOutlet;
+    int _group;
+    int _dataCount;
+    int _parityCount;
+    int _pendingDataCount;
+    int _pendingParityCount;
+    int _index;
+    int _maxSize;
+    unsigned char* _symbolData;
+    unsigned char* _symbols[PACKETFEC_MAX_DATA];
+    int _sizes[PACKETFEC_MAX_DATA];
+    unsigned char* _parityData;
+    unsigned char* _parity[PACKETFEC_MAX_PARITY];
+    unsigned char* _packet;
+    t_atom* _atoms;
+    int _adapt;
+    int _maxParity;
+    float _targetResidual;
+    float _smoothedLoss;
+    int _dataPackets;
+    int _parityPackets;
+    int _invalidPackets;
+} t_opusfecenc;
+
+void opusfecenc_setup();
+void* opusfecenc_new(t_floatarg dataCount, t_floatarg parityCount);
+void opusfecenc_free(t_opusfecenc* x);
+void opusfecenc_packet(t_opusfecenc* x, t_symbol* s, int argc, t_atom* argv);
+void opusfecenc_anything(t_opusfecenc* x, t_symbol* s, int argc, t_atom* argv);
+void opusfecenc_group(t_opusfecenc* x, t_floatarg dataCount);
+void opusfecenc_parity(t_opusfecenc* x, t_floatarg parityCount);
+void opusfecenc_adapt(t_opusfecenc* x, t_symbol* s, int argc, t_atom* argv);
+void opusfecenc_loss(t_opusfecenc* x, t_floatarg percent);
+void opusfecenc_status(t_opusfecenc* x);
+static int loadPacket(t_opusfecenc* x, int argc, t_atom* argv);
+static void outputPacket(t_opusfecenc* x, int index, const unsigned char* data, int size);
+static void outputParity(t_opusfecenc* x);
+static double residualLoss(int dataCount, int parityCount, double loss);
+static int adaptParityCount(t_opusfecenc* x);
+
+void opusfecenc_setup()
+{
+    packetFecInit();
+
+    opusfecenc_class = class_new(gensym("opusfecenc"),
+                                 (t_newmethod)opusfecenc_new,
+                                 (t_method)opusfecenc_free,
+                                 sizeof(t_opusfecenc),
+                                 CLASS_DEFAULT,
+                                 A_DEFFLOAT,
+                                 A_DEFFLOAT,
+                                 0);
+
+    class_addlist(opusfecenc_class, (t_method)opusfecenc_packet);
+    class_addanything(opusfecenc_class, (t_method)opusfecenc_anything);
+    class_addmethod(opusfecenc_class, (t_method)opusfecenc_group, gensym("group"), A_FLOAT, 0);
+    class_addmethod(opusfecenc_class, (t_method)opusfecenc_parity, gensym("parity"), A_FLOAT, 0);
+    class_addmethod(opusfecenc_class, (t_method)opusfecenc_adapt, gensym("adapt"), A_GIMME, 0);
+    class_addmethod(opusfecenc_class, (t_method)opusfecenc_loss, gensym("loss"), A_FLOAT, 0);
+    class_addmethod(opusfecenc_class, (t_method)opusfecenc_status, gensym("status"), 0);
+}
+
+void* opusfecenc_new(t_floatarg dataCount, t_floatarg parityCount)
+{
+    t_opusfecenc* x = (t_opusfecenc*)pd_new(opusfecenc_class);
+    if (!x)
+        return 0;
+
+    x->_packetOutlet = outlet_new(&x->x_obj, &s_list);
+    x->_group = 0;
+    x->_index = 0;
+    x->_maxSize = 0;
+    x->_symbolData = (unsigned char*)malloc(PACKETFEC_MAX_DATA * PACKETFEC_SYMBOL_SIZE);
+    x->_parityData = (unsigned char*)malloc(PACKETFEC_MAX_PARITY * PACKETFEC_SYMBOL_SIZE);
+    for (int i = 0; i < PACKETFEC_MAX_DATA; ++i)
+        x->_symbols[i] = x->_symbolData + i * PACKETFEC_SYMBOL_SIZE;
+    for (int i = 0; i < PACKETFEC_MAX_PARITY; ++i)
+        x->_parity[i] = x->_parityData + i * PACKETFEC_SYMBOL_SIZE;
+    x->_packet = (unsigned char*)malloc(PACKETFEC_MAX_PACKET_SIZE);
+    x->_atoms = (t_atom*)malloc((PACKETFEC_HEADER_SIZE + PACKETFEC_SYMBOL_SIZE) * sizeof(t_atom));
+    x->_adapt = 0;
+    x->_maxParity = 0;
+    x->_targetResidual = DEFAULT_TARGET_RESIDUAL;
+    x->_smoothedLoss = 0;
+    x->_dataPackets = 0;
+    x->_parityPackets = 0;
+    x->_invalidPackets = 0;
+
+    x->_dataCount = x->_pendingDataCount = DEFAULT_DATA_COUNT;
+    x->_parityCount = x->_pendingParityCount = DEFAULT_PARITY_COUNT;
+    if (dataCount)
+        opusfecenc_group(x, dataCount);
+    if (parityCount)
+        opusfecenc_parity(x, parityCount);
+    x->_dataCount = x->_pendingDataCount;
+    x->_parityCount = x->_pendingParityCount;
+
+    return x;
+}
+
+void opusfecenc_free(t_opusfecenc* x)
+{
+    free(x->_symbolData);
+    free(x->_parityData);
+    free(x->_packet);
+    free(x->_atoms);
+}
+
+void opusfecenc_group(t_opusfecenc* x, t_floatarg dataCount)
+{
+    if (dataCount < 1 || dataCount > PACKETFEC_MAX_DATA)
+    {
+        error("group size must be 1 to %d packets", PACKETFEC_MAX_DATA);
+        return;
+    }
+
+    x->_pendingDataCount = dataCount;
+    verbose(LOG_LEVEL_NORMAL, "set FEC group size to %d packets from the next group", (int)dataCount);
+}
+
+void opusfecenc_parity(t_opusfecenc* x, t_floatarg parityCount)
+{
+    if (parityCount < 0 || parityCount > PACKETFEC_MAX_PARITY)
+    {
+        error("parity must be 0 to %d packets per group", PACKETFEC_MAX_PARITY);
+        return;
+    }
+
+    x->_pendingParityCount = parityCount;
+    verbose(LOG_LEVEL_NORMAL, "set FEC parity to %d packets per group from the next group", (int)parityCount);
+}
+
+void opusfecenc_adapt(t_opusfecenc* x, t_symbol* s, int argc, t_atom* argv)
+{
+    x->_adapt = atom_getfloatarg(0, argc, argv) != 0;
+    if (argc > 1)
+        x->_maxParity = atom_getfloatarg(1, argc, argv);
+    if (argc > 2)
+        x->_targetResidual = atom_getfloatarg(2, argc, argv);
+
+    if (x->_maxParity < 0 || x->_maxParity > PACKETFEC_MAX_PARITY)
+        x->_maxParity = PACKETFEC_MAX_PARITY;
+
+    if (x->_adapt)
+        x->_pendingParityCount = adaptParityCount(x);
+
+    verbose(LOG_LEVEL_NORMAL, "adaptive FEC %s", x->_adapt ? "enabled" : "disabled");
+}
+
+void opusfecenc_loss(t_opusfecenc* x, t_floatarg percent)
+{
+    // rise at once on new loss, fall back slowly once it clears
+    float loss = percent < 0 ? 0 : percent > 100 ? 100 : percent;
+    x->_smoothedLoss = loss > x->_smoothedLoss ? loss : LOSS_DECAY * x->_smoothedLoss + (1 - LOSS_DECAY) * loss;
+
+    if (!x->_adapt)
+        return;
+
+    int parityCount = adaptParityCount(x);
+    if (parityCount != x->_pendingParityCount)
+    {
+        x->_pendingParityCount = parityCount;
+        verbose(LOG_LEVEL_NORMAL, "adapted FEC parity to %d packets per group at %g%% loss", parityCount, x->_smoothedLoss);
+    }
+}
+
+static double residualLoss(int dataCount, int parityCount, double loss)
+{
+    // probability that more packets of a group are lost than parity can
+    // rebuild, with independent losses
+    int n = dataCount + parityCount;
+    double term = pow(1 - loss, n);
+    double recoverable = 0;
+    for (int i = 0; i <= parityCount; ++i)
+    {
+        recoverable += term;
+        term *= (double)(n - i) / (i + 1) * loss / (1 - loss);
+    }
+    return recoverable < 1 ? 1 - recoverable : 0;
+}
+
+static int adaptParityCount(t_opusfecenc* x)
+{
+    int maxParity = x->_maxParity ? x->_maxParity : (x->_pendingDataCount + 1) / 2;
+    if (maxParity > PACKETFEC_MAX_PARITY)
+        maxParity = PACKETFEC_MAX_PARITY;
+
+    double loss = x->_smoothedLoss / 100;
+    if (loss <= 0)
+        return 1 < maxParity ? 1 : maxParity;
+    if (loss >= 1)
+        return maxParity;
+
+    int parityCount = 1;
+    while (parityCount < maxParity && residualLoss(x->_pendingDataCount, parityCount, loss) * 100 > x->_targetResidual)
+        parityCount++;
+    return parityCount < maxParity ? parityCount : maxParity;
+}
+
+void opusfecenc_status(t_opusfecenc* x)
+{
+    post("group: %d data + %d parity packets (%g%% overhead)", x->_dataCount, x->_parityCount, 100.f * x->_parityCount / x->_dataCount);
+    if (x->_pendingDataCount != x->_dataCount || x->_pendingParityCount != x->_parityCount)
+        post("next group: %d data + %d parity packets", x->_pendingDataCount, x->_pendingParityCount);
+    post("packets: %d data, %d parity, %d invalid", x->_dataPackets, x->_parityPackets, x->_invalidPackets);
+    if (x->_adapt)
+        post("adaptive: smoothed loss %g%%, target residual loss %g%%", x->_smoothedLoss, x->_targetResidual);
+}
+
+static int loadPacket(t_opusfecenc* x, int argc, t_atom* argv)
+{
+    if (argc > PACKETFEC_MAX_PACKET_SIZE)
+    {
+        error("packet of %d bytes exceeds the maximum of %d", argc, PACKETFEC_MAX_PACKET_SIZE);
+        return 0;
+    }
+
+    for (int i = 0; i < argc; ++i)
+    {
+        t_float f = atom_getfloat(&argv[i]);
+        if (argv[i].a_type != A_FLOAT || f != (int)f || f < 0 || f > 255)
+        {
+            error("invalid packet data (%f) at byte index: %d", f, i);
+            return 0;
+        }
+        x->_packet[i] = (int)f;
+    }
+    return 1;
+}
+
+static void outputPacket(t_opusfecenc* x, int index, const unsigned char* data, int size)
+{
+    unsigned char header[PACKETFEC_HEADER_SIZE];
+    packetFecWriteHeader(header, x->_group, x->_dataCount, x->_parityCount, index);
+
+    for (int i = 0; i < PACKETFEC_HEADER_SIZE; ++i)
+        SETFLOAT(&x->_atoms[i], header[i]);
+    for (int i = 0; i < size; ++i)
+        SETFLOAT(&x->_atoms[PACKETFEC_HEADER_SIZE + i], data[i]);
+
+    outlet_list(x->_packetOutlet, &s_list, PACKETFEC_HEADER_SIZE + size, x->_atoms);
+}
+
+static void outputParity(t_opusfecenc* x)
+{
+    // symbols are as long as the longest packet in the group
+    int symbolSize = x->_maxSize + 2;
+    for (int i = 0; i < x->_dataCount; ++i)
+        memset(x->_symbols[i] + 2 + x->_sizes[i], 0, symbolSize - 2 - x->_sizes[i]);
+
+    packetFecEncode(x->_symbols, x->_dataCount, x->_parity, x->_parityCount, symbolSize);
+
+    for (int j = 0; j < x->_parityCount; ++j)
+    {
+        outputPacket(x, x->_dataCount + j, x->_parity[j], symbolSize);
+        x->_parityPackets++;
+    }
+}
+
+void opusfecenc_packet(t_opusfecenc* x, t_symbol* s, int argc, t_atom* argv)
+{
+    // loss markers mean nothing on the sending side
+    if (!argc)
+        return;
+
+    if (!loadPacket(x, argc, argv))
+    {
+        x->_invalidPackets++;
+        return;
+    }
+
+    // group settings only change between groups
+    if (!x->_index)
+    {
+        x->_dataCount = x->_pendingDataCount;
+        x->_parityCount = x->_pendingParityCount;
+        x->_maxSize = 0;
+    }
+
+    int index = x->_index++;
+    packetFecMakeSymbol(x->_symbols[index], x->_packet, argc, argc + 2);
+    x->_sizes[index] = argc;
+    if (argc > x->_maxSize)
+        x->_maxSize = argc;
+
+    outputPacket(x, index, x->_packet, argc);
+    x->_dataPackets++;
+
+    if (x->_index == x->_dataCount)
+    {
+        outputParity(x);
+        x->_index = 0;
+        x->_group = (x->_group + 1) & 0xffff;
+    }
+}
+
+void opusfecenc_anything(t_opusfecenc* x, t_symbol* s, int argc, t_atom* argv)
+{
+    // control messages such as the demixing matrix pass unprotected
+    outlet_anything(x->_packetOutlet, s, argc, argv);
+}
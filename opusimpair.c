@@ -0,0 +1,430 @@
+#include "m_pd.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_QUEUE_SIZE 64
+#define PARETO_SHAPE 2.5
+
+static t_class* opusimpair_class;
+
+enum LOG_LEVEL
+{
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_NORMAL
+};
+
+enum DISTRIBUTION
+{
+    DISTRIBUTION_UNIFORM = 0,
+    DISTRIBUTION_NORMAL,
+    DISTRIBUTION_PARETO
+};
+
+typedef struct _delayedpacket
+{
+    double _due;
+    double _arrival;
+    int _size;
+    t_atom* _atoms;
+} DelayedPacket;
+
+typedef struct _opusimpair
+{
+    t_object x_obj;
+    t_outlet* _packetOutlet;
+    t_outlet* _statsOutlet;
+    t_clock* _clock;
+    double _epoch;
+    uint64_t _seed;
+    uint64_t _state;
+    int _bad;
+    int _lostPrevious;
+    double _goodToBad;
+    double _badToGood;
+    double _lossGood;
+    double _lossBad;
+    double _delay;
+    double _jitter;
+    int _distribution;
+    double _reorder;
+    double _reorderDelay;
+    double _duplicate;
+    int _markLost;
+    double _lastDue;
+    DelayedPacket* _queue;
+    int _queueSize;
+    int _queueCount;
+    int _packetsIn;
+    int _packetsOut;
+    int _lost;
+    int _bursts;
+    int _reordered;
+    int _duplicated;
+    double _delaySum;
+    double _maxDelay;
+} t_opusimpair;
+
+void opusimpair_setup();
+void* opusimpair_new(t_floatarg seed);
+void opusimpair_free(t_opusimpair* x);
+void opusimpair_packet(t_opusimpair* x, t_symbol* s, int argc, t_atom* argv);
+void opusimpair_anything(t_opusimpair* x, t_symbol* s, int argc, t_atom* argv);
+void opusimpair_seed(t_opusimpair* x, t_floatarg seed);
+void opusimpair_loss(t_opusimpair* x, t_floatarg percent);
+void opusimpair_gilbert(t_opusimpair* x, t_symbol* s, int argc, t_atom* argv);
+void opusimpair_delay(t_opusimpair* x, t_symbol* s, int argc, t_atom* argv);
+void opusimpair_reorder(t_opusimpair* x, t_floatarg percent, t_floatarg ms);
+void opusimpair_duplicate(t_opusimpair* x, t_floatarg percent);
+void opusimpair_marklost(t_opusimpair* x, t_floatarg enabled);
+void opusimpair_flush(t_opusimpair* x);
+void opusimpair_stats(t_opusimpair* x);
+void opusimpair_resetstats(t_opusimpair* x);
+static double randomUniform(t_opusimpair* x);
+static double randomDelay(t_opusimpair* x);
+static int isLost(t_opusimpair* x);
+static void schedulePacket(t_opusimpair* x, double arrival, double due, int argc, t_atom* argv);
+static void outputDue(t_opusimpair* x);
+static void outputStat(t_opusimpair* x, const char* name, t_float value);
+
+void opusimpair_setup()
+{
+    opusimpair_class = class_new(gensym("opusimpair"),
+                                 (t_newmethod)opusimpair_new,
+                                 (t_method)opusimpair_free,
+                                 sizeof(t_opusimpair),
+                                 CLASS_DEFAULT,
+                                 A_DEFFLOAT,
+                                 0);
+
+    class_addlist(opusimpair_class, (t_method)opusimpair_packet);
+    class_addanything(opusimpair_class, (t_method)opusimpair_anything);
+    class_addmethod(opusimpair_class, (t_method)opusimpair_seed, gensym("seed"), A_FLOAT, 0);
+    class_addmethod(opusimpair_class, (t_method)opusimpair_loss, gensym("loss"), A_FLOAT, 0);
+    class_addmethod(opusimpair_class, (t_method)opusimpair_gilbert, gensym("gilbert"), A_GIMME, 0);
+    class_addmethod(opusimpair_class, (t_method)opusimpair_delay, gensym("delay"), A_GIMME, 0);
+    class_addmethod(opusimpair_class, (t_method)opusimpair_reorder, gensym("reorder"), A_FLOAT, A_DEFFLOAT, 0);
+    class_addmethod(opusimpair_class, (t_method)opusimpair_duplicate, gensym("duplicate"), A_FLOAT, 0);
+    class_addmethod(opusimpair_class, (t_method)opusimpair_marklost, gensym("marklost"), A_FLOAT, 0);
+    class_addmethod(opusimpair_class, (t_method)opusimpair_flush, gensym("flush"), 0);
+    class_addmethod(opusimpair_class, (t_method)opusimpair_stats, gensym("stats"), 0);
+    class_addmethod(opusimpair_class, (t_method)opusimpair_resetstats, gensym("resetstats"), 0);
+}
+
+void* opusimpair_new(t_floatarg seed)
+{
+    t_opusimpair* x = (t_opusimpair*)pd_new(opusimpair_class);
+    if (!x)
+        return 0;
+
+    x->_packetOutlet = outlet_new(&x->x_obj, &s_list);
+    x->_statsOutlet = outlet_new(&x->x_obj, 0);
+    x->_clock = clock_new(x, (t_method)outputDue);
+    x->_epoch = clock_getlogicaltime();
+    x->_goodToBad = 0;
+    x->_badToGood = 1;
+    x->_lossGood = 0;
+    x->_lossBad = 1;
+    x->_delay = 0;
+    x->_jitter = 0;
+    x->_distribution = DISTRIBUTION_UNIFORM;
+    x->_reorder = 0;
+    x->_reorderDelay = 0;
+    x->_duplicate = 0;
+    x->_markLost = 1;
+    x->_lastDue = 0;
+    x->_queueSize = INITIAL_QUEUE_SIZE;
+    x->_queue = (DelayedPacket*)malloc(x->_queueSize * sizeof(DelayedPacket));
+    x->_queueCount = 0;
+
+    opusimpair_seed(x, seed);
+    opusimpair_resetstats(x);
+
+    return x;
+}
+
+void opusimpair_free(t_opusimpair* x)
+{
+    for (int i = 0; i < x->_queueCount; ++i)
+        freebytes(x->_queue[i]._atoms, x->_queue[i]._size * sizeof(t_atom));
+    free(x->_queue);
+    clock_free(x->_clock);
+}
+
+void opusimpair_seed(t_opusimpair* x, t_floatarg seed)
+{
+    // splitmix64 turns small seeds into a well mixed xorshift state
+    uint64_t z = (uint64_t)seed + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    x->_seed = (uint64_t)seed;
+    x->_state = (z ^ (z >> 31)) | 1;
+    x->_bad = 0;
+    x->_lostPrevious = 0;
+}
+
+static double randomUniform(t_opusimpair* x)
+{
+    // xorshift64*
+    x->_state ^= x->_state >> 12;
+    x->_state ^= x->_state << 25;
+    x->_state ^= x->_state >> 27;
+    return ((x->_state * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void opusimpair_loss(t_opusimpair* x, t_floatarg percent)
+{
+    // independent losses: a Gilbert-Elliott channel that never turns bad
+    x->_goodToBad = 0;
+    x->_badToGood = 1;
+    x->_lossGood = percent / 100;
+    x->_lossBad = 1;
+    x->_bad = 0;
+}
+
+void opusimpair_gilbert(t_opusimpair* x, t_symbol* s, int argc, t_atom* argv)
+{
+    if (argc < 2)
+    {
+        error("gilbert needs p (good to bad) and r (bad to good) in percent, optionally followed by the loss in the good and bad state");
+        return;
+    }
+
+    x->_goodToBad = atom_getfloatarg(0, argc, argv) / 100;
+    x->_badToGood = atom_getfloatarg(1, argc, argv) / 100;
+    x->_lossGood = argc > 2 ? atom_getfloatarg(2, argc, argv) / 100 : 0;
+    x->_lossBad = argc > 3 ? atom_getfloatarg(3, argc, argv) / 100 : 1;
+    x->_bad = 0;
+}
+
+void opusimpair_delay(t_opusimpair* x, t_symbol* s, int argc, t_atom* argv)
+{
+    x->_delay = atom_getfloatarg(0, argc, argv);
+    x->_jitter = atom_getfloatarg(1, argc, argv);
+
+    t_symbol* distribution = atom_getsymbolarg(2, argc, argv);
+    if (distribution == gensym("normal"))
+        x->_distribution = DISTRIBUTION_NORMAL;
+    else if (distribution == gensym("pareto"))
+        x->_distribution = DISTRIBUTION_PARETO;
+    else if (distribution == &s_ || distribution == gensym("uniform"))
+        x->_distribution = DISTRIBUTION_UNIFORM;
+    else
+        error("delay distribution must be 'uniform', 'normal' or 'pareto'");
+}
+
+void opusimpair_reorder(t_opusimpair* x, t_floatarg percent, t_floatarg ms)
+{
+    x->_reorder = percent / 100;
+    x->_reorderDelay = ms;
+}
+
+void opusimpair_duplicate(t_opusimpair* x, t_floatarg percent)
+{
+    x->_duplicate = percent / 100;
+}
+
+void opusimpair_marklost(t_opusimpair* x, t_floatarg enabled)
+{
+    x->_markLost = (enabled == 0 ? 0 : 1);
+}
+
+void opusimpair_resetstats(t_opusimpair* x)
+{
+    x->_packetsIn = 0;
+    x->_packetsOut = 0;
+    x->_lost = 0;
+    x->_bursts = 0;
+    x->_reordered = 0;
+    x->_duplicated = 0;
+    x->_delaySum = 0;
+    x->_maxDelay = 0;
+}
+
+static void outputStat(t_opusimpair* x, const char* name, t_float value)
+{
+    t_atom a;
+    SETFLOAT(&a, value);
+    outlet_anything(x->_statsOutlet, gensym(name), 1, &a);
+}
+
+void opusimpair_stats(t_opusimpair* x)
+{
+    double meanDelay = x->_packetsOut ? x->_delaySum / x->_packetsOut : 0;
+    double meanBurst = x->_bursts ? (double)x->_lost / x->_bursts : 0;
+
+    post("seed %d: %d packet(s) in, %d out, %d lost in %d burst(s), %d reordered, %d duplicated",
+         (int)x->_seed, x->_packetsIn, x->_packetsOut, x->_lost, x->_bursts, x->_reordered, x->_duplicated);
+    post("delay mean %g ms, max %g ms", meanDelay, x->_maxDelay);
+
+    outputStat(x, "in", x->_packetsIn);
+    outputStat(x, "out", x->_packetsOut);
+    outputStat(x, "lost", x->_lost);
+    outputStat(x, "loss", x->_packetsIn ? 100.f * x->_lost / x->_packetsIn : 0);
+    outputStat(x, "bursts", x->_bursts);
+    outputStat(x, "meanburst", meanBurst);
+    outputStat(x, "reordered", x->_reordered);
+    outputStat(x, "duplicated", x->_duplicated);
+    outputStat(x, "meandelay", meanDelay);
+    outputStat(x, "maxdelay", x->_maxDelay);
+}
+
+static int isLost(t_opusimpair* x)
+{
+    // Gilbert-Elliott: the state changes before each packet, and each
+    // state has its own loss probability
+    if (x->_bad)
+        x->_bad = randomUniform(x) >= x->_badToGood;
+    else
+        x->_bad = randomUniform(x) < x->_goodToBad;
+
+    int lost = randomUniform(x) < (x->_bad ? x->_lossBad : x->_lossGood);
+    if (lost && !x->_lostPrevious)
+        x->_bursts++;
+    x->_lostPrevious = lost;
+    return lost;
+}
+
+static double randomDelay(t_opusimpair* x)
+{
+    double delay = x->_delay;
+    if (x->_jitter > 0)
+    {
+        switch (x->_distribution) {
+            case DISTRIBUTION_NORMAL:
+            {
+                // Box-Muller
+                double u = 1 - randomUniform(x);
+                double v = randomUniform(x);
+                delay += x->_jitter * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+                break;
+            }
+            case DISTRIBUTION_PARETO:
+                delay += x->_jitter * (pow(1 - randomUniform(x), -1 / PARETO_SHAPE) - 1);
+                break;
+            default:
+                delay += x->_jitter * (2 * randomUniform(x) - 1);
+                break;
+        }
+    }
+    return delay > 0 ? delay : 0;
+}
+
+static void schedulePacket(t_opusimpair* x, double arrival, double due, int argc, t_atom* argv)
+{
+    if (x->_queueCount == x->_queueSize)
+    {
+        x->_queue = (DelayedPacket*)realloc(x->_queue, 2 * x->_queueSize * sizeof(DelayedPacket));
+        x->_queueSize *= 2;
+    }
+
+    // keep the queue sorted by due time; equal times stay in arrival order
+    int i = x->_queueCount;
+    while (i > 0 && x->_queue[i - 1]._due > due)
+    {
+        x->_queue[i] = x->_queue[i - 1];
+        --i;
+    }
+
+    x->_queue[i]._due = due;
+    x->_queue[i]._arrival = arrival;
+    x->_queue[i]._size = argc;
+    x->_queue[i]._atoms = argc ? (t_atom*)copybytes(argv, argc * sizeof(t_atom)) : 0;
+    x->_queueCount++;
+
+    clock_delay(x->_clock, x->_queue[0]._due - clock_gettimesince(x->_epoch));
+}
+
+static void outputDue(t_opusimpair* x)
+{
+    double now = clock_gettimesince(x->_epoch);
+    while (x->_queueCount && x->_queue[0]._due <= now)
+    {
+        DelayedPacket packet = x->_queue[0];
+        x->_queueCount--;
+        memmove(x->_queue, x->_queue + 1, x->_queueCount * sizeof(DelayedPacket));
+
+        if (packet._size)
+        {
+            x->_packetsOut++;
+            x->_delaySum += now - packet._arrival;
+            if (now - packet._arrival > x->_maxDelay)
+                x->_maxDelay = now - packet._arrival;
+            outlet_list(x->_packetOutlet, &s_list, packet._size, packet._atoms);
+            freebytes(packet._atoms, packet._size * sizeof(t_atom));
+        }
+        else
+        {
+            outlet_bang(x->_packetOutlet);
+        }
+    }
+
+    if (x->_queueCount)
+        clock_delay(x->_clock, x->_queue[0]._due - now);
+    else
+        clock_unset(x->_clock);
+}
+
+void opusimpair_flush(t_opusimpair* x)
+{
+    for (int i = 0; i < x->_queueCount; ++i)
+        freebytes(x->_queue[i]._atoms, x->_queue[i]._size * sizeof(t_atom));
+    x->_queueCount = 0;
+    x->_lastDue = 0;
+    clock_unset(x->_clock);
+}
+
+void opusimpair_packet(t_opusimpair* x, t_symbol* s, int argc, t_atom* argv)
+{
+    // an empty list is a loss upstream and passes through as one
+    if (!argc)
+    {
+        outlet_bang(x->_packetOutlet);
+        return;
+    }
+
+    x->_packetsIn++;
+    double now = clock_gettimesince(x->_epoch);
+    double delay = randomDelay(x);
+
+    if (isLost(x))
+    {
+        x->_lost++;
+        if (x->_markLost)
+            schedulePacket(x, now, now + delay, 0, 0);
+        return;
+    }
+
+    // packets keep their order like on a single path, unless picked to
+    // be held back past the ones that follow
+    double due = now + delay;
+    if (x->_reorder > 0 && randomUniform(x) < x->_reorder)
+    {
+        due += x->_reorderDelay;
+        x->_reordered++;
+    }
+    else
+    {
+        if (due < x->_lastDue)
+            due = x->_lastDue;
+        x->_lastDue = due;
+    }
+
+    schedulePacket(x, now, due, argc, argv);
+
+    if (x->_duplicate > 0 && randomUniform(x) < x->_duplicate)
+    {
+        x->_duplicated++;
+        schedulePacket(x, now, now + randomDelay(x), argc, argv);
+    }
+
+    if (x->_queue[0]._due <= now)
+        outputDue(x);
+}
+
+void opusimpair_anything(t_opusimpair* x, t_symbol* s, int argc, t_atom* argv)
+{
+    // control messages such as the demixing matrix pass unimpaired
+    outlet_anything(x->_packetOutlet, s, argc, argv);
+}
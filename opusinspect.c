@@ -0,0 +1,250 @@
+#include "m_pd.h"
+#include "opuscodec.h"
+#include <opus.h>
+#include <string.h>
+
+#define MAX_PACKET_SIZE 4000
+#define TOC_SAMPLE_RATE 48000
+#define BANDWIDTHS 5
+
+static t_class* opusinspect_class;
+
+/* Packet metadata without a decoder: everything comes from the TOC byte
+   and the frame lengths that opus_packet_parse() reads, plus the LBRR
+   flag at the start of the SILK layer, so the cost per packet is a few
+   byte reads and there is no codec state to allocate. One object keeps
+   the running statistics of one stream. */
+typedef struct _opusinspect
+{
+    t_object x_obj;
+    t_outlet* _packetOutlet;
+    t_outlet* _statsOutlet;
+    t_clock* _statsClock;
+    float _statsInterval;
+    unsigned char _packet[MAX_PACKET_SIZE];
+    int _packets;
+    int _lost;
+    int _invalid;
+    int _dtx;
+    int _stereo;
+    int _lbrr;
+    int _modes[3];
+    int _bandwidths[BANDWIDTHS];
+    int _frames;
+    int _changes;
+    int _lastToc;
+    int _minSize;
+    int _maxSize;
+    double _bytes;
+    double _duration;
+} t_opusinspect;
+
+void opusinspect_setup();
+void* opusinspect_new();
+void opusinspect_free(t_opusinspect* x);
+void opusinspect_packet(t_opusinspect* x, t_symbol* s, int argc, t_atom* argv);
+void opusinspect_bang(t_opusinspect* x);
+void opusinspect_stats(t_opusinspect* x);
+void opusinspect_statsinterval(t_opusinspect* x, t_floatarg interval);
+void opusinspect_resetstats(t_opusinspect* x);
+static void inspectPacket(t_opusinspect* x, const unsigned char* data, int size);
+static void outputStat(t_opusinspect* x, const char* name, t_float value);
+static void outputStats(t_opusinspect* x);
+static void statsTick(t_opusinspect* x);
+
+void opusinspect_setup()
+{
+    opusinspect_class = class_new(gensym("opusinspect"),
+                                  (t_newmethod)opusinspect_new,
+                                  (t_method)opusinspect_free,
+                                  sizeof(t_opusinspect),
+                                  CLASS_DEFAULT,
+                                  0);
+
+    class_addlist(opusinspect_class, (t_method)opusinspect_packet);
+    class_addbang(opusinspect_class, (t_method)opusinspect_bang);
+    class_addmethod(opusinspect_class, (t_method)opusinspect_stats, gensym("stats"), 0);
+    class_addmethod(opusinspect_class, (t_method)opusinspect_statsinterval, gensym("statsinterval"), A_FLOAT, 0);
+    class_addmethod(opusinspect_class, (t_method)opusinspect_resetstats, gensym("resetstats"), 0);
+}
+
+void* opusinspect_new()
+{
+    t_opusinspect* x = (t_opusinspect*)pd_new(opusinspect_class);
+    if (!x)
+        return 0;
+
+    x->_packetOutlet = outlet_new(&x->x_obj, 0);
+    x->_statsOutlet = outlet_new(&x->x_obj, 0);
+    x->_statsClock = clock_new(x, (t_method)statsTick);
+    x->_statsInterval = 0;
+
+    opusinspect_resetstats(x);
+
+    return x;
+}
+
+void opusinspect_free(t_opusinspect* x)
+{
+    clock_free(x->_statsClock);
+}
+
+void opusinspect_resetstats(t_opusinspect* x)
+{
+    x->_packets = 0;
+    x->_lost = 0;
+    x->_invalid = 0;
+    x->_dtx = 0;
+    x->_stereo = 0;
+    x->_lbrr = 0;
+    memset(x->_modes, 0, sizeof(x->_modes));
+    memset(x->_bandwidths, 0, sizeof(x->_bandwidths));
+    x->_frames = 0;
+    x->_changes = 0;
+    x->_lastToc = -1;
+    x->_minSize = 0;
+    x->_maxSize = 0;
+    x->_bytes = 0;
+    x->_duration = 0;
+}
+
+void opusinspect_bang(t_opusinspect* x)
+{
+    x->_lost++;
+}
+
+void opusinspect_packet(t_opusinspect* x, t_symbol* s, int argc, t_atom* argv)
+{
+    // an empty list is a lost packet, like for opusdec~
+    if (!argc)
+    {
+        x->_lost++;
+        return;
+    }
+
+    if (argc > MAX_PACKET_SIZE)
+    {
+        x->_invalid++;
+        return;
+    }
+
+    for (int i = 0; i < argc; ++i)
+        x->_packet[i] = (unsigned char)atom_getfloat(&argv[i]);
+
+    inspectPacket(x, x->_packet, argc);
+}
+
+static void inspectPacket(t_opusinspect* x, const unsigned char* data, int size)
+{
+    unsigned char toc;
+    const unsigned char* frames[48];
+    opus_int16 sizes[48];
+    int count = opus_packet_parse(data, size, &toc, frames, sizes, 0);
+    if (count < 0)
+    {
+        x->_invalid++;
+        return;
+    }
+
+    int mode = opusPacketMode(data);
+    int bandwidth = opus_packet_get_bandwidth(data);
+    int channels = opus_packet_get_nb_channels(data);
+    int frameSize = opus_packet_get_samples_per_frame(data, TOC_SAMPLE_RATE);
+    float duration = count * frameSize * 1000.f / TOC_SAMPLE_RATE;
+
+    // DTX leaves the TOC and empty frames
+    int payload = 0;
+    for (int i = 0; i < count; ++i)
+        payload += sizes[i];
+
+    int lbrr = mode != MODE_CELT_ONLY && count && opusFrameHasLbrr(frames[0], sizes[0], frameSize, channels);
+
+    x->_packets++;
+    x->_frames += count;
+    x->_duration += duration;
+    x->_bytes += size;
+    x->_modes[mode - MODE_SILK_ONLY]++;
+    x->_bandwidths[bandwidth - OPUS_BANDWIDTH_NARROWBAND]++;
+    x->_stereo += channels == 2;
+    x->_lbrr += lbrr;
+    x->_dtx += !payload;
+    if (!x->_minSize || size < x->_minSize)
+        x->_minSize = size;
+    if (size > x->_maxSize)
+        x->_maxSize = size;
+
+    // a new configuration or channel count, ignoring the frame count code
+    if (x->_lastToc >= 0 && (toc & 0xfc) != x->_lastToc)
+        x->_changes++;
+    x->_lastToc = toc & 0xfc;
+
+    t_atom info[6];
+    SETFLOAT(&info[0], opusBandwidthHz(bandwidth));
+    SETFLOAT(&info[1], count);
+    SETFLOAT(&info[2], duration);
+    SETFLOAT(&info[3], channels == 2);
+    SETFLOAT(&info[4], lbrr);
+    SETFLOAT(&info[5], size);
+    outlet_anything(x->_packetOutlet, gensym(opusModeName(mode)), 6, info);
+}
+
+static void outputStat(t_opusinspect* x, const char* name, t_float value)
+{
+    t_atom a;
+    SETFLOAT(&a, value);
+    outlet_anything(x->_statsOutlet, gensym(name), 1, &a);
+}
+
+static void outputStats(t_opusinspect* x)
+{
+    outputStat(x, "packets", x->_packets);
+    outputStat(x, "lost", x->_lost);
+    outputStat(x, "invalid", x->_invalid);
+    outputStat(x, "frames", x->_frames);
+    outputStat(x, "duration", x->_duration);
+    outputStat(x, "bitrate", x->_duration ? x->_bytes * 8000 / x->_duration : 0);
+    outputStat(x, "meansize", x->_packets ? x->_bytes / x->_packets : 0);
+    outputStat(x, "minsize", x->_minSize);
+    outputStat(x, "maxsize", x->_maxSize);
+    outputStat(x, "stereo", x->_stereo);
+    outputStat(x, "lbrr", x->_lbrr);
+    outputStat(x, "dtx", x->_dtx);
+    outputStat(x, "changes", x->_changes);
+
+    t_atom modes[3];
+    for (int i = 0; i < 3; ++i)
+        SETFLOAT(&modes[i], x->_modes[i]);
+    outlet_anything(x->_statsOutlet, gensym("modes"), 3, modes);
+
+    t_atom bandwidths[BANDWIDTHS];
+    for (int i = 0; i < BANDWIDTHS; ++i)
+        SETFLOAT(&bandwidths[i], x->_bandwidths[i]);
+    outlet_anything(x->_statsOutlet, gensym("bandwidths"), BANDWIDTHS, bandwidths);
+}
+
+void opusinspect_stats(t_opusinspect* x)
+{
+    post("packets: %d, lost: %d, invalid: %d, frames: %d, duration: %g ms", x->_packets, x->_lost, x->_invalid, x->_frames, x->_duration);
+    post("bitrate: %g, packet size: %d-%d bytes", x->_duration ? x->_bytes * 8000 / x->_duration : 0, x->_minSize, x->_maxSize);
+    post("SILK: %d, hybrid: %d, CELT: %d", x->_modes[0], x->_modes[1], x->_modes[2]);
+    post("NB: %d, MB: %d, WB: %d, SWB: %d, FB: %d", x->_bandwidths[0], x->_bandwidths[1], x->_bandwidths[2], x->_bandwidths[3], x->_bandwidths[4]);
+    post("stereo: %d, LBRR: %d, DTX: %d, configuration changes: %d", x->_stereo, x->_lbrr, x->_dtx, x->_changes);
+
+    outputStats(x);
+}
+
+void opusinspect_statsinterval(t_opusinspect* x, t_floatarg interval)
+{
+    x->_statsInterval = interval > 0 ? interval : 0;
+    if (x->_statsInterval)
+        clock_delay(x->_statsClock, x->_statsInterval);
+    else
+        clock_unset(x->_statsClock);
+}
+
+static void statsTick(t_opusinspect* x)
+{
+    outputStats(x);
+    if (x->_statsInterval)
+        clock_delay(x->_statsClock, x->_statsInterval);
+}
@@ -0,0 +1,216 @@
+#include "m_pd.h"
+#include "packetcapture.h"
+#include <stdlib.h>
+#include <string.h>
+
+static t_class* opusreplay_class;
+
+enum LOG_LEVEL
+{
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_NORMAL
+};
+
+typedef struct _opusreplay
+{
+    t_object x_obj;
+    t_outlet* _packetOutlet;
+    t_outlet* _dbovOutlet;
+    t_outlet* _doneOutlet;
+    t_clock* _clock;
+    t_canvas* _canvas;
+    const unsigned char* _data;
+    size_t _size;
+    size_t _offset;
+    int _sampleRate;
+    int _channels;
+    int _playing;
+    double _startTime;
+    double _firstRecordTime;
+    t_atom* _atoms;
+} t_opusreplay;
+
+void opusreplay_setup();
+void* opusreplay_new(t_symbol* s);
+void opusreplay_free(t_opusreplay* x);
+void opusreplay_open(t_opusreplay* x, t_symbol* s);
+void opusreplay_close(t_opusreplay* x);
+void opusreplay_start(t_opusreplay* x);
+void opusreplay_fast(t_opusreplay* x);
+void opusreplay_stop(t_opusreplay* x);
+static void replayTick(t_opusreplay* x);
+static int rewindReplay(t_opusreplay* x);
+static void outputRecord(t_opusreplay* x, const PacketRecord* record);
+
+void opusreplay_setup()
+{
+    opusreplay_class = class_new(gensym("opusreplay"),
+                                 (t_newmethod)opusreplay_new,
+                                 (t_method)opusreplay_free,
+                                 sizeof(t_opusreplay),
+                                 CLASS_DEFAULT,
+                                 A_DEFSYMBOL,
+                                 0);
+
+    class_addbang(opusreplay_class, (t_method)opusreplay_start);
+    class_addmethod(opusreplay_class, (t_method)opusreplay_open, gensym("open"), A_SYMBOL, 0);
+    class_addmethod(opusreplay_class, (t_method)opusreplay_close, gensym("close"), 0);
+    class_addmethod(opusreplay_class, (t_method)opusreplay_start, gensym("start"), 0);
+    class_addmethod(opusreplay_class, (t_method)opusreplay_fast, gensym("fast"), 0);
+    class_addmethod(opusreplay_class, (t_method)opusreplay_stop, gensym("stop"), 0);
+}
+
+void* opusreplay_new(t_symbol* s)
+{
+    t_opusreplay* x = (t_opusreplay*)pd_new(opusreplay_class);
+    if (!x)
+        return 0;
+
+    x->_packetOutlet = outlet_new(&x->x_obj, &s_list);
+    x->_dbovOutlet = outlet_new(&x->x_obj, &s_float);
+    x->_doneOutlet = outlet_new(&x->x_obj, &s_bang);
+    x->_clock = clock_new(x, (t_method)replayTick);
+    x->_canvas = canvas_getcurrent();
+    x->_data = 0;
+    x->_size = 0;
+    x->_offset = 0;
+    x->_sampleRate = 0;
+    x->_channels = 0;
+    x->_playing = 0;
+    x->_startTime = 0;
+    x->_firstRecordTime = 0;
+    x->_atoms = (t_atom*)malloc(PACKETBUS_MAX_PACKET_SIZE * sizeof(t_atom));
+
+    if (*s->s_name)
+        opusreplay_open(x, s);
+
+    return x;
+}
+
+void opusreplay_free(t_opusreplay* x)
+{
+    opusreplay_close(x);
+    clock_free(x->_clock);
+    free(x->_atoms);
+}
+
+void opusreplay_open(t_opusreplay* x, t_symbol* s)
+{
+    opusreplay_close(x);
+
+    char path[MAXPDSTRING];
+    canvas_makefilename(x->_canvas, s->s_name, path, MAXPDSTRING);
+
+    x->_size = packetCaptureMap(path, &x->_data, &x->_sampleRate, &x->_channels);
+    if (!x->_size)
+    {
+        error("opusreplay: %s is not a packet capture", path);
+        x->_data = 0;
+        return;
+    }
+
+    if (x->_sampleRate != (int)sys_getsr())
+        post("opusreplay: %s was captured @%dhz, Pd runs @%dhz", s->s_name, x->_sampleRate, (int)sys_getsr());
+
+    verbose(LOG_LEVEL_NORMAL, "opened capture %s of %d bytes with %d channel(s) @%dhz", path, (int)x->_size, x->_channels, x->_sampleRate);
+}
+
+void opusreplay_close(t_opusreplay* x)
+{
+    opusreplay_stop(x);
+    if (x->_data)
+        packetCaptureUnmap(x->_data, x->_size);
+    x->_data = 0;
+    x->_size = 0;
+}
+
+void opusreplay_stop(t_opusreplay* x)
+{
+    x->_playing = 0;
+    clock_unset(x->_clock);
+}
+
+static int rewindReplay(t_opusreplay* x)
+{
+    opusreplay_stop(x);
+    if (!x->_data)
+    {
+        error("opusreplay: no capture open");
+        return 0;
+    }
+
+    PacketRecord record;
+    x->_offset = PACKETCAPTURE_HEADER_SIZE;
+    x->_firstRecordTime = packetCaptureRecord(x->_data, x->_size, x->_offset, &record) ? record._time : 0;
+    x->_startTime = clock_getlogicaltime();
+    x->_playing = 1;
+    return 1;
+}
+
+void opusreplay_start(t_opusreplay* x)
+{
+    if (rewindReplay(x))
+        replayTick(x);
+}
+
+void opusreplay_fast(t_opusreplay* x)
+{
+    if (!rewindReplay(x))
+        return;
+
+    PacketRecord record;
+    size_t next;
+    while (x->_playing && (next = packetCaptureRecord(x->_data, x->_size, x->_offset, &record)))
+    {
+        x->_offset = next;
+        outputRecord(x, &record);
+    }
+
+    if (x->_playing)
+    {
+        x->_playing = 0;
+        outlet_bang(x->_doneOutlet);
+    }
+}
+
+static void replayTick(t_opusreplay* x)
+{
+    // packets go out at their captured DSP time relative to the first one;
+    // outputs can stop or close the replay, so check before every record
+    double elapsed = clock_gettimesince(x->_startTime);
+    PacketRecord record;
+    size_t next;
+    while (x->_playing && (next = packetCaptureRecord(x->_data, x->_size, x->_offset, &record)))
+    {
+        double due = record._time - x->_firstRecordTime;
+        if (due > elapsed)
+        {
+            clock_delay(x->_clock, due - elapsed);
+            return;
+        }
+
+        x->_offset = next;
+        outputRecord(x, &record);
+    }
+
+    if (x->_playing)
+    {
+        x->_playing = 0;
+        outlet_bang(x->_doneOutlet);
+    }
+}
+
+static void outputRecord(t_opusreplay* x, const PacketRecord* record)
+{
+    for (int i = 0; i < record->_size; ++i)
+        SETFLOAT(&x->_atoms[i], record->_data[i]);
+
+    if (record->_flags & PACKETCAPTURE_DEMIXING)
+    {
+        outlet_anything(x->_packetOutlet, gensym("demixing"), record->_size, x->_atoms);
+        return;
+    }
+
+    outlet_float(x->_dbovOutlet, record->_dbov);
+    outlet_list(x->_packetOutlet, &s_list, record->_size, x->_atoms);
+}
@@ -0,0 +1,219 @@
+#include "m_pd.h"
+#include "packetbus.h"
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define SEND_BUFFER_SIZE 65536
+
+static t_class* opussend_class;
+
+enum LOG_LEVEL
+{
+    LOG_LEVEL_DEBUG = 0,
+    LOG_LEVEL_NORMAL
+};
+
+typedef struct _opussend
+{
+    t_object x_obj;
+    PacketBus* _bus;
+    pthread_t _thread;
+    int _threadStarted;
+    pthread_mutex_t _mutex;
+    _Atomic int _quit;
+    int _socket;
+    struct sockaddr_storage _address;
+    socklen_t _addressLength;
+    unsigned char* _buffer;
+    int _packetsSent;
+    int _bytesSent;
+    int _sendErrors;
+    int _unsent;
+} t_opussend;
+
+void opussend_setup();
+void* opussend_new(t_symbol* s, int argc, t_atom* argv);
+void opussend_free(t_opussend* x);
+void opussend_connect(t_opussend* x, t_symbol* host, t_floatarg port);
+void opussend_disconnect(t_opussend* x);
+void opussend_status(t_opussend* x);
+static void* senderThread(void* arg);
+static void sendPacket(t_opussend* x, const unsigned char* data, int size);
+
+void opussend_setup()
+{
+    opussend_class = class_new(gensym("opussend"),
+                               (t_newmethod)opussend_new,
+                               (t_method)opussend_free,
+                               sizeof(t_opussend),
+                               CLASS_DEFAULT,
+                               A_GIMME,
+                               0);
+
+    class_addmethod(opussend_class, (t_method)opussend_connect, gensym("connect"), A_SYMBOL, A_FLOAT, 0);
+    class_addmethod(opussend_class, (t_method)opussend_disconnect, gensym("disconnect"), 0);
+    class_addmethod(opussend_class, (t_method)opussend_status, gensym("status"), 0);
+}
+
+void* opussend_new(t_symbol* s, int argc, t_atom* argv)
+{
+    if (!argc || argv[0].a_type != A_SYMBOL)
+    {
+        error("opussend: needs the name of the packet bus to drain");
+        return 0;
+    }
+
+    t_opussend* x = (t_opussend*)pd_new(opussend_class);
+    if (!x)
+        return 0;
+
+    pthread_mutex_init(&x->_mutex, 0);
+    x->_threadStarted = 0;
+    atomic_init(&x->_quit, 0);
+    x->_socket = -1;
+    x->_addressLength = 0;
+    x->_buffer = (unsigned char*)malloc(SEND_BUFFER_SIZE);
+    x->_packetsSent = 0;
+    x->_bytesSent = 0;
+    x->_sendErrors = 0;
+    x->_unsent = 0;
+
+    x->_bus = packetBusAcquire(atom_getsymbol(&argv[0]), PACKETBUS_CONSUMER);
+    if (!x->_bus)
+    {
+        pd_free(&x->x_obj.ob_pd);
+        return 0;
+    }
+
+    if (argc >= 3)
+        opussend_connect(x, atom_getsymbol(&argv[1]), atom_getfloat(&argv[2]));
+
+    if (pthread_create(&x->_thread, 0, senderThread, x))
+    {
+        error("opussend: could not start the sender thread");
+        pd_free(&x->x_obj.ob_pd);
+        return 0;
+    }
+    x->_threadStarted = 1;
+
+    return x;
+}
+
+void opussend_free(t_opussend* x)
+{
+    if (x->_threadStarted)
+    {
+        atomic_store(&x->_quit, 1);
+        packetBusWake(x->_bus);
+        pthread_join(x->_thread, 0);
+    }
+
+    opussend_disconnect(x);
+    if (x->_bus)
+        packetBusRelease(x->_bus, PACKETBUS_CONSUMER);
+    pthread_mutex_destroy(&x->_mutex);
+    free(x->_buffer);
+}
+
+void opussend_connect(t_opussend* x, t_symbol* host, t_floatarg port)
+{
+    char service[16];
+    snprintf(service, sizeof(service), "%d", (int)port);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    struct addrinfo* info = 0;
+    int err = getaddrinfo(host->s_name, service, &hints, &info);
+    if (err)
+    {
+        error("opussend: could not resolve %s: %s", host->s_name, gai_strerror(err));
+        return;
+    }
+
+    int sock = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (sock < 0)
+    {
+        error("opussend: could not create socket");
+        freeaddrinfo(info);
+        return;
+    }
+
+    pthread_mutex_lock(&x->_mutex);
+    if (x->_socket >= 0)
+        close(x->_socket);
+    x->_socket = sock;
+    memcpy(&x->_address, info->ai_addr, info->ai_addrlen);
+    x->_addressLength = info->ai_addrlen;
+    pthread_mutex_unlock(&x->_mutex);
+
+    freeaddrinfo(info);
+    verbose(LOG_LEVEL_NORMAL, "sending packets to %s:%d", host->s_name, (int)port);
+}
+
+void opussend_disconnect(t_opussend* x)
+{
+    pthread_mutex_lock(&x->_mutex);
+    if (x->_socket >= 0)
+        close(x->_socket);
+    x->_socket = -1;
+    pthread_mutex_unlock(&x->_mutex);
+}
+
+void opussend_status(t_opussend* x)
+{
+    pthread_mutex_lock(&x->_mutex);
+    post("connected: %d", x->_socket >= 0);
+    post("packets sent: %d (%d bytes), send errors: %d, unsent: %d", x->_packetsSent, x->_bytesSent, x->_sendErrors, x->_unsent);
+    pthread_mutex_unlock(&x->_mutex);
+
+    post("bus fill: %d bytes, dropped by encoder: %d", packetBusFill(x->_bus), packetBusDropped(x->_bus));
+}
+
+static void sendPacket(t_opussend* x, const unsigned char* data, int size)
+{
+    pthread_mutex_lock(&x->_mutex);
+    if (x->_socket < 0)
+    {
+        x->_unsent++;
+    }
+    else if (sendto(x->_socket, data, size, 0, (struct sockaddr*)&x->_address, x->_addressLength) < 0)
+    {
+        x->_sendErrors++;
+    }
+    else
+    {
+        x->_packetsSent++;
+        x->_bytesSent += size;
+    }
+    pthread_mutex_unlock(&x->_mutex);
+}
+
+static void* senderThread(void* arg)
+{
+    t_opussend* x = (t_opussend*)arg;
+
+    // the mutex is only ever contended by messages, never by the audio
+    // thread, which just appends to the bus; polling every millisecond
+    // keeps system calls out of perform at well under a tick of delay
+    while (!atomic_load(&x->_quit))
+    {
+        packetBusWait(x->_bus, PACKETBUS_POLL_MS);
+
+        int size;
+        while ((size = packetBusRead(x->_bus, x->_buffer, SEND_BUFFER_SIZE)))
+        {
+            if (size > 0)
+                sendPacket(x, x->_buffer, size);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,238 @@
+#ifndef __opustrace_h_
+#define __opustrace_h_
+
+/* Optional spans around the per-frame hot paths, written to a Chrome trace
+   (chrome://tracing, ui.perfetto.dev). Built only with -DPDOPUS_TRACE;
+   otherwise the OPUSTRACE_ macros expand to nothing. When built in, a span
+   costs one relaxed load while tracing is off. While it is on, each thread
+   appends its spans to its own single producer ring, and a background
+   thread drains all rings into the JSON file every OPUSTRACE_FLUSH_MS.
+   Rings are allocated on the message thread when tracing starts,
+   OPUSTRACE_SPARE_RINGS more than are in use, and a thread claims one with
+   a compare and swap the first time it records a span, so the DSP thread
+   never locks or allocates. A full ring, or a thread that finds no spare
+   ring, drops spans and counts them rather than wait. */
+
+enum OPUSTRACE_SPAN
+{
+    OPUSTRACE_ENCODE = 0,
+    OPUSTRACE_OUTPUT,
+    OPUSTRACE_PACKET,
+    OPUSTRACE_READ
+};
+
+#ifdef PDOPUS_TRACE
+
+#include "pdopus.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OPUSTRACE_RING_SIZE 16384
+#define OPUSTRACE_MAX_THREADS 64
+#define OPUSTRACE_SPARE_RINGS 8
+#define OPUSTRACE_FLUSH_MS 50
+
+typedef struct _tracespan
+{
+    uint64_t _begin;
+    uint64_t _end;
+    const void* _instance;
+    int _size;
+    int _span;
+} TraceSpan;
+
+typedef struct _tracering
+{
+    TraceSpan _spans[OPUSTRACE_RING_SIZE];
+    _Atomic uint64_t _writeCount;
+    _Atomic uint64_t _readCount;
+    int _thread;
+} TraceRing;
+
+typedef struct _tracestate
+{
+    _Atomic int _enabled;
+    _Atomic int _dropped;
+    pthread_mutex_t _mutex;
+    TraceRing* _rings[OPUSTRACE_MAX_THREADS];
+    _Atomic int _ringCount;
+    _Atomic int _claimedCount;
+    FILE* _file;
+    int _events;
+    pthread_t _flusher;
+    _Atomic int _quit;
+} TraceState;
+
+PDOPUS_SHARED(TraceState opusTrace, { 0, 0, PTHREAD_MUTEX_INITIALIZER });
+PDOPUS_SHARED(_Thread_local TraceRing* opusTraceRing, 0);
+
+static const char* opusTraceNames[] = { "encode", "output", "packet", "read" };
+
+static inline uint64_t opusTraceNow()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static inline int opusTraceEnabled()
+{
+    return atomic_load_explicit(&opusTrace._enabled, memory_order_relaxed);
+}
+
+// sets aside rings for count more threads; message thread only
+static inline void opusTraceReserve(int count)
+{
+    pthread_mutex_lock(&opusTrace._mutex);
+    int total = atomic_load(&opusTrace._claimedCount) + count;
+    for (int i = atomic_load(&opusTrace._ringCount); i < total && i < OPUSTRACE_MAX_THREADS; ++i)
+    {
+        TraceRing* ring = (TraceRing*)calloc(1, sizeof(TraceRing));
+        if (!ring)
+            break;
+        ring->_thread = i + 1;
+        opusTrace._rings[i] = ring;
+        atomic_store_explicit(&opusTrace._ringCount, i + 1, memory_order_release);
+    }
+    pthread_mutex_unlock(&opusTrace._mutex);
+}
+
+// the calling thread's ring, claimed from the reserved ones the first time
+static inline TraceRing* opusTraceThreadRing()
+{
+    if (opusTraceRing)
+        return opusTraceRing;
+
+    int claimed = atomic_load_explicit(&opusTrace._claimedCount, memory_order_relaxed);
+    while (claimed < atomic_load_explicit(&opusTrace._ringCount, memory_order_acquire))
+    {
+        if (atomic_compare_exchange_weak(&opusTrace._claimedCount, &claimed, claimed + 1))
+        {
+            opusTraceRing = opusTrace._rings[claimed];
+            break;
+        }
+    }
+    return opusTraceRing;
+}
+
+static inline void opusTraceSpan(int span, uint64_t begin, const void* instance, int size)
+{
+    TraceRing* ring = opusTraceThreadRing();
+    if (!ring)
+    {
+        atomic_fetch_add_explicit(&opusTrace._dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    uint64_t head = atomic_load_explicit(&ring->_writeCount, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->_readCount, memory_order_acquire) == OPUSTRACE_RING_SIZE)
+    {
+        atomic_fetch_add_explicit(&opusTrace._dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    TraceSpan* s = &ring->_spans[head % OPUSTRACE_RING_SIZE];
+    s->_begin = begin;
+    s->_end = opusTraceNow();
+    s->_instance = instance;
+    s->_size = size;
+    s->_span = span;
+    atomic_store_explicit(&ring->_writeCount, head + 1, memory_order_release);
+}
+
+static inline void opusTraceDrain()
+{
+    int count = atomic_load(&opusTrace._ringCount);
+    for (int i = 0; i < count; ++i)
+    {
+        TraceRing* ring = opusTrace._rings[i];
+        uint64_t tail = atomic_load_explicit(&ring->_readCount, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->_writeCount, memory_order_acquire);
+        for (; tail != head; ++tail)
+        {
+            const TraceSpan* s = &ring->_spans[tail % OPUSTRACE_RING_SIZE];
+            fprintf(opusTrace._file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"instance\":\"%p\",\"size\":%d}}\n",
+                    opusTrace._events++ ? "," : "", opusTraceNames[s->_span], s->_begin / 1000.0, (s->_end - s->_begin) / 1000.0,
+                    (int)getpid(), ring->_thread, s->_instance, s->_size);
+        }
+        atomic_store_explicit(&ring->_readCount, tail, memory_order_release);
+    }
+    fflush(opusTrace._file);
+}
+
+static inline void* opusTraceFlusher(void* arg)
+{
+    int quit = 0;
+    while (!quit)
+    {
+        quit = atomic_load(&opusTrace._quit);
+        if (!quit)
+            usleep(OPUSTRACE_FLUSH_MS * 1000);
+        opusTraceDrain();
+    }
+    return 0;
+}
+
+// starts tracing into path, or stops when path is 0; returns 0 on failure
+static inline int opusTraceFile(const char* path)
+{
+    if (opusTrace._file)
+    {
+        atomic_store(&opusTrace._enabled, 0);
+        atomic_store(&opusTrace._quit, 1);
+        pthread_join(opusTrace._flusher, 0);
+        fprintf(opusTrace._file, "]}\n");
+        fclose(opusTrace._file);
+        opusTrace._file = 0;
+    }
+
+    if (!path)
+        return 1;
+
+    // the array is left open until tracing stops; trace viewers also load
+    // files cut short by a crash
+    opusTrace._file = fopen(path, "w");
+    if (!opusTrace._file)
+        return 0;
+    fprintf(opusTrace._file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    opusTrace._events = 0;
+    atomic_store(&opusTrace._dropped, 0);
+    opusTraceReserve(OPUSTRACE_SPARE_RINGS);
+
+    // spans left over from the last trace don't belong in this one
+    for (int i = 0; i < atomic_load(&opusTrace._ringCount); ++i)
+        atomic_store(&opusTrace._rings[i]->_readCount, atomic_load(&opusTrace._rings[i]->_writeCount));
+    atomic_store(&opusTrace._quit, 0);
+
+    if (pthread_create(&opusTrace._flusher, 0, opusTraceFlusher, 0))
+    {
+        fclose(opusTrace._file);
+        opusTrace._file = 0;
+        return 0;
+    }
+    atomic_store(&opusTrace._enabled, 1);
+    return 1;
+}
+
+static inline int opusTraceDropped()
+{
+    return atomic_load(&opusTrace._dropped);
+}
+
+#define OPUSTRACE_BEGIN(name) uint64_t opusTraceBegin_##name = opusTraceEnabled() ? opusTraceNow() : 0
+#define OPUSTRACE_END(name, span, instance, size) \
+    do { if (opusTraceBegin_##name) opusTraceSpan(span, opusTraceBegin_##name, instance, size); } while (0)
+
+#else
+
+#define OPUSTRACE_BEGIN(name)
+#define OPUSTRACE_END(name, span, instance, size) do { } while (0)
+
+#endif /* PDOPUS_TRACE */
+
+#endif /* __opustrace_h_ */
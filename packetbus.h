@@ -0,0 +1,399 @@
+#ifndef __packetbus_h_
+#define __packetbus_h_
+
+#include "m_pd.h"
+#include "pdopus.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PACKETBUS_MAGIC 0x4f505553
+#define PACKETBUS_RING_MAGIC 0x4f505352
+#define PACKETBUS_CAPACITY 65536
+#define PACKETBUS_MAX_PACKET_SIZE 0xffff
+#define PACKETBUS_POLL_MS 1
+#define PACKETBUS_ATTACH_MS 100
+
+enum PACKETBUS_ROLE
+{
+    PACKETBUS_PRODUCER = 0,
+    PACKETBUS_CONSUMER
+};
+
+/* A named single producer, single consumer queue of OPUS packets. The
+   producer is an encoder's perform routine: it copies each packet into a
+   byte ring and publishes it with a release store, so it never blocks,
+   allocates or makes a system call. Consumer threads poll the ring every
+   PACKETBUS_POLL_MS, well within a DSP tick; the wakeup pipe is only
+   written from the message thread, to stop a consumer without waiting
+   out its timeout. Buses are shared between
+   separately loaded externals through a holder object bound to a Pd
+   symbol, recognised by its class name and magic, and reference counted
+   on the message thread. packetBusInit/packetBusDestroy also set up an
+   unnamed ring for private producer/consumer pairs.
+
+   Names starting with a slash are POSIX shared memory rings that connect
+   separate Pd processes (pd~ subprocesses or sibling daemons). The ring
+   header with the indices lives in the mapping next to the data, so
+   packets cross over with a copy in and a copy out and no system calls.
+   A pipe can't wake a thread in another process, so such rings have none
+   and packetBusWait always sleeps for the poll interval.
+   The segment outlives the processes so either side can restart and
+   reattach; a consumer skips whatever was queued before it attached. The
+   one producer and one consumer rule has to hold across processes too,
+   so the ring header records the pid that owns each role. A role is
+   claimed with a compare and swap and given back on release; the owner
+   of a role whose process has died is replaced. */
+
+typedef struct _packetring
+{
+    _Atomic uint32_t _magic;
+    uint32_t _capacity;
+    _Atomic int32_t _owners[2];
+    _Alignas(64) _Atomic uint64_t _writeCount;
+    _Atomic int _signalled;
+    _Alignas(64) _Atomic uint64_t _readCount;
+    _Alignas(64) _Atomic int _dropped;
+} PacketRing;
+
+typedef struct _packetbus
+{
+    t_pd _pd;
+    int _magic;
+    int _refCount;
+    int _roles[2];
+    t_symbol* _symbol;
+    PacketRing* _ring;
+    unsigned char* _data;
+    size_t _capacity;
+    size_t _mappedSize;
+    int _wakeFds[2];
+} PacketBus;
+
+PDOPUS_SHARED(t_class* packetbus_class, 0);
+PDOPUS_SHARED(pthread_once_t packetBusClassOnce, PTHREAD_ONCE_INIT);
+
+static inline void packetBusNewClass()
+{
+    packetbus_class = class_new(gensym("opuspacketbus"), 0, 0, sizeof(PacketBus), CLASS_PD, 0);
+}
+
+static inline t_symbol* packetBusSymbol(t_symbol* name)
+{
+    char buf[MAXPDSTRING];
+    snprintf(buf, sizeof(buf), "__opusbus_%s", name->s_name);
+    return gensym(buf);
+}
+
+static inline void packetBusInitRing(PacketRing* ring, size_t capacity)
+{
+    ring->_capacity = (uint32_t)capacity;
+    atomic_init(&ring->_writeCount, 0);
+    atomic_init(&ring->_readCount, 0);
+    atomic_init(&ring->_dropped, 0);
+    atomic_init(&ring->_signalled, 0);
+    atomic_init(&ring->_owners[PACKETBUS_PRODUCER], 0);
+    atomic_init(&ring->_owners[PACKETBUS_CONSUMER], 0);
+}
+
+static inline int packetBusInit(PacketBus* bus, size_t capacity)
+{
+    bus->_ring = (PacketRing*)aligned_alloc(64, sizeof(PacketRing) + capacity);
+    bus->_mappedSize = 0;
+    bus->_capacity = capacity;
+
+    if (!bus->_ring || pipe(bus->_wakeFds))
+    {
+        free(bus->_ring);
+        return 0;
+    }
+    packetBusInitRing(bus->_ring, capacity);
+    bus->_data = (unsigned char*)(bus->_ring + 1);
+    fcntl(bus->_wakeFds[0], F_SETFL, O_NONBLOCK);
+    fcntl(bus->_wakeFds[1], F_SETFL, O_NONBLOCK);
+    return 1;
+}
+
+// maps the shared memory ring of that name, creating it if needed
+static inline int packetBusMap(PacketBus* bus, const char* name, size_t capacity)
+{
+    size_t size = sizeof(PacketRing) + capacity;
+    int created = 1;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST)
+    {
+        created = 0;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd < 0)
+        return 0;
+
+    if (created && ftruncate(fd, size))
+    {
+        close(fd);
+        shm_unlink(name);
+        return 0;
+    }
+
+    // the creating process may not have sized the segment yet
+    struct stat st;
+    for (int i = 0; !created && !fstat(fd, &st) && (size_t)st.st_size < size && i < PACKETBUS_ATTACH_MS; ++i)
+        usleep(1000);
+    if (!created && (fstat(fd, &st) || (size_t)st.st_size != size))
+    {
+        close(fd);
+        return 0;
+    }
+
+    void* mapping = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return 0;
+
+    PacketRing* ring = (PacketRing*)mapping;
+    if (created)
+    {
+        packetBusInitRing(ring, capacity);
+        atomic_store_explicit(&ring->_magic, PACKETBUS_RING_MAGIC, memory_order_release);
+    }
+
+    for (int i = 0; atomic_load_explicit(&ring->_magic, memory_order_acquire) != PACKETBUS_RING_MAGIC && i < PACKETBUS_ATTACH_MS; ++i)
+        usleep(1000);
+
+    if (atomic_load_explicit(&ring->_magic, memory_order_acquire) != PACKETBUS_RING_MAGIC || ring->_capacity != capacity)
+    {
+        munmap(mapping, size);
+        return 0;
+    }
+
+    bus->_ring = ring;
+    bus->_data = (unsigned char*)(ring + 1);
+    bus->_capacity = capacity;
+    bus->_mappedSize = size;
+    bus->_wakeFds[0] = -1;
+    bus->_wakeFds[1] = -1;
+    return 1;
+}
+
+// claims a role of a shared ring for this process; returns 0 or the pid
+// of the live process that holds it
+static inline int packetBusClaim(PacketBus* bus, int role)
+{
+    int32_t pid = (int32_t)getpid();
+    int32_t owner = 0;
+    while (!atomic_compare_exchange_strong(&bus->_ring->_owners[role], &owner, pid))
+    {
+        // another instance in this process counts as an owner too; a
+        // role given back in the meantime is simply tried again
+        if (owner && (owner == pid || !kill(owner, 0) || errno != ESRCH))
+            return owner;
+    }
+    return 0;
+}
+
+static inline void packetBusDisown(PacketBus* bus, int role)
+{
+    int32_t pid = (int32_t)getpid();
+    atomic_compare_exchange_strong(&bus->_ring->_owners[role], &pid, 0);
+}
+
+static inline void packetBusDestroy(PacketBus* bus)
+{
+    if (bus->_mappedSize)
+    {
+        munmap(bus->_ring, bus->_mappedSize);
+        return;
+    }
+
+    close(bus->_wakeFds[0]);
+    close(bus->_wakeFds[1]);
+    free(bus->_ring);
+}
+
+static inline PacketBus* packetBusAcquire(t_symbol* name, int role)
+{
+    t_symbol* s = packetBusSymbol(name);
+    PacketBus* bus = (PacketBus*)s->s_thing;
+
+    if (bus)
+    {
+        if (strcmp(class_getname(*s->s_thing), "opuspacketbus") || bus->_magic != PACKETBUS_MAGIC)
+        {
+            error("packet bus %s is bound to another object", name->s_name);
+            return 0;
+        }
+    }
+    else
+    {
+        // libpd instances on separate threads may create the first buses at once
+        pthread_once(&packetBusClassOnce, packetBusNewClass);
+
+        bus = (PacketBus*)pd_new(packetbus_class);
+        bus->_magic = PACKETBUS_MAGIC;
+        bus->_refCount = 0;
+        bus->_roles[PACKETBUS_PRODUCER] = 0;
+        bus->_roles[PACKETBUS_CONSUMER] = 0;
+        bus->_symbol = s;
+
+        int shared = name->s_name[0] == '/';
+        errno = 0;
+        if (shared ? !packetBusMap(bus, name->s_name, PACKETBUS_CAPACITY) : !packetBusInit(bus, PACKETBUS_CAPACITY))
+        {
+            if (shared)
+                error("could not map shared packet ring %s: %s", name->s_name, errno ? strerror(errno) : "size mismatch");
+            else
+                error("could not create packet bus %s", name->s_name);
+            pd_free(&bus->_pd);
+            return 0;
+        }
+
+        pd_bind(&bus->_pd, s);
+    }
+
+    if (bus->_roles[role])
+    {
+        error("packet bus %s already has a %s", name->s_name, role == PACKETBUS_PRODUCER ? "producer" : "consumer");
+        return 0;
+    }
+
+    int owner = bus->_mappedSize ? packetBusClaim(bus, role) : 0;
+    if (owner)
+    {
+        error("shared packet ring %s already has a %s in process %d", name->s_name, role == PACKETBUS_PRODUCER ? "producer" : "consumer", owner);
+        if (!bus->_refCount)
+        {
+            pd_unbind(&bus->_pd, bus->_symbol);
+            packetBusDestroy(bus);
+            pd_free(&bus->_pd);
+        }
+        return 0;
+    }
+
+    if (role == PACKETBUS_CONSUMER && bus->_mappedSize)
+        atomic_store_explicit(&bus->_ring->_readCount, atomic_load_explicit(&bus->_ring->_writeCount, memory_order_acquire), memory_order_release);
+
+    bus->_roles[role] = 1;
+    bus->_refCount++;
+    return bus;
+}
+
+static inline void packetBusRelease(PacketBus* bus, int role)
+{
+    if (bus->_mappedSize)
+        packetBusDisown(bus, role);
+    bus->_roles[role] = 0;
+    if (--bus->_refCount)
+        return;
+
+    pd_unbind(&bus->_pd, bus->_symbol);
+    packetBusDestroy(bus);
+    pd_free(&bus->_pd);
+}
+
+static inline void packetBusCopyIn(PacketBus* bus, size_t position, const unsigned char* src, size_t size)
+{
+    size_t offset = position & (bus->_capacity - 1);
+    size_t first = bus->_capacity - offset < size ? bus->_capacity - offset : size;
+    memcpy(bus->_data + offset, src, first);
+    memcpy(bus->_data, src + first, size - first);
+}
+
+static inline void packetBusCopyOut(PacketBus* bus, size_t position, unsigned char* dst, size_t size)
+{
+    size_t offset = position & (bus->_capacity - 1);
+    size_t first = bus->_capacity - offset < size ? bus->_capacity - offset : size;
+    memcpy(dst, bus->_data + offset, first);
+    memcpy(dst + first, bus->_data, size - first);
+}
+
+// message thread only; wakes a consumer sleeping in packetBusWait early
+static inline void packetBusWake(PacketBus* bus)
+{
+    if (bus->_wakeFds[1] < 0)
+        return;
+
+    if (!atomic_exchange_explicit(&bus->_ring->_signalled, 1, memory_order_acq_rel))
+        (void)!write(bus->_wakeFds[1], "", 1);
+}
+
+// producer side; returns 0 and counts a drop when the ring is full
+static inline int packetBusWrite(PacketBus* bus, const unsigned char* data, int size)
+{
+    uint64_t head = atomic_load_explicit(&bus->_ring->_writeCount, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&bus->_ring->_readCount, memory_order_acquire);
+    size_t record = size + 2;
+
+    if (size <= 0 || size > PACKETBUS_MAX_PACKET_SIZE || bus->_capacity - (head - tail) < record)
+    {
+        atomic_fetch_add_explicit(&bus->_ring->_dropped, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    unsigned char header[2] = { (unsigned char)(size >> 8), (unsigned char)size };
+    packetBusCopyIn(bus, head, header, 2);
+    packetBusCopyIn(bus, head + 2, data, size);
+    atomic_store_explicit(&bus->_ring->_writeCount, head + record, memory_order_release);
+    return 1;
+}
+
+// consumer side; returns the packet size, 0 when empty or -1 when the
+// packet didn't fit and was skipped
+static inline int packetBusRead(PacketBus* bus, unsigned char* data, int maxSize)
+{
+    uint64_t tail = atomic_load_explicit(&bus->_ring->_readCount, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&bus->_ring->_writeCount, memory_order_acquire);
+    if (head == tail)
+        return 0;
+
+    unsigned char header[2];
+    packetBusCopyOut(bus, tail, header, 2);
+    int size = header[0] << 8 | header[1];
+
+    if (size <= maxSize)
+        packetBusCopyOut(bus, tail + 2, data, size);
+
+    atomic_store_explicit(&bus->_ring->_readCount, tail + 2 + size, memory_order_release);
+    return size <= maxSize ? size : -1;
+}
+
+// consumer side; sleeps until the timeout expires or packetBusWake is
+// called, then the caller drains the ring. Producers don't signal, so
+// consumers that forward packets pass PACKETBUS_POLL_MS.
+static inline void packetBusWait(PacketBus* bus, int timeoutMs)
+{
+    struct pollfd fd = { bus->_wakeFds[0], POLLIN, 0 };
+    char buf[64];
+
+    if (fd.fd < 0)
+    {
+        poll(0, 0, timeoutMs < PACKETBUS_POLL_MS ? timeoutMs : PACKETBUS_POLL_MS);
+        return;
+    }
+
+    poll(&fd, 1, timeoutMs);
+    while (read(bus->_wakeFds[0], buf, sizeof(buf)) > 0)
+        ;
+    atomic_store_explicit(&bus->_ring->_signalled, 0, memory_order_release);
+}
+
+static inline int packetBusFill(PacketBus* bus)
+{
+    return (int)(atomic_load_explicit(&bus->_ring->_writeCount, memory_order_acquire) - atomic_load_explicit(&bus->_ring->_readCount, memory_order_acquire));
+}
+
+static inline int packetBusDropped(PacketBus* bus)
+{
+    return atomic_load_explicit(&bus->_ring->_dropped, memory_order_relaxed);
+}
+
+#endif /* __packetbus_h_ */
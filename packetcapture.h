@@ -0,0 +1,213 @@
+#ifndef __packetcapture_h_
+#define __packetcapture_h_
+
+#include "packetbus.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Packet capture files are append-only: a 16 byte header ("OPUSCAP1",
+   sample rate, channels) followed by one record per packet holding the
+   DSP time in ms since the capture started, the packet size, its dBov, a
+   flags byte and the packet bytes. Records flagged as demixing carry the
+   channels, streams, coupled streams and matrix of a projection encoder.
+   Fields are stored in host byte order. A truncated last record, e.g.
+   after a crash, is ignored when reading. */
+
+#define PACKETCAPTURE_MAGIC "OPUSCAP1"
+#define PACKETCAPTURE_HEADER_SIZE 16
+#define PACKETCAPTURE_RECORD_SIZE 12
+#define PACKETCAPTURE_RING_SIZE (1 << 20)
+#define PACKETCAPTURE_WAIT_MS 100
+#define PACKETCAPTURE_DEMIXING 1
+
+typedef struct _packetcapture
+{
+    PacketBus _ring;
+    FILE* _file;
+    pthread_t _thread;
+    _Atomic int _quit;
+    unsigned char* _record;
+    unsigned char* _buffer;
+} PacketCapture;
+
+typedef struct _packetrecord
+{
+    double _time;
+    int _size;
+    int _dbov;
+    int _flags;
+    const unsigned char* _data;
+} PacketRecord;
+
+static inline void* packetCaptureThread(void* arg)
+{
+    PacketCapture* capture = (PacketCapture*)arg;
+    int quit = 0;
+
+    // drain once more after the quit flag so nothing queued is lost
+    while (!quit)
+    {
+        quit = atomic_load(&capture->_quit);
+        packetBusWait(&capture->_ring, quit ? 0 : PACKETCAPTURE_WAIT_MS);
+
+        int size;
+        while ((size = packetBusRead(&capture->_ring, capture->_buffer, PACKETBUS_MAX_PACKET_SIZE)) > 0)
+            fwrite(capture->_buffer, 1, size, capture->_file);
+        fflush(capture->_file);
+    }
+
+    return 0;
+}
+
+static inline void packetCaptureWriteHeader(FILE* file, int sampleRate, int channels)
+{
+    unsigned char header[PACKETCAPTURE_HEADER_SIZE] = { 0 };
+    uint32_t rate = sampleRate;
+    uint16_t count = channels;
+    memcpy(header, PACKETCAPTURE_MAGIC, 8);
+    memcpy(header + 8, &rate, 4);
+    memcpy(header + 12, &count, 2);
+    fwrite(header, 1, sizeof(header), file);
+}
+
+// fills in a record and returns its size; record must hold PACKETBUS_MAX_PACKET_SIZE bytes
+static inline int packetCaptureMakeRecord(unsigned char* record, double time, int dbov, int flags, const unsigned char* data, int size)
+{
+    uint16_t packetSize = size;
+    memcpy(record, &time, 8);
+    memcpy(record + 8, &packetSize, 2);
+    record[10] = dbov;
+    record[11] = flags;
+    memcpy(record + PACKETCAPTURE_RECORD_SIZE, data, size);
+    return size + PACKETCAPTURE_RECORD_SIZE;
+}
+
+static inline PacketCapture* packetCaptureOpen(const char* path, int sampleRate, int channels)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+        return 0;
+
+    packetCaptureWriteHeader(file, sampleRate, channels);
+
+    PacketCapture* capture = (PacketCapture*)calloc(1, sizeof(PacketCapture));
+    if (!packetBusInit(&capture->_ring, PACKETCAPTURE_RING_SIZE))
+    {
+        free(capture);
+        fclose(file);
+        return 0;
+    }
+
+    capture->_file = file;
+    atomic_init(&capture->_quit, 0);
+    capture->_record = (unsigned char*)malloc(PACKETBUS_MAX_PACKET_SIZE);
+    capture->_buffer = (unsigned char*)malloc(PACKETBUS_MAX_PACKET_SIZE);
+
+    if (pthread_create(&capture->_thread, 0, packetCaptureThread, capture))
+    {
+        packetBusDestroy(&capture->_ring);
+        free(capture->_record);
+        free(capture->_buffer);
+        free(capture);
+        fclose(file);
+        return 0;
+    }
+
+    return capture;
+}
+
+// queues one record for the writer thread; returns 0 when it was dropped
+static inline int packetCaptureWrite(PacketCapture* capture, double time, int dbov, int flags, const unsigned char* data, int size)
+{
+    if (size + PACKETCAPTURE_RECORD_SIZE > PACKETBUS_MAX_PACKET_SIZE)
+        return 0;
+
+    int recordSize = packetCaptureMakeRecord(capture->_record, time, dbov, flags, data, size);
+    return packetBusWrite(&capture->_ring, capture->_record, recordSize);
+}
+
+static inline int packetCaptureDropped(PacketCapture* capture)
+{
+    return packetBusDropped(&capture->_ring);
+}
+
+static inline void packetCaptureClose(PacketCapture* capture)
+{
+    atomic_store(&capture->_quit, 1);
+    packetBusWake(&capture->_ring);
+    pthread_join(capture->_thread, 0);
+
+    fclose(capture->_file);
+    packetBusDestroy(&capture->_ring);
+    free(capture->_record);
+    free(capture->_buffer);
+    free(capture);
+}
+
+// maps a capture file read-only; returns its size or 0 if it isn't one
+static inline size_t packetCaptureMap(const char* path, const unsigned char** data, int* sampleRate, int* channels)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < PACKETCAPTURE_HEADER_SIZE)
+    {
+        close(fd);
+        return 0;
+    }
+
+    void* map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return 0;
+
+    if (memcmp(map, PACKETCAPTURE_MAGIC, 8))
+    {
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    uint32_t rate;
+    uint16_t count;
+    memcpy(&rate, (unsigned char*)map + 8, 4);
+    memcpy(&count, (unsigned char*)map + 12, 2);
+    *sampleRate = rate;
+    *channels = count;
+    *data = (const unsigned char*)map;
+    return st.st_size;
+}
+
+static inline void packetCaptureUnmap(const unsigned char* data, size_t size)
+{
+    munmap((void*)data, size);
+}
+
+// reads the record at offset; returns the offset of the next record or 0
+// at the end of the file
+static inline size_t packetCaptureRecord(const unsigned char* data, size_t size, size_t offset, PacketRecord* record)
+{
+    if (offset + PACKETCAPTURE_RECORD_SIZE > size)
+        return 0;
+
+    uint16_t packetSize;
+    memcpy(&record->_time, data + offset, 8);
+    memcpy(&packetSize, data + offset + 8, 2);
+    record->_size = packetSize;
+    record->_dbov = data[offset + 10];
+    record->_flags = data[offset + 11];
+    record->_data = data + offset + PACKETCAPTURE_RECORD_SIZE;
+
+    offset += PACKETCAPTURE_RECORD_SIZE + packetSize;
+    return offset <= size ? offset : 0;
+}
+
+#endif /* __packetcapture_h_ */
@@ -0,0 +1,326 @@
+#ifndef __packetfec_h_
+#define __packetfec_h_
+
+#include "pdopus.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PACKETFEC_X86_DISPATCH
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/* Packet level forward error correction for groups of OPUS packets. Every
+   packet gets a 5 byte header: the 16 bit group number, the group's data
+   count k and parity count m, and the packet's index in the group (data
+   first, then parity). Parity packets are a systematic Reed-Solomon code
+   over GF(2^8): the data packets, each prefixed with its 16 bit length and
+   zero padded to the longest one, are combined with a Cauchy matrix whose
+   columns are scaled so the first parity row is all ones. One parity
+   packet is therefore a plain XOR, and any k of the k + m packets rebuild
+   the group. Multiplying a packet by a constant uses the split nibble
+   table lookup (pshufb on SSSE3/AVX2, tbl on NEON), 16 or 32 bytes at a
+   time. The x86 variants are compiled with target attributes and picked
+   at run time from what the CPU supports, so a baseline build still uses
+   them; NEON is always there on aarch64. */
+
+#define PACKETFEC_HEADER_SIZE 5
+#define PACKETFEC_MAX_DATA 32
+#define PACKETFEC_MAX_PARITY 16
+#define PACKETFEC_MAX_PACKET_SIZE 1500
+#define PACKETFEC_SYMBOL_SIZE (PACKETFEC_MAX_PACKET_SIZE + 2)
+#define PACKETFEC_POLYNOMIAL 0x11d
+
+enum PACKETFEC_SIMD
+{
+    PACKETFEC_SIMD_NONE = 0,
+    PACKETFEC_SIMD_SSSE3,
+    PACKETFEC_SIMD_AVX2
+};
+
+PDOPUS_SHARED(unsigned char gfExp[512], { 0 });
+PDOPUS_SHARED(unsigned char gfLog[256], { 0 });
+PDOPUS_SHARED(unsigned char fecCoefficients[PACKETFEC_MAX_PARITY][PACKETFEC_MAX_DATA], { { 0 } });
+PDOPUS_SHARED(pthread_once_t fecTablesOnce, PTHREAD_ONCE_INIT);
+PDOPUS_SHARED(int fecSimd, PACKETFEC_SIMD_NONE);
+
+static inline unsigned char gfMul(unsigned char a, unsigned char b)
+{
+    return a && b ? gfExp[gfLog[a] + gfLog[b]] : 0;
+}
+
+static inline unsigned char gfInverse(unsigned char a)
+{
+    return gfExp[255 - gfLog[a]];
+}
+
+static inline void packetFecBuildTables()
+{
+    int x = 1;
+    for (int i = 0; i < 255; ++i)
+    {
+        gfExp[i] = gfExp[i + 255] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= PACKETFEC_POLYNOMIAL;
+    }
+
+    // Cauchy rows use x_j = MAX_DATA + j and columns y_s = s, so x_j ^ y_s
+    // is never 0; scaling a column keeps every square submatrix invertible
+    for (int s = 0; s < PACKETFEC_MAX_DATA; ++s)
+    {
+        unsigned char scale = PACKETFEC_MAX_DATA ^ s;
+        for (int j = 0; j < PACKETFEC_MAX_PARITY; ++j)
+            fecCoefficients[j][s] = gfMul(gfInverse((PACKETFEC_MAX_DATA + j) ^ s), scale);
+    }
+
+#ifdef PACKETFEC_X86_DISPATCH
+    __builtin_cpu_init();
+    fecSimd = __builtin_cpu_supports("avx2") ? PACKETFEC_SIMD_AVX2
+            : __builtin_cpu_supports("ssse3") ? PACKETFEC_SIMD_SSSE3 : PACKETFEC_SIMD_NONE;
+#endif
+}
+
+// libpd instances on separate threads may set up FEC objects at once
+static inline void packetFecInit()
+{
+    pthread_once(&fecTablesOnce, packetFecBuildTables);
+}
+
+#ifdef PACKETFEC_X86_DISPATCH
+// dst ^= c * src for whole 16 byte blocks from i on; returns where it stopped
+__attribute__((target("ssse3")))
+static inline int gfMulAddSsse3(unsigned char* dst, const unsigned char* src, const unsigned char* low, const unsigned char* high, int i, int n)
+{
+    __m128i lowTable = _mm_loadu_si128((const __m128i*)low);
+    __m128i highTable = _mm_loadu_si128((const __m128i*)high);
+    __m128i mask = _mm_set1_epi8(0x0f);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(lowTable, _mm_and_si128(s, mask)),
+                                  _mm_shuffle_epi8(highTable, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i*)(dst + i)), p));
+    }
+    return i;
+}
+
+// the same for whole 32 byte blocks
+__attribute__((target("avx2")))
+static inline int gfMulAddAvx2(unsigned char* dst, const unsigned char* src, const unsigned char* low, const unsigned char* high, int i, int n)
+{
+    __m256i lowTable = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)low));
+    __m256i highTable = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)high));
+    __m256i mask = _mm256_set1_epi8(0x0f);
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(lowTable, _mm256_and_si256(s, mask)),
+                                     _mm256_shuffle_epi8(highTable, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(dst + i)), p));
+    }
+    return i;
+}
+#endif
+
+// dst ^= c * src
+static inline void gfMulAdd(unsigned char* dst, const unsigned char* src, unsigned char c, int n)
+{
+    int i = 0;
+    if (c == 0)
+        return;
+
+    if (c == 1)
+    {
+        for (; i < n; ++i)
+            dst[i] ^= src[i];
+        return;
+    }
+
+#if defined(PACKETFEC_X86_DISPATCH) || defined(__aarch64__)
+    unsigned char low[16];
+    unsigned char high[16];
+    for (int j = 0; j < 16; ++j)
+    {
+        low[j] = gfMul(c, j);
+        high[j] = gfMul(c, j << 4);
+    }
+#endif
+
+#if defined(PACKETFEC_X86_DISPATCH)
+    if (fecSimd == PACKETFEC_SIMD_AVX2)
+        i = gfMulAddAvx2(dst, src, low, high, i, n);
+    if (fecSimd >= PACKETFEC_SIMD_SSSE3)
+        i = gfMulAddSsse3(dst, src, low, high, i, n);
+#elif defined(__aarch64__)
+    uint8x16_t lowTable = vld1q_u8(low);
+    uint8x16_t highTable = vld1q_u8(high);
+    uint8x16_t mask = vdupq_n_u8(0x0f);
+    for (; i + 16 <= n; i += 16)
+    {
+        uint8x16_t s = vld1q_u8(src + i);
+        uint8x16_t p = veorq_u8(vqtbl1q_u8(lowTable, vandq_u8(s, mask)), vqtbl1q_u8(highTable, vshrq_n_u8(s, 4)));
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), p));
+    }
+#endif
+
+    int logC = gfLog[c];
+    for (; i < n; ++i)
+    {
+        if (src[i])
+            dst[i] ^= gfExp[gfLog[src[i]] + logC];
+    }
+}
+
+static inline void packetFecWriteHeader(unsigned char* header, int group, int dataCount, int parityCount, int index)
+{
+    header[0] = (unsigned char)(group >> 8);
+    header[1] = (unsigned char)group;
+    header[2] = (unsigned char)dataCount;
+    header[3] = (unsigned char)parityCount;
+    header[4] = (unsigned char)index;
+}
+
+// returns 0 if the header isn't a valid one
+static inline int packetFecReadHeader(const unsigned char* header, int size, int* group, int* dataCount, int* parityCount, int* index)
+{
+    if (size < PACKETFEC_HEADER_SIZE)
+        return 0;
+
+    *group = header[0] << 8 | header[1];
+    *dataCount = header[2];
+    *parityCount = header[3];
+    *index = header[4];
+    return *dataCount >= 1 && *dataCount <= PACKETFEC_MAX_DATA && *parityCount <= PACKETFEC_MAX_PARITY
+        && *index < *dataCount + *parityCount;
+}
+
+// symbols are a packet's 16 bit length followed by its bytes, padded with zeros
+static inline void packetFecMakeSymbol(unsigned char* symbol, const unsigned char* data, int size, int symbolSize)
+{
+    symbol[0] = (unsigned char)(size >> 8);
+    symbol[1] = (unsigned char)size;
+    memmove(symbol + 2, data, size);
+    memset(symbol + 2 + size, 0, symbolSize - 2 - size);
+}
+
+static inline int packetFecSymbolLength(const unsigned char* symbol)
+{
+    return symbol[0] << 8 | symbol[1];
+}
+
+static inline void packetFecEncode(unsigned char** data, int dataCount, unsigned char** parity, int parityCount, int symbolSize)
+{
+    for (int j = 0; j < parityCount; ++j)
+    {
+        memset(parity[j], 0, symbolSize);
+        for (int s = 0; s < dataCount; ++s)
+            gfMulAdd(parity[j], data[s], fecCoefficients[j][s], symbolSize);
+    }
+}
+
+/* Rebuilds the missing data symbols in place from the present data and
+   parity symbols; scratch holds parityCount symbols. Returns the number of
+   symbols rebuilt, or -1 if too few packets arrived. */
+static inline int packetFecRecover(unsigned char** data, const int* dataPresent, int dataCount,
+                                   unsigned char** parity, const int* parityPresent, int parityCount,
+                                   unsigned char** scratch, int symbolSize)
+{
+    int missing[PACKETFEC_MAX_PARITY];
+    int rows[PACKETFEC_MAX_PARITY];
+    int missingCount = 0;
+    int rowCount = 0;
+
+    for (int s = 0; s < dataCount; ++s)
+    {
+        if (dataPresent[s])
+            continue;
+        if (missingCount == parityCount)
+            return -1;
+        missing[missingCount++] = s;
+    }
+
+    if (!missingCount)
+        return 0;
+
+    for (int j = 0; j < parityCount && rowCount < missingCount; ++j)
+    {
+        if (parityPresent[j])
+            rows[rowCount++] = j;
+    }
+
+    if (rowCount < missingCount)
+        return -1;
+
+    // invert the square part of the matrix that covers the missing packets
+    unsigned char matrix[PACKETFEC_MAX_PARITY][PACKETFEC_MAX_PARITY];
+    unsigned char inverse[PACKETFEC_MAX_PARITY][PACKETFEC_MAX_PARITY];
+    int n = missingCount;
+    for (int r = 0; r < n; ++r)
+    {
+        for (int c = 0; c < n; ++c)
+        {
+            matrix[r][c] = fecCoefficients[rows[r]][missing[c]];
+            inverse[r][c] = r == c;
+        }
+    }
+
+    for (int c = 0; c < n; ++c)
+    {
+        int pivot = c;
+        while (pivot < n && !matrix[pivot][c])
+            ++pivot;
+        if (pivot == n)
+            return -1;
+
+        for (int k = 0; k < n; ++k)
+        {
+            unsigned char t = matrix[c][k]; matrix[c][k] = matrix[pivot][k]; matrix[pivot][k] = t;
+            t = inverse[c][k]; inverse[c][k] = inverse[pivot][k]; inverse[pivot][k] = t;
+        }
+
+        unsigned char scale = gfInverse(matrix[c][c]);
+        for (int k = 0; k < n; ++k)
+        {
+            matrix[c][k] = gfMul(matrix[c][k], scale);
+            inverse[c][k] = gfMul(inverse[c][k], scale);
+        }
+
+        for (int r = 0; r < n; ++r)
+        {
+            unsigned char factor = matrix[r][c];
+            if (r == c || !factor)
+                continue;
+            for (int k = 0; k < n; ++k)
+            {
+                matrix[r][k] ^= gfMul(factor, matrix[c][k]);
+                inverse[r][k] ^= gfMul(factor, inverse[c][k]);
+            }
+        }
+    }
+
+    // remove the known packets from the parity, then mix in the inverse
+    for (int r = 0; r < n; ++r)
+    {
+        memcpy(scratch[r], parity[rows[r]], symbolSize);
+        for (int s = 0; s < dataCount; ++s)
+        {
+            if (dataPresent[s])
+                gfMulAdd(scratch[r], data[s], fecCoefficients[rows[r]][s], symbolSize);
+        }
+    }
+
+    for (int c = 0; c < n; ++c)
+    {
+        memset(data[missing[c]], 0, symbolSize);
+        for (int r = 0; r < n; ++r)
+            gfMulAdd(data[missing[c]], scratch[r], inverse[c][r], symbolSize);
+    }
+
+    return n;
+}
+
+#endif /* __packetfec_h_ */
@@ -0,0 +1,32 @@
+#define PDOPUS_DEFINE_SHARED
+#include "m_pd.h"
+#include "codecpool.h"
+#include "opustrace.h"
+#include "packetbus.h"
+#include "packetfec.h"
+
+/* The pdopus library: every object in one binary with one copy of libopus,
+   loaded with "-lib pdopus" or [declare -lib pdopus]. The process-wide
+   state of the shared headers is defined here once for all of them. */
+
+void opusenc_tilde_setup();
+void opusdec_tilde_setup();
+void opussend_setup();
+void opusreplay_setup();
+void opusimpair_setup();
+void opusfecenc_setup();
+void opusfecdec_setup();
+void opusinspect_setup();
+void pdopus_setup();
+
+void pdopus_setup()
+{
+    opusenc_tilde_setup();
+    opusdec_tilde_setup();
+    opussend_setup();
+    opusreplay_setup();
+    opusimpair_setup();
+    opusfecenc_setup();
+    opusfecdec_setup();
+    opusinspect_setup();
+}
@@ -0,0 +1,21 @@
+#ifndef __pdopus_h_
+#define __pdopus_h_
+
+/* Process-wide state in the shared headers (the codec pool, the packet
+   bus class, the trace rings, the FEC tables) is declared with
+   PDOPUS_SHARED. Each external built on its own gets a private static
+   copy. In the combined pdopus library, built with PDOPUS_LIBRARY, every
+   object shares one copy, defined in pdopus.c with PDOPUS_DEFINE_SHARED
+   and hidden from other binaries. */
+
+#ifdef PDOPUS_LIBRARY
+#ifdef PDOPUS_DEFINE_SHARED
+#define PDOPUS_SHARED(declaration, ...) __attribute__((visibility("hidden"))) declaration = __VA_ARGS__
+#else
+#define PDOPUS_SHARED(declaration, ...) extern __attribute__((visibility("hidden"))) declaration
+#endif
+#else
+#define PDOPUS_SHARED(declaration, ...) static declaration = __VA_ARGS__
+#endif
+
+#endif /* __pdopus_h_ */
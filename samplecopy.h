@@ -0,0 +1,78 @@
+#ifndef __samplecopy_h_
+#define __samplecopy_h_
+
+#include "m_pd.h"
+#include <string.h>
+
+#if PD_FLOATSIZE == 64
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#endif
+
+/* Copy Pd signal vectors into the float buffers libopus works on and back.
+   With 32 bit samples this is a plain memcpy; with PD_FLOATSIZE 64 the
+   samples are converted four (AVX) or two (SSE2/NEON) at a time. */
+
+static inline void copySamplesToFloat(float* dst, const t_sample* src, int n)
+{
+#if PD_FLOATSIZE == 32
+    memcpy(dst, src, n * sizeof(float));
+#else
+    int i = 0;
+#if defined(__AVX__)
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(dst + i, _mm256_cvtpd_ps(_mm256_loadu_pd(src + i)));
+#elif defined(__SSE2__) || defined(_M_X64)
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(src + i));
+        __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(src + i + 2));
+        _mm_storeu_ps(dst + i, _mm_movelh_ps(lo, hi));
+    }
+#elif defined(__aarch64__)
+    for (; i + 4 <= n; i += 4)
+    {
+        float32x2_t lo = vcvt_f32_f64(vld1q_f64(src + i));
+        vst1q_f32(dst + i, vcvt_high_f32_f64(lo, vld1q_f64(src + i + 2)));
+    }
+#endif
+    for (; i < n; ++i)
+        dst[i] = (float)src[i];
+#endif
+}
+
+static inline void copyFloatToSamples(t_sample* dst, const float* src, int n)
+{
+#if PD_FLOATSIZE == 32
+    memcpy(dst, src, n * sizeof(float));
+#else
+    int i = 0;
+#if defined(__AVX__)
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(dst + i, _mm256_cvtps_pd(_mm_loadu_ps(src + i)));
+#elif defined(__SSE2__) || defined(_M_X64)
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 v = _mm_loadu_ps(src + i);
+        _mm_storeu_pd(dst + i, _mm_cvtps_pd(v));
+        _mm_storeu_pd(dst + i + 2, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+    }
+#elif defined(__aarch64__)
+    for (; i + 4 <= n; i += 4)
+    {
+        float32x4_t v = vld1q_f32(src + i);
+        vst1q_f64(dst + i, vcvt_f64_f32(vget_low_f32(v)));
+        vst1q_f64(dst + i + 2, vcvt_high_f64_f32(v));
+    }
+#endif
+    for (; i < n; ++i)
+        dst[i] = src[i];
+#endif
+}
+
+#endif /* __samplecopy_h_ */
@@ -0,0 +1,681 @@
+#include "opuscodec.h"
+#include <opus.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_PACKET_SIZE 4000
+#define MAX_VALUES 32
+#define SEGMENT_MS 20
+#define SEGMENT_SNR_MIN -10
+#define SEGMENT_SNR_MAX 35
+#define SILENT_SEGMENT_POWER 1e-6
+#define BAND_POWER_FLOOR 1e-10
+#define MAX_FFT_SIZE 4096
+
+typedef struct _audio
+{
+    const char* _name;
+    int _sampleRate;
+    int _frames;
+    float* _samples;
+} Audio;
+
+typedef struct _setting
+{
+    const char* _modeName;
+    int _mode;
+    int _bitrate;
+    int _complexity;
+    float _frameMs;
+} Setting;
+
+typedef struct _result
+{
+    double _encodeSeconds;
+    double _decodeSeconds;
+    double _audioSeconds;
+    double _bytes;
+    int _packets;
+    int _modePackets[3];
+    double _delayMs;
+    double _snr;
+    double _segmentalSnr;
+    double _spectralDistance;
+    int _files;
+} Result;
+
+typedef struct _grid
+{
+    const char* _modes[MAX_VALUES];
+    int _modeCount;
+    float _bitrates[MAX_VALUES];
+    int _bitrateCount;
+    float _complexities[MAX_VALUES];
+    int _complexityCount;
+    float _frameSizes[MAX_VALUES];
+    int _frameSizeCount;
+} Grid;
+
+static void usage();
+static int parseList(const char* arg, float* values);
+static int parseNames(char* arg, const char** names);
+static int readWav(const char* path, Audio* audio);
+static double cpuSeconds();
+static int defaultComplexity(int application);
+static int runSetting(const Audio* audio, const Setting* setting, int application, Result* result);
+static void measureQuality(const Audio* audio, const float* decoded, int delay, Result* result);
+static double spectralDistance(const float* reference, const float* degraded, int count, int sampleRate);
+static void bandPowers(const float* samples, int count, int sampleRate, double* powers, int bands);
+static void fft(double* re, double* im, int n);
+static void printHeader(int csv);
+static void printResult(const Setting* setting, const Result* result, int passes, int csv);
+
+// Zwicker's critical band edges in Hz
+static const float barkEdges[] = { 0, 100, 200, 300, 400, 510, 630, 770, 920, 1080, 1270, 1480, 1720,
+                                   2000, 2320, 2700, 3150, 3700, 4400, 5300, 6400, 7700, 9500, 12000, 15500, 20000 };
+#define BARK_BANDS (int)(sizeof(barkEdges) / sizeof(barkEdges[0]) - 1)
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: opussweep [options] file.wav...\n"
+            "\n"
+            "Encodes and decodes every file with each combination of settings, the way\n"
+            "opusenc~ and opusdec~ do, and prints one row per setting averaged over all\n"
+            "files. Files must be 16/24/32 bit PCM or 32 bit float WAV at 8, 12, 16, 24\n"
+            "or 48 kHz. opusenc~ encodes a single channel, so stereo files are mixed\n"
+            "down to mono. Everything but the swept settings (FEC, DTX, expected loss,\n"
+            "VBR...) starts out as in a new opusenc~.\n"
+            "\n"
+            "  -modes silk,hybrid,celt   forced modes (default: all three)\n"
+            "  -bitrates 16000,32000     target bitrates in bps (default: 16000,32000,64000)\n"
+            "  -complexity 0,5,10        encoder complexities (default: opusenc~'s)\n"
+            "  -framesizes 10,20         frame sizes in ms (default: 20)\n"
+            "  -lowdelay                 restricted low delay application (CELT only), as\n"
+            "                            \"opusenc~ -lowdelay\"\n"
+            "  -minsegsnr dB             quality bar on the segmental SNR\n"
+            "  -maxlsd dB                quality bar on the Bark spectral distance\n"
+            "  -csv                      comma separated output\n"
+            "\n"
+            "Columns: coded mode (most packets), actual bitrate, encode and decode CPU time\n"
+            "in percent of real time and per frame, algorithmic delay (frame + lookahead),\n"
+            "SNR and segmental SNR in dB, and the log spectral distance over Bark bands in\n"
+            "dB, a rough perceptual estimate (lower is better). SNR only means something\n"
+            "for CELT; SILK and hybrid don't preserve the waveform, use the spectral\n"
+            "distance to compare those.\n");
+}
+
+int main(int argc, char** argv)
+{
+    Grid grid;
+    grid._modeCount = 3;
+    for (int m = 0; m < grid._modeCount; ++m)
+        grid._modes[m] = opusModeName(MODE_SILK_ONLY + m);
+    grid._bitrateCount = parseList("16000,32000,64000", grid._bitrates);
+    grid._complexityCount = 0;
+    grid._frameSizeCount = parseList("20", grid._frameSizes);
+
+    int application = OPUS_APPLICATION_VOIP;
+    float minSegmentalSnr = -1000;
+    float maxSpectralDistance = 1000;
+    int csv = 0;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; ++i)
+    {
+        const char* option = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : 0;
+
+        if (!strcmp(option, "-lowdelay"))
+            application = OPUS_APPLICATION_RESTRICTED_LOWDELAY;
+        else if (!strcmp(option, "-csv"))
+            csv = 1;
+        else if (value && !strcmp(option, "-modes"))
+            grid._modeCount = parseNames(argv[++i], grid._modes);
+        else if (value && !strcmp(option, "-bitrates"))
+            grid._bitrateCount = parseList(argv[++i], grid._bitrates);
+        else if (value && !strcmp(option, "-complexity"))
+            grid._complexityCount = parseList(argv[++i], grid._complexities);
+        else if (value && !strcmp(option, "-framesizes"))
+            grid._frameSizeCount = parseList(argv[++i], grid._frameSizes);
+        else if (value && !strcmp(option, "-minsegsnr"))
+            minSegmentalSnr = atof(argv[++i]);
+        else if (value && !strcmp(option, "-maxlsd"))
+            maxSpectralDistance = atof(argv[++i]);
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (!grid._complexityCount)
+    {
+        grid._complexities[0] = defaultComplexity(application);
+        grid._complexityCount = 1;
+    }
+
+    if (i == argc || !grid._modeCount || !grid._bitrateCount || !grid._complexityCount || !grid._frameSizeCount)
+    {
+        usage();
+        return 1;
+    }
+
+    for (int m = 0; m < grid._modeCount; ++m)
+    {
+        if (!opusModeFromName(grid._modes[m]))
+        {
+            fprintf(stderr, "mode must be 'hybrid', 'silk' or 'celt', not '%s'\n", grid._modes[m]);
+            return 1;
+        }
+    }
+
+    for (int f = 0; f < grid._frameSizeCount; ++f)
+    {
+        if (!isOpusFrameDuration(grid._frameSizes[f]))
+        {
+            fprintf(stderr, "frame size must be 2.5, 5, 10, 20, 40, 60, 80, 100 or 120 ms, not %g\n", grid._frameSizes[f]);
+            return 1;
+        }
+    }
+
+    int audioCount = 0;
+    Audio* corpus = (Audio*)calloc(argc - i, sizeof(Audio));
+    for (; i < argc; ++i)
+    {
+        if (readWav(argv[i], &corpus[audioCount]))
+            audioCount++;
+    }
+
+    if (!audioCount)
+    {
+        fprintf(stderr, "no usable files\n");
+        return 1;
+    }
+
+    printHeader(csv);
+
+    Setting cheapest = { 0 };
+    Setting smallest = { 0 };
+    double cheapestCpu = 0;
+    double smallestBitrate = 0;
+
+    for (int m = 0; m < grid._modeCount; ++m)
+    for (int b = 0; b < grid._bitrateCount; ++b)
+    for (int c = 0; c < grid._complexityCount; ++c)
+    for (int f = 0; f < grid._frameSizeCount; ++f)
+    {
+        Setting setting;
+        setting._modeName = grid._modes[m];
+        setting._mode = opusModeFromName(grid._modes[m]);
+        setting._bitrate = grid._bitrates[b];
+        setting._complexity = grid._complexities[c];
+        setting._frameMs = grid._frameSizes[f];
+
+        // the restricted low delay application has no SILK layer
+        if (application == OPUS_APPLICATION_RESTRICTED_LOWDELAY && setting._mode != MODE_CELT_ONLY)
+            continue;
+
+        Result result;
+        memset(&result, 0, sizeof(result));
+        for (int a = 0; a < audioCount; ++a)
+            runSetting(&corpus[a], &setting, application, &result);
+
+        if (!result._files)
+            continue;
+
+        result._snr /= result._files;
+        result._segmentalSnr /= result._files;
+        result._spectralDistance /= result._files;
+        result._delayMs /= result._files;
+
+        int passes = result._segmentalSnr >= minSegmentalSnr && result._spectralDistance <= maxSpectralDistance;
+        printResult(&setting, &result, passes, csv);
+
+        double cpu = (result._encodeSeconds + result._decodeSeconds) / result._audioSeconds;
+        double bitrate = result._bytes * 8 / result._audioSeconds;
+        if (passes && (!cheapest._modeName || cpu < cheapestCpu))
+        {
+            cheapest = setting;
+            cheapestCpu = cpu;
+        }
+        if (passes && (!smallest._modeName || bitrate < smallestBitrate))
+        {
+            smallest = setting;
+            smallestBitrate = bitrate;
+        }
+    }
+
+    if (!csv && cheapest._modeName)
+    {
+        printf("\nlowest CPU meeting the bar: %s %d bps, complexity %d, %g ms (%.2f%% of real time)\n",
+               cheapest._modeName, cheapest._bitrate, cheapest._complexity, cheapest._frameMs, 100 * cheapestCpu);
+        printf("lowest bitrate meeting the bar: %s %d bps, complexity %d, %g ms (%.1f kbps)\n",
+               smallest._modeName, smallest._bitrate, smallest._complexity, smallest._frameMs, smallestBitrate / 1000);
+    }
+    else if (!csv)
+    {
+        printf("\nno setting meets the bar\n");
+    }
+
+    for (int a = 0; a < audioCount; ++a)
+        free(corpus[a]._samples);
+    free(corpus);
+
+    return 0;
+}
+
+static int parseList(const char* arg, float* values)
+{
+    int count = 0;
+    const char* p = arg;
+    while (*p && count < MAX_VALUES)
+    {
+        char* end;
+        values[count++] = strtof(p, &end);
+        if (end == p)
+            return 0;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+static int parseNames(char* arg, const char** names)
+{
+    int count = 0;
+    for (char* name = strtok(arg, ","); name && count < MAX_VALUES; name = strtok(0, ","))
+        names[count++] = name;
+    return count;
+}
+
+static unsigned readLittleEndian(const unsigned char* p, int bytes)
+{
+    unsigned value = 0;
+    for (int i = bytes - 1; i >= 0; --i)
+        value = value << 8 | p[i];
+    return value;
+}
+
+static int readWav(const char* path, Audio* audio)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "%s: could not open\n", path);
+        return 0;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char* data = (unsigned char*)malloc(size > 0 ? size : 1);
+    size = fread(data, 1, size > 0 ? size : 0, file);
+    fclose(file);
+
+    int format = 0, channels = 0, sampleRate = 0, bits = 0;
+    const unsigned char* samples = 0;
+    long sampleBytes = 0;
+
+    if (size < 12 || memcmp(data, "RIFF", 4) || memcmp(data + 8, "WAVE", 4))
+    {
+        fprintf(stderr, "%s: not a WAV file\n", path);
+        free(data);
+        return 0;
+    }
+
+    for (long offset = 12; offset + 8 <= size;)
+    {
+        long chunkSize = readLittleEndian(data + offset + 4, 4);
+        const unsigned char* chunk = data + offset + 8;
+        if (chunkSize > size - offset - 8)
+            chunkSize = size - offset - 8;
+
+        if (!memcmp(data + offset, "fmt ", 4) && chunkSize >= 16)
+        {
+            format = readLittleEndian(chunk, 2);
+            channels = readLittleEndian(chunk + 2, 2);
+            sampleRate = readLittleEndian(chunk + 4, 4);
+            bits = readLittleEndian(chunk + 14, 2);
+            // WAVE_FORMAT_EXTENSIBLE keeps the real format in the sub format GUID
+            if (format == 0xfffe && chunkSize >= 26)
+                format = readLittleEndian(chunk + 24, 2);
+        }
+        else if (!memcmp(data + offset, "data", 4))
+        {
+            samples = chunk;
+            sampleBytes = chunkSize;
+        }
+
+        offset += 8 + chunkSize + (chunkSize & 1);
+    }
+
+    int pcm = format == 1 && (bits == 16 || bits == 24 || bits == 32);
+    int ieee = format == 3 && bits == 32;
+    if (!samples || !channels || (!pcm && !ieee))
+    {
+        fprintf(stderr, "%s: only 16/24/32 bit PCM and 32 bit float WAV files are supported\n", path);
+        free(data);
+        return 0;
+    }
+
+    if (channels > 2)
+    {
+        fprintf(stderr, "%s: %d channels, only mono and stereo (mixed down to mono) are supported\n", path, channels);
+        free(data);
+        return 0;
+    }
+
+    if (sampleRate != 8000 && sampleRate != 12000 && sampleRate != 16000 && sampleRate != 24000 && sampleRate != 48000)
+    {
+        fprintf(stderr, "%s: %d Hz isn't an OPUS sample rate\n", path, sampleRate);
+        free(data);
+        return 0;
+    }
+
+    int bytes = bits / 8;
+    audio->_name = path;
+    audio->_sampleRate = sampleRate;
+    audio->_frames = sampleBytes / (bytes * channels);
+    audio->_samples = (float*)calloc(audio->_frames + 1, sizeof(float));
+
+    for (long i = 0; i < (long)audio->_frames * channels; ++i)
+    {
+        const unsigned char* p = samples + i * bytes;
+        unsigned value = readLittleEndian(p, bytes);
+        float sample;
+        if (ieee)
+            memcpy(&sample, &value, 4);
+        else
+            sample = (int32_t)(value << (32 - bits)) / 2147483648.f;
+        audio->_samples[i / channels] += sample / channels;
+    }
+
+    free(data);
+    return 1;
+}
+
+static double cpuSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static int runSetting(const Audio* audio, const Setting* setting, int application, Result* result)
+{
+    // mono states set up like those of a new opusenc~ and opusdec~, with
+    // only the swept settings changed
+    OpusEncoder* encoder = (OpusEncoder*)malloc(opus_encoder_get_size(1));
+    OpusDecoder* decoder = (OpusDecoder*)malloc(opus_decoder_get_size(1));
+    OpusEncoderSettings settings;
+
+    int err = opus_encoder_init(encoder, audio->_sampleRate, 1, application);
+    if (!err)
+    {
+        opusDefaultEncoderSettings(&settings, encoder, application);
+        settings._mode = setting->_mode;
+        settings._bitrate = setting->_bitrate;
+        settings._complexity = setting->_complexity;
+        err = opusApplyEncoderSettings(opusMonoEncoderCtl, encoder, &settings, 0);
+    }
+    if (err)
+    {
+        fprintf(stderr, "%s: could not set up encoder: %s\n", audio->_name, opus_strerror(err));
+        free(encoder);
+        free(decoder);
+        return 0;
+    }
+
+    err = opus_decoder_init(decoder, audio->_sampleRate, 1);
+    if (err)
+    {
+        fprintf(stderr, "%s: could not set up decoder: %s\n", audio->_name, opus_strerror(err));
+        free(encoder);
+        free(decoder);
+        return 0;
+    }
+
+    opus_int32 lookahead = 0;
+    opus_encoder_ctl(encoder, OPUS_GET_LOOKAHEAD(&lookahead));
+
+    // feed zeros after the file until the decoder has caught up with the
+    // lookahead, so the whole file can be compared
+    int frameSize = setting->_frameMs * audio->_sampleRate / 1000;
+    int frames = (audio->_frames + lookahead + frameSize - 1) / frameSize;
+    float* input = (float*)calloc((size_t)frames * frameSize, sizeof(float));
+    float* decoded = (float*)calloc((size_t)frames * frameSize, sizeof(float));
+    memcpy(input, audio->_samples, (size_t)audio->_frames * sizeof(float));
+
+    unsigned char packet[MAX_PACKET_SIZE];
+    int ok = 1;
+    for (int i = 0; i < frames && ok; ++i)
+    {
+        double start = cpuSeconds();
+        int size = opusEncodeFrame(encoder, input + (size_t)i * frameSize, frameSize, packet, MAX_PACKET_SIZE);
+        result->_encodeSeconds += cpuSeconds() - start;
+
+        if (size < 0)
+        {
+            fprintf(stderr, "%s: failed to encode: %s\n", audio->_name, opus_strerror(size));
+            ok = 0;
+            break;
+        }
+
+        start = cpuSeconds();
+        int samples = opusDecodeFrame(decoder, packet, size, decoded + (size_t)i * frameSize, frameSize, 0);
+        result->_decodeSeconds += cpuSeconds() - start;
+
+        if (samples < 0)
+        {
+            fprintf(stderr, "%s: failed to decode: %s\n", audio->_name, opus_strerror(samples));
+            ok = 0;
+            break;
+        }
+
+        result->_bytes += size;
+        result->_packets++;
+        if (size > 1)
+            result->_modePackets[opusPacketMode(packet) - MODE_SILK_ONLY]++;
+    }
+
+    if (ok)
+    {
+        // same as algorithmicDelay() in opusenc~, in ms since the files
+        // may differ in sample rate
+        result->_delayMs += 1000.0 * (frameSize + lookahead) / audio->_sampleRate;
+        result->_audioSeconds += (double)frames * frameSize / audio->_sampleRate;
+        measureQuality(audio, decoded, lookahead, result);
+        result->_files++;
+    }
+
+    free(input);
+    free(decoded);
+    free(decoder);
+    free(encoder);
+    return ok;
+}
+
+// the complexity a new opusenc~ runs at, which is the library's default
+static int defaultComplexity(int application)
+{
+    OpusEncoder* encoder = (OpusEncoder*)malloc(opus_encoder_get_size(1));
+    OpusEncoderSettings settings;
+    opusDefaultEncoderSettings(&settings, opus_encoder_init(encoder, 48000, 1, application) ? 0 : encoder, application);
+    free(encoder);
+    return settings._complexity;
+}
+
+static void measureQuality(const Audio* audio, const float* decoded, int delay, Result* result)
+{
+    int segment = SEGMENT_MS * audio->_sampleRate / 1000;
+    const float* reference = audio->_samples;
+    const float* degraded = decoded + delay;
+
+    double signal = 0, noise = 0;
+    double segmentalSnr = 0, distance = 0;
+    int segments = 0;
+
+    for (int start = 0; start + segment <= audio->_frames; start += segment)
+    {
+        double segmentSignal = 0, segmentNoise = 0;
+        for (int i = start; i < start + segment; ++i)
+        {
+            double r = reference[i];
+            double d = degraded[i];
+            segmentSignal += r * r;
+            segmentNoise += (r - d) * (r - d);
+        }
+
+        signal += segmentSignal;
+        noise += segmentNoise;
+
+        // silent segments would only add the clamp values
+        if (segmentSignal / segment < SILENT_SEGMENT_POWER)
+            continue;
+
+        double snr = segmentNoise > 0 ? 10 * log10(segmentSignal / segmentNoise) : SEGMENT_SNR_MAX;
+        segmentalSnr += snr < SEGMENT_SNR_MIN ? SEGMENT_SNR_MIN : snr > SEGMENT_SNR_MAX ? SEGMENT_SNR_MAX : snr;
+        distance += spectralDistance(reference + start, degraded + start, segment, audio->_sampleRate);
+        segments++;
+    }
+
+    result->_snr += noise > 0 ? 10 * log10(signal / noise) : 99;
+    result->_segmentalSnr += segments ? segmentalSnr / segments : 0;
+    result->_spectralDistance += segments ? distance / segments : 0;
+}
+
+static double spectralDistance(const float* reference, const float* degraded, int count, int sampleRate)
+{
+    double referencePowers[BARK_BANDS];
+    double degradedPowers[BARK_BANDS];
+    bandPowers(reference, count, sampleRate, referencePowers, BARK_BANDS);
+    bandPowers(degraded, count, sampleRate, degradedPowers, BARK_BANDS);
+
+    double sum = 0;
+    int bands = 0;
+    for (int b = 0; b < BARK_BANDS && barkEdges[b] < sampleRate / 2; ++b)
+    {
+        double d = 10 * log10((referencePowers[b] + BAND_POWER_FLOOR) / (degradedPowers[b] + BAND_POWER_FLOOR));
+        sum += d * d;
+        bands++;
+    }
+    return bands ? sqrt(sum / bands) : 0;
+}
+
+static void bandPowers(const float* samples, int count, int sampleRate, double* powers, int bands)
+{
+    static double re[MAX_FFT_SIZE];
+    static double im[MAX_FFT_SIZE];
+
+    int n = 1;
+    while (n < count && n < MAX_FFT_SIZE)
+        n *= 2;
+    if (count > n)
+        count = n;
+
+    // Hann window, zero padded to a power of two
+    for (int i = 0; i < n; ++i)
+    {
+        re[i] = i < count ? samples[i] * (0.5 - 0.5 * cos(2 * M_PI * i / count)) : 0;
+        im[i] = 0;
+    }
+    fft(re, im, n);
+
+    memset(powers, 0, bands * sizeof(double));
+    for (int k = 1; k < n / 2; ++k)
+    {
+        float hz = (float)k * sampleRate / n;
+        for (int b = 0; b < bands; ++b)
+        {
+            if (hz >= barkEdges[b] && hz < barkEdges[b + 1])
+            {
+                powers[b] += (re[k] * re[k] + im[k] * im[k]) / n;
+                break;
+            }
+        }
+    }
+}
+
+static void fft(double* re, double* im, int n)
+{
+    for (int i = 1, j = 0; i < n; ++i)
+    {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+        {
+            double t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+
+    for (int length = 2; length <= n; length *= 2)
+    {
+        double angle = -2 * M_PI / length;
+        double wr = cos(angle), wi = sin(angle);
+        for (int i = 0; i < n; i += length)
+        {
+            double cr = 1, ci = 0;
+            for (int k = 0; k < length / 2; ++k)
+            {
+                int a = i + k, b = i + k + length / 2;
+                double tr = re[b] * cr - im[b] * ci;
+                double ti = re[b] * ci + im[b] * cr;
+                re[b] = re[a] - tr;
+                im[b] = im[a] - ti;
+                re[a] += tr;
+                im[a] += ti;
+                double t = cr * wr - ci * wi;
+                ci = cr * wi + ci * wr;
+                cr = t;
+            }
+        }
+    }
+}
+
+static void printHeader(int csv)
+{
+    if (csv)
+    {
+        printf("mode,bitrate,complexity,frame_ms,coded,kbps,encode_rt_percent,decode_rt_percent,encode_us_per_frame,decode_us_per_frame,delay_ms,snr_db,segsnr_db,lsd_db,passes\n");
+        return;
+    }
+
+    printf("%-6s %7s %3s %6s | %-6s %7s %7s %7s %8s %8s %7s %6s %6s %6s %s\n",
+           "mode", "bitrate", "cx", "frame", "coded", "kbps", "enc %rt", "dec %rt", "enc us/f", "dec us/f", "delay", "SNR", "segSNR", "LSD", "bar");
+}
+
+static void printResult(const Setting* setting, const Result* result, int passes, int csv)
+{
+    int coded = 0;
+    for (int m = 1; m < 3; ++m)
+    {
+        if (result->_modePackets[m] > result->_modePackets[coded])
+            coded = m;
+    }
+
+    double kbps = result->_bytes * 8 / result->_audioSeconds / 1000;
+    double encodePercent = 100 * result->_encodeSeconds / result->_audioSeconds;
+    double decodePercent = 100 * result->_decodeSeconds / result->_audioSeconds;
+    double encodeUs = 1e6 * result->_encodeSeconds / result->_packets;
+    double decodeUs = 1e6 * result->_decodeSeconds / result->_packets;
+
+    if (csv)
+    {
+        printf("%s,%d,%d,%g,%s,%.2f,%.3f,%.3f,%.1f,%.1f,%.2f,%.2f,%.2f,%.2f,%d\n",
+               setting->_modeName, setting->_bitrate, setting->_complexity, setting->_frameMs, opusModeName(MODE_SILK_ONLY + coded),
+               kbps, encodePercent, decodePercent, encodeUs, decodeUs, result->_delayMs,
+               result->_snr, result->_segmentalSnr, result->_spectralDistance, passes);
+        return;
+    }
+
+    printf("%-6s %7d %3d %6g | %-6s %7.1f %7.2f %7.2f %8.1f %8.1f %7.2f %6.1f %6.1f %6.2f %s\n",
+           setting->_modeName, setting->_bitrate, setting->_complexity, setting->_frameMs, opusModeName(MODE_SILK_ONLY + coded),
+           kbps, encodePercent, decodePercent, encodeUs, decodeUs, result->_delayMs,
+           result->_snr, result->_segmentalSnr, result->_spectralDistance, passes ? "*" : "");
+}
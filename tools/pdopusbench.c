@@ -0,0 +1,226 @@
+#include "z_libpd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SAMPLE_RATE 48000
+#define OUTPUT_CHANNELS 1
+#define MAX_PAIRS 1024
+#define WARMUP_TICKS 200
+
+/* Times the DSP ticks of a patch with a number of mono [opusenc~] ->
+   [opusdec~] pairs, minus those of the same patch without them, and prints
+   the cost of one pair per block. Built twice: pdopusbench with the block
+   size specialised perform routines and pdopusbench-generic with
+   PDOPUS_GENERIC_PERFORM, so the difference between the two is what the
+   specialised routines save. Encoding and decoding are in both numbers
+   alike; the encoders run at complexity 0 and long frames keep their
+   share small. */
+
+static char patchDir[256];
+static const char* basePatchName = "pdopusbench-base.pd";
+static const char* pairPatchName = "pdopusbench-pairs.pd";
+static int pdErrors;
+
+void pdopus_setup();
+
+static void usage();
+static double wallSeconds();
+static void printHook(const char* s);
+static int writePatch(const char* name, int pairs, float frameSizeMs);
+static double timePatch(const char* name, int ticks, int runs);
+static void removePatches();
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: pdopusbench [options]\n"
+            "\n"
+            "Prints the DSP cost of a mono opusenc~ -> opusdec~ pair per block.\n"
+            "Compare against pdopusbench-generic, built without the specialised\n"
+            "perform routines.\n"
+            "\n"
+            "  -pairs N        encoder/decoder pairs in the patch (default: 64)\n"
+            "  -seconds S      audio processed per run (default: 10)\n"
+            "  -runs R         runs per patch, the fastest counts (default: 5)\n"
+            "  -framesize ms   OPUS frame size (default: 20)\n");
+}
+
+int main(int argc, char** argv)
+{
+    int pairs = 64;
+    float seconds = 10;
+    int runs = 5;
+    float frameSizeMs = 20;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-pairs") && i + 1 < argc)
+            pairs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-seconds") && i + 1 < argc)
+            seconds = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-runs") && i + 1 < argc)
+            runs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-framesize") && i + 1 < argc)
+            frameSizeMs = atof(argv[++i]);
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+
+    if (pairs < 1 || pairs > MAX_PAIRS || seconds <= 0 || runs < 1 || frameSizeMs <= 0)
+    {
+        usage();
+        return 2;
+    }
+
+    snprintf(patchDir, sizeof(patchDir), "%s/pdopusbenchXXXXXX", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+    if (!mkdtemp(patchDir))
+    {
+        fprintf(stderr, "could not create a directory for the patches\n");
+        return 1;
+    }
+
+    if (!writePatch(basePatchName, 0, frameSizeMs) || !writePatch(pairPatchName, pairs, frameSizeMs))
+    {
+        removePatches();
+        return 1;
+    }
+
+    libpd_set_printhook(printHook);
+    libpd_init();
+    pdopus_setup();
+    libpd_init_audio(0, OUTPUT_CHANNELS, SAMPLE_RATE);
+
+    int blockSize = libpd_blocksize();
+    int ticks = (int)(seconds * SAMPLE_RATE / blockSize);
+    double base = timePatch(basePatchName, ticks, runs);
+    double total = timePatch(pairPatchName, ticks, runs);
+    removePatches();
+
+    if (base < 0 || total < 0 || pdErrors)
+    {
+        fprintf(stderr, "%s\n", pdErrors ? "Pd posted errors, no result" : "could not open the patches");
+        return 1;
+    }
+
+#ifdef PDOPUS_GENERIC_PERFORM
+    const char* routines = "generic";
+#else
+    const char* routines = "specialised";
+#endif
+    double perPair = (total - base) / ticks / pairs * 1e9;
+    printf("perform routines: %s\n", routines);
+    printf("%d pairs, %d sample blocks, %g ms frames, %d blocks, fastest of %d runs\n", pairs, blockSize, frameSizeMs, ticks, runs);
+    printf("%10s %14s %14s\n", "", "ns per block", "ns per pair");
+    printf("%10s %14.1f\n", "empty", base / ticks * 1e9);
+    printf("%10s %14.1f %14.1f\n", "pairs", total / ticks * 1e9, perPair);
+    return 0;
+}
+
+static double wallSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void printHook(const char* s)
+{
+    if (strstr(s, "error"))
+    {
+        pdErrors++;
+        fprintf(stderr, "%s", s);
+    }
+}
+
+static int writePatch(const char* name, int pairs, float frameSizeMs)
+{
+    char path[sizeof(patchDir) + 32];
+    snprintf(path, sizeof(path), "%s/%s", patchDir, name);
+    FILE* file = fopen(path, "w");
+    if (!file)
+    {
+        fprintf(stderr, "could not write %s\n", path);
+        return 0;
+    }
+
+    // 0: the signal, 1: the output, 2/3: complexity 0 for every encoder,
+    // then each pair's encoder and decoder
+    fprintf(file, "#N canvas 0 0 600 300 10;\n");
+    fprintf(file, "#X obj 20 20 osc~ 440;\n");
+    fprintf(file, "#X obj 20 200 dac~ 1;\n");
+    fprintf(file, "#X obj 200 20 loadbang;\n");
+    fprintf(file, "#X msg 200 50 complexity 0;\n");
+    for (int i = 0; i < pairs; ++i)
+    {
+        fprintf(file, "#X obj 20 80 opusenc~ %g;\n", frameSizeMs);
+        fprintf(file, "#X obj 20 140 opusdec~ %g;\n", frameSizeMs);
+    }
+
+    fprintf(file, "#X connect 0 0 1 0;\n");
+    fprintf(file, "#X connect 2 0 3 0;\n");
+    for (int i = 0; i < pairs; ++i)
+    {
+        int encoder = 4 + 2 * i;
+        fprintf(file, "#X connect 0 0 %d 0;\n", encoder);
+        fprintf(file, "#X connect 3 0 %d 0;\n", encoder);
+        fprintf(file, "#X connect %d 0 %d 0;\n", encoder, encoder + 1);
+        fprintf(file, "#X connect %d 0 1 0;\n", encoder + 1);
+    }
+
+    int failed = ferror(file);
+    fclose(file);
+    if (failed)
+        fprintf(stderr, "could not write %s\n", path);
+    return !failed;
+}
+
+// the fastest of the runs, in seconds; -1 if the patch won't open
+static double timePatch(const char* name, int ticks, int runs)
+{
+    void* patch = libpd_openfile(name, patchDir);
+    if (!patch)
+        return -1;
+
+    libpd_start_message(1);
+    libpd_add_float(1);
+    libpd_finish_message("pd", "dsp");
+
+    // the decoders only take their fast path once frames are decoded
+    float* output = (float*)calloc(libpd_blocksize() * OUTPUT_CHANNELS, sizeof(float));
+    for (int tick = 0; tick < WARMUP_TICKS; ++tick)
+        libpd_process_float(1, 0, output);
+
+    double fastest = -1;
+    for (int run = 0; run < runs; ++run)
+    {
+        double start = wallSeconds();
+        for (int tick = 0; tick < ticks; ++tick)
+            libpd_process_float(1, 0, output);
+        double elapsed = wallSeconds() - start;
+        if (fastest < 0 || elapsed < fastest)
+            fastest = elapsed;
+    }
+
+    libpd_start_message(1);
+    libpd_add_float(0);
+    libpd_finish_message("pd", "dsp");
+    libpd_closefile(patch);
+    free(output);
+    return fastest;
+}
+
+static void removePatches()
+{
+    char path[sizeof(patchDir) + 32];
+    snprintf(path, sizeof(path), "%s/%s", patchDir, basePatchName);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/%s", patchDir, pairPatchName);
+    unlink(path);
+    rmdir(patchDir);
+}
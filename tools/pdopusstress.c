@@ -0,0 +1,382 @@
+#include "z_libpd.h"
+#include "codecpool.h"
+#include "opustrace.h"
+#include "packetfec.h"
+#include <opus.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SAMPLE_RATE 48000
+#define OUTPUT_CHANNELS 2
+#define MAX_THREADS 64
+#define WARMUP_TICKS 200
+#define MIN_OUTPUT_RMS 0.05
+
+/* Runs one libpd instance per thread, built with PDINSTANCE/PDTHREADS and
+   linked with every object the way the pdopus library is, and checks the
+   process-wide state they share: the codec pool (patches are opened and
+   closed over and over, so encoder and decoder states move between
+   instances), the packet bus class (each patch attaches an encoder and a
+   decoder to a bus), the FEC tables (set up by all threads at once) and,
+   while a trace is running, the per-thread trace rings. Each patch
+   encodes a sine through [opusfecenc]/[opusfecdec] on one channel and
+   through the packet bus on the other; silence, a Pd error or a codec
+   state that isn't returned to the pool fails the run. The throughput of
+   1, 2, 4... threads shows how well the instances scale. */
+
+typedef struct _instance
+{
+    t_pdinstance* _pd;
+    pthread_t _thread;
+    int _rounds;
+    int _ticks;
+    double _minRms;
+    int _failed;
+} Instance;
+
+static const char* patchText =
+    "#N canvas 0 0 600 300 10;\n"
+    "#X obj 20 20 osc~ 440;\n"
+    "#X obj 20 50 opusenc~ 10;\n"
+    "#X obj 20 80 opusfecenc 4 1;\n"
+    "#X obj 20 110 opusfecdec 1;\n"
+    "#X obj 20 140 opusdec~ 10;\n"
+    "#X obj 200 50 opusenc~ 20;\n"
+    "#X obj 200 140 opusdec~ 20;\n"
+    "#X obj 20 200 dac~ 1 2;\n"
+    "#X msg 200 20 send stress;\n"
+    "#X msg 300 110 receive stress;\n"
+    "#X obj 300 20 loadbang;\n"
+    "#X connect 0 0 1 0;\n"
+    "#X connect 0 0 5 0;\n"
+    "#X connect 1 0 2 0;\n"
+    "#X connect 2 0 3 0;\n"
+    "#X connect 3 0 4 0;\n"
+    "#X connect 4 0 7 0;\n"
+    "#X connect 6 0 7 1;\n"
+    "#X connect 8 0 5 0;\n"
+    "#X connect 9 0 6 0;\n"
+    "#X connect 10 0 8 0;\n"
+    "#X connect 10 0 9 0;\n";
+
+static char patchDir[256];
+static const char* patchName = "pdopusstress.pd";
+static _Atomic int pdErrors;
+static pthread_barrier_t fecBarrier;
+
+void pdopus_setup();
+
+static void usage();
+static double wallSeconds();
+static void printHook(const char* s);
+static int writePatch();
+static void* fecInitThread(void* arg);
+static int checkFecTables();
+static void* instanceThread(void* arg);
+static int runThreads(Instance* instances, int count, double* seconds);
+static int checkCodecPool();
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: pdopusstress [options]\n"
+            "\n"
+            "Runs one libpd instance per thread, each encoding and decoding through\n"
+            "every shared part of pdopus, and prints how the throughput scales.\n"
+            "\n"
+            "  -threads N    largest number of threads (default: the number of CPUs)\n"
+            "  -seconds S    audio processed per patch (default: 2)\n"
+            "  -rounds R     times each thread opens and closes its patch (default: 4)\n"
+            "  -trace file   trace all threads into file while running\n");
+}
+
+int main(int argc, char** argv)
+{
+    int maxThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    float seconds = 2;
+    int rounds = 4;
+    const char* tracePath = 0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+            maxThreads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-seconds") && i + 1 < argc)
+            seconds = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-rounds") && i + 1 < argc)
+            rounds = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-trace") && i + 1 < argc)
+            tracePath = argv[++i];
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+
+    if (maxThreads < 1 || maxThreads > MAX_THREADS || seconds <= 0 || rounds < 1)
+    {
+        usage();
+        return 2;
+    }
+
+    if (!writePatch())
+        return 1;
+
+    // the FEC tables are built lazily by whichever thread gets there first
+    pthread_t fecThreads[MAX_THREADS];
+    pthread_barrier_init(&fecBarrier, 0, maxThreads);
+    for (int i = 0; i < maxThreads; ++i)
+        pthread_create(&fecThreads[i], 0, fecInitThread, 0);
+    for (int i = 0; i < maxThreads; ++i)
+        pthread_join(fecThreads[i], 0);
+    pthread_barrier_destroy(&fecBarrier);
+    int failed = !checkFecTables();
+
+    // classes are set up once and reach the instances created afterwards
+    libpd_set_printhook(printHook);
+    libpd_init();
+    pdopus_setup();
+
+    Instance instances[MAX_THREADS];
+    for (int i = 0; i < maxThreads; ++i)
+    {
+        instances[i]._pd = libpd_new_instance();
+        libpd_set_instance(instances[i]._pd);
+        libpd_set_printhook(printHook);
+        libpd_init_audio(0, OUTPUT_CHANNELS, SAMPLE_RATE);
+        instances[i]._rounds = rounds;
+        instances[i]._ticks = (int)(seconds * SAMPLE_RATE / libpd_blocksize());
+    }
+
+#ifdef PDOPUS_TRACE
+    // the runs start about twice as many threads in all, and a ring
+    // stays with the thread that claimed it
+    if (tracePath)
+        opusTraceReserve(2 * maxThreads);
+    if (tracePath && !opusTraceFile(tracePath))
+    {
+        fprintf(stderr, "could not open trace file %s\n", tracePath);
+        return 1;
+    }
+#else
+    if (tracePath)
+        fprintf(stderr, "built without PDOPUS_TRACE, not tracing\n");
+#endif
+
+    printf("%7s %10s %12s %8s %8s\n", "threads", "seconds", "audio x rt", "speedup", "min rms");
+    double singleRate = 0;
+    for (int count = 1; count <= maxThreads; count = count < maxThreads && count * 2 > maxThreads ? maxThreads : count * 2)
+    {
+        double elapsed = 0;
+        failed |= !runThreads(instances, count, &elapsed);
+
+        double minRms = 1;
+        for (int i = 0; i < count; ++i)
+            minRms = instances[i]._minRms < minRms ? instances[i]._minRms : minRms;
+
+        double rate = count * rounds * seconds / elapsed;
+        if (count == 1)
+            singleRate = rate;
+        printf("%7d %10.3f %12.1f %8.2f %8.3f\n", count, elapsed, rate, rate / singleRate, minRms);
+        fflush(stdout);
+    }
+
+#ifdef PDOPUS_TRACE
+    if (tracePath)
+    {
+        opusTraceFile(0);
+        if (opusTraceDropped())
+            printf("trace: %d span(s) dropped\n", opusTraceDropped());
+    }
+#endif
+
+    for (int i = 0; i < maxThreads; ++i)
+        libpd_free_instance(instances[i]._pd);
+
+    failed |= !checkCodecPool();
+    if (atomic_load(&pdErrors))
+    {
+        fprintf(stderr, "%d error(s) posted by Pd\n", atomic_load(&pdErrors));
+        failed = 1;
+    }
+
+    char path[sizeof(patchDir) + 32];
+    snprintf(path, sizeof(path), "%s/%s", patchDir, patchName);
+    unlink(path);
+    rmdir(patchDir);
+
+    printf("%s\n", failed ? "FAILED" : "ok");
+    return failed;
+}
+
+static double wallSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void printHook(const char* s)
+{
+    if (strstr(s, "error"))
+    {
+        atomic_fetch_add(&pdErrors, 1);
+        fprintf(stderr, "%s", s);
+    }
+}
+
+static int writePatch()
+{
+    snprintf(patchDir, sizeof(patchDir), "%s/pdopusstressXXXXXX", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+    if (!mkdtemp(patchDir))
+    {
+        fprintf(stderr, "could not create a directory for the test patch\n");
+        return 0;
+    }
+
+    char path[sizeof(patchDir) + 32];
+    snprintf(path, sizeof(path), "%s/%s", patchDir, patchName);
+    FILE* file = fopen(path, "w");
+    if (!file || fputs(patchText, file) < 0)
+    {
+        fprintf(stderr, "could not write %s\n", path);
+        if (file)
+            fclose(file);
+        return 0;
+    }
+    fclose(file);
+    return 1;
+}
+
+static void* fecInitThread(void* arg)
+{
+    pthread_barrier_wait(&fecBarrier);
+    packetFecInit();
+    return 0;
+}
+
+static int checkFecTables()
+{
+    // a torn initialisation leaves entries that don't invert each other
+    for (int a = 1; a < 256; ++a)
+    {
+        if (gfExp[gfLog[a]] != a || gfMul(a, gfInverse(a)) != 1)
+        {
+            fprintf(stderr, "FEC tables are inconsistent at %d\n", a);
+            return 0;
+        }
+    }
+    for (int s = 0; s < PACKETFEC_MAX_DATA; ++s)
+    {
+        if (fecCoefficients[0][s] != 1)
+        {
+            fprintf(stderr, "FEC parity row 0 is not all ones at column %d\n", s);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void* instanceThread(void* arg)
+{
+    Instance* instance = (Instance*)arg;
+    int blockSize = libpd_blocksize();
+    float* output = (float*)calloc(blockSize * OUTPUT_CHANNELS, sizeof(float));
+
+    libpd_set_instance(instance->_pd);
+    instance->_minRms = 1;
+    instance->_failed = 0;
+
+    for (int round = 0; round < instance->_rounds; ++round)
+    {
+        void* patch = libpd_openfile(patchName, patchDir);
+        if (!patch)
+        {
+            instance->_failed = 1;
+            break;
+        }
+
+        libpd_start_message(1);
+        libpd_add_float(1);
+        libpd_finish_message("pd", "dsp");
+
+        // the first frames are the decoders' start up and the FEC delay
+        double power[OUTPUT_CHANNELS] = { 0 };
+        int counted = 0;
+        for (int tick = 0; tick < instance->_ticks; ++tick)
+        {
+            libpd_process_float(1, 0, output);
+            if (tick < WARMUP_TICKS)
+                continue;
+            for (int i = 0; i < blockSize; ++i)
+                for (int c = 0; c < OUTPUT_CHANNELS; ++c)
+                    power[c] += output[i * OUTPUT_CHANNELS + c] * output[i * OUTPUT_CHANNELS + c];
+            counted += blockSize;
+        }
+
+        for (int c = 0; c < OUTPUT_CHANNELS && counted; ++c)
+        {
+            double rms = sqrt(power[c] / counted);
+            if (rms < instance->_minRms)
+                instance->_minRms = rms;
+        }
+
+        libpd_start_message(1);
+        libpd_add_float(0);
+        libpd_finish_message("pd", "dsp");
+        libpd_closefile(patch);
+    }
+
+    if (instance->_minRms < MIN_OUTPUT_RMS)
+        instance->_failed = 1;
+
+    free(output);
+    return 0;
+}
+
+static int runThreads(Instance* instances, int count, double* seconds)
+{
+    double start = wallSeconds();
+    for (int i = 0; i < count; ++i)
+        pthread_create(&instances[i]._thread, 0, instanceThread, &instances[i]);
+
+    int failed = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        pthread_join(instances[i]._thread, 0);
+        if (instances[i]._failed)
+        {
+            fprintf(stderr, "instance %d of %d failed (output rms %g)\n", i, count, instances[i]._minRms);
+            failed = 1;
+        }
+    }
+    *seconds = wallSeconds() - start;
+    return !failed;
+}
+
+static int checkCodecPool()
+{
+    // every patch is closed, so every pooled state must be back
+    int inUse, allocated;
+    codecPoolUsage(opus_encoder_get_size(1), &inUse, &allocated);
+    if (inUse)
+    {
+        fprintf(stderr, "codec pool: %d of %d encoder states still in use\n", inUse, allocated);
+        return 0;
+    }
+
+    codecPoolUsage(opus_decoder_get_size(1), &inUse, &allocated);
+    if (inUse)
+    {
+        fprintf(stderr, "codec pool: %d of %d decoder states still in use\n", inUse, allocated);
+        return 0;
+    }
+    return 1;
+}